@@ -0,0 +1,464 @@
+/*
+    Benchmarks for the synthesizer, headless.
+
+    Measures what the sound costs, from the single oscillator up to the full
+    block loop, and prints the results as JSON so runs from different
+    versions can be compared:
+
+      oscillators   ns per sample of every OSC_* type, through the original
+                    osc(), and through each SIMD kernel set this CPU runs
+      envelope      ns per sample of sEnvelopeADSR::GetAmplitude(), of the
+                    time-based ApplyEnvelope() and of sEnvelopeGenerator
+      modulation    ns per sample a wavetable LFO adds, at audio rate and
+                    at control rate with linear and cubic interpolation
+      presets       ns per voice-sample of every preset, and how many voices
+                    one core can keep up with at 44.1, 48 and 96 kHz, and
+                    the speedup of its compiled patch over the generic path
+      graph         ns per sample of a patch graph built like the Hip Hop Bell
+                    preset, with a tremolo LFO and a filter, through sGraphEngine
+      convert       ns per sample of turning a float block into int16,
+                    int24, int32 and float32 output, with and without dither
+      effects       ns per stereo frame of each post-mix effect: biquad,
+                    state variable filter, delay and a 1.5 s convolution
+                    reverb at two partition sizes
+      block_loop    realtime factor of olcNoiseMaker's block loop, rendering
+                    16 voices into the null backend as fast as it can, in
+                    mono and panned across a stereo output
+
+    Build and run:
+      g++ -std=c++14 -O2 -pthread bench.cpp -o bench
+      ./bench [--quick] > results.json
+*/
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstring>
+
+using namespace std;
+
+#include "olcNoiseMaker.h"
+#include "synth.h"
+#include "synthWavetable.h"
+#include "synthSimd.h"
+#include "synthVoices.h"
+#include "synthEvents.h"
+#include "synthPresets.h"
+#include "synthGraph.h"
+#include "synthEffects.h"
+
+double dMinSeconds = 0.2;   // Shortest timed run; --quick lowers it
+volatile float fSink;       // Keeps results alive so the work is not optimized away
+
+// Best of five timed runs of func(), each repeated for at least dMinSeconds,
+// in ns per sample. func() renders nSamples samples per call.
+template<class FUNC>
+double NsPerSample(size_t nSamples, FUNC func)
+{
+    func();
+
+    double dBest = 1e30;
+    for (int nRun = 0; nRun < 5; nRun++)
+    {
+        size_t nCalls = 0;
+        auto tStart = chrono::steady_clock::now();
+        double dElapsed = 0.0;
+        do
+        {
+            func();
+            nCalls++;
+            dElapsed = chrono::duration<double>(chrono::steady_clock::now() - tStart).count();
+        } while (dElapsed < dMinSeconds / 5.0);
+
+        dBest = min(dBest, dElapsed * 1e9 / (double)(nCalls * nSamples));
+    }
+    return dBest;
+}
+
+string Number(double d)
+{
+    ostringstream s;
+    s.precision(4);
+    s << d;
+    return s.str();
+}
+
+// ns per sample of every oscillator type
+string BenchOscillators()
+{
+    const size_t nBlock = 512;
+    const double dSampleRate = 44100.0;
+    vector<float> vOut(nBlock);
+
+    vector<const sSimdKernels*> vKernels;
+    for (int nLevel = SIMD_SCALAR; nLevel <= DetectSimdLevel(); nLevel++)
+        vKernels.push_back(&SimdKernelsFor(nLevel));
+
+    ostringstream s;
+    s << "{";
+    for (int nType = OSC_SINE; nType <= OSC_BROWN_NOISE; nType++)
+    {
+        s << (nType > 0 ? "," : "") << "\n    \"" << sOscNames[nType] << "\": { ";
+
+        double dTime = 0.0;
+        s << "\"osc\": " << Number(NsPerSample(nBlock, [&]()
+        {
+            float fSum = 0.0f;
+            for (size_t n = 0; n < nBlock; n++, dTime += 1.0 / dSampleRate)
+                fSum += (float)osc(dTime, 220.0, nType, 5.0, 0.01);
+            fSink = fSum;
+        }));
+
+        for (const sSimdKernels* k : vKernels)
+        {
+            sOscillator osc;
+            osc.Set(220.0, dSampleRate, nType, 5.0, 0.01);
+            s << ", \"oscillator_" << k->sName << "\": " << Number(NsPerSample(nBlock, [&]()
+            {
+                k->RenderOscillator(osc, vOut.data(), nBlock, 1.0f);
+                fSink = vOut[0];
+            }));
+
+            sWavetableOscillator table;
+            table.Set(220.0, dSampleRate, nType, 5.0, 0.01);
+            s << ", \"wavetable_" << k->sName << "\": " << Number(NsPerSample(nBlock, [&]()
+            {
+                k->RenderWavetable(table, vOut.data(), nBlock, 1.0f);
+                fSink = vOut[0];
+            }));
+        }
+        s << " }";
+    }
+    s << "\n  }";
+    return s.str();
+}
+
+// ns per sample of the envelope, per sample and per block
+string BenchEnvelope()
+{
+    const size_t nBlock = 512;
+    const double dTimeStep = 1.0 / 44100.0;
+    vector<float> vOut(nBlock, 1.0f);
+
+    sEnvelopeADSR env;
+    env.NoteOn(0.0);
+
+    // Times loop over the first two seconds so every stage gets its share
+    double dTime = 0.0;
+    double dPerSample = NsPerSample(nBlock, [&]()
+    {
+        float fSum = 0.0f;
+        for (size_t n = 0; n < nBlock; n++, dTime += dTimeStep)
+            fSum += (float)env.GetAmplitude(dTime);
+        if (dTime > 2.0) dTime = 0.0;
+        fSink = fSum;
+    });
+
+    dTime = 0.0;
+    double dPerBlock = NsPerSample(nBlock, [&]()
+    {
+        ApplyEnvelope(env, vOut.data(), nBlock, dTime, dTimeStep);
+        dTime += nBlock * dTimeStep;
+        if (dTime > 2.0) dTime = 0.0;
+        fSink = vOut[0];
+    });
+
+    // The stage machine, retriggered every two seconds and released half way
+    sEnvelopeGenerator gen;
+    size_t nFrame = 0;
+    double dGenerator = NsPerSample(nBlock, [&]()
+    {
+        if (nFrame == 0) gen.NoteOn(env, 44100.0);
+        if (nFrame == 44100) gen.NoteOff(env, 44100.0);
+        ApplyEnvelope(gen, env, 44100.0, vOut.data(), nBlock);
+        nFrame = nFrame + nBlock >= 88200 ? 0 : nFrame + nBlock;
+        fSink = vOut[0];
+    });
+
+    return "{ \"get_amplitude\": " + Number(dPerSample) + ", \"apply_envelope\": " + Number(dPerBlock)
+        + ", \"generator\": " + Number(dGenerator) + " }";
+}
+
+// Cost of the LFO on top of a plain wavetable sine, with the kernels in use,
+// for several control periods
+string BenchModulation()
+{
+    const size_t nBlock = 512;
+    const double dSampleRate = 44100.0;
+    vector<float> vOut(nBlock);
+    const sSimdKernels& kernels = SimdKernels();
+
+    auto Time = [&](double dLFOAmplitude, int nPeriod, int nInterpolation)
+    {
+        sWavetableOscillator osc;
+        osc.Set(220.0, dSampleRate, OSC_SINE, 5.0, dLFOAmplitude);
+        osc.nModPeriod = nPeriod;
+        osc.nModInterpolation = nInterpolation;
+        return NsPerSample(nBlock, [&]()
+        {
+            kernels.RenderWavetable(osc, vOut.data(), nBlock, 1.0f);
+            fSink = vOut[0];
+        });
+    };
+
+    double dPlain = Time(0.0, 1, MOD_LINEAR);
+    double dAudioRate = Time(0.01, 1, MOD_LINEAR) - dPlain;
+
+    ostringstream s;
+    s << "{ \"unmodulated\": " << Number(dPlain) << ", \"lfo_audio_rate\": " << Number(dAudioRate);
+    for (int nPeriod : { 8, 32, 128 })
+    {
+        double dLinear = Time(0.01, nPeriod, MOD_LINEAR) - dPlain;
+        double dCubic = Time(0.01, nPeriod, MOD_CUBIC) - dPlain;
+        s << ", \"lfo_linear_" << nPeriod << "\": " << Number(dLinear) << ", \"lfo_cubic_" << nPeriod << "\": " << Number(dCubic);
+    }
+    s << " }";
+    return s.str();
+}
+
+// ns per sample of turning a float block into each output type, against the
+// per-sample clip() and cast olcNoiseMaker used before
+string BenchConvert()
+{
+    const size_t nBlock = 512;
+    vector<float> vIn(nBlock);
+    for (size_t n = 0; n < nBlock; n++)
+        vIn[n] = 1.2f * (float)sin(0.05 * (double)n);
+
+    vector<short> v16(nBlock);
+    vector<olcInt24> v24(nBlock);
+    vector<int32_t> v32(nBlock);
+    vector<float> vFloat(nBlock);
+    olcSampleConverter plain, dithered(true);
+
+    double dPerSample = NsPerSample(nBlock, [&]()
+    {
+        const double dMax = 32767.0;
+        for (size_t n = 0; n < nBlock; n++)
+        {
+            double d = vIn[n];
+            d = d >= 0.0 ? fmin(d, 1.0) : fmax(d, -1.0);
+            v16[n] = (short)(d * dMax);
+        }
+        fSink = v16[1];
+    });
+
+    ostringstream s;
+    s << "{ \"per_sample_int16\": " << Number(dPerSample)
+      << ", \"int16\": " << Number(NsPerSample(nBlock, [&]() { plain.Convert(vIn.data(), v16.data(), nBlock); fSink = v16[1]; }))
+      << ", \"int16_dither\": " << Number(NsPerSample(nBlock, [&]() { dithered.Convert(vIn.data(), v16.data(), nBlock); fSink = v16[1]; }))
+      << ", \"int24\": " << Number(NsPerSample(nBlock, [&]() { plain.Convert(vIn.data(), v24.data(), nBlock); fSink = v24[1].b[0]; }))
+      << ", \"int24_dither\": " << Number(NsPerSample(nBlock, [&]() { dithered.Convert(vIn.data(), v24.data(), nBlock); fSink = v24[1].b[0]; }))
+      << ", \"int32\": " << Number(NsPerSample(nBlock, [&]() { plain.Convert(vIn.data(), v32.data(), nBlock); fSink = (float)v32[1]; }))
+      << ", \"float32\": " << Number(NsPerSample(nBlock, [&]() { plain.Convert(vIn.data(), vFloat.data(), nBlock); fSink = vFloat[1]; }))
+      << " }";
+    return s.str();
+}
+
+// ns per stereo frame of each effect, run on 512-frame blocks of noise
+string BenchEffects()
+{
+    const size_t nBlock = 512;
+    const double dSampleRate = 44100.0;
+    vector<float> vNoise(2 * nBlock), vLeft(nBlock), vRight(nBlock);
+    float* ppChannels[2] = { vLeft.data(), vRight.data() };
+    sRandom random(1);
+    for (float& f : vNoise)
+        f = 0.1f * random.Bipolar();
+
+    auto time = [&](sEffect& effect)
+    {
+        return NsPerSample(nBlock, [&]()
+        {
+            memcpy(vLeft.data(), vNoise.data(), nBlock * sizeof(float));
+            memcpy(vRight.data(), vNoise.data() + nBlock, nBlock * sizeof(float));
+            effect.Process(ppChannels, 2, nBlock);
+            fSink = vLeft[1];
+        });
+    };
+
+    sBiquadEffect biquad(BIQUAD_PEAK, 1000.0, 1.0, 6.0, dSampleRate);
+    sStateVariableEffect svf(SVF_LOWPASS, 2000.0, 0.7, dSampleRate);
+    sDelayEffect delay(1.0, dSampleRate);
+    vector<float> vImpulse = MakeReverbImpulse(1.5, dSampleRate);
+    sConvolutionReverb reverb256(vImpulse, 2, 256);
+    sConvolutionReverb reverb1024(vImpulse, 2, 1024);
+
+    ostringstream s;
+    s << "{ \"biquad\": " << Number(time(biquad))
+      << ", \"svf\": " << Number(time(svf))
+      << ", \"delay\": " << Number(time(delay))
+      << ", \"reverb_256\": " << Number(time(reverb256))
+      << ", \"reverb_1024\": " << Number(time(reverb1024))
+      << " }";
+    return s.str();
+}
+
+// ns per voice-sample of a preset, 32 voices held in sustain
+double PresetNs(const sPreset& preset, double dSampleRate)
+{
+    const size_t nBlock = 512;
+    const size_t nVoices = 32;
+    vector<float> vOut(nBlock);
+
+    sVoiceManager voices(nVoices, nBlock);
+    voices.pPreset = &preset;
+    voices.dSampleRate = dSampleRate;
+    voices.envelope.dSustainAmplitude = 0.8;
+    for (size_t v = 0; v < nVoices; v++)
+        voices.NoteOn((int)v, 110.0 * pow(2.0, v / 12.0), 0.0);
+
+    // Play a second first, past attack and decay
+    for (size_t n = 0; n < (size_t)dSampleRate; n += nBlock)
+        voices.Render(vOut.data(), nBlock);
+
+    return NsPerSample(nBlock * nVoices, [&]()
+    {
+        memset(vOut.data(), 0, nBlock * sizeof(float));
+        voices.Render(vOut.data(), nBlock);
+        fSink = vOut[0];
+    });
+}
+
+// Cost of one voice of every preset and the voices one core can render in
+// realtime, through its compiled patch loop. At 44.1 kHz the same preset is
+// also timed through the generic per-partial path for comparison.
+string BenchPresets()
+{
+    const double dRates[] = { 44100.0, 48000.0, 96000.0 };
+
+    ostringstream s;
+    s << "[";
+    for (int p = 0; p < nPresetCount; p++)
+    {
+        s << (p > 0 ? "," : "") << "\n    { \"name\": \"" << presets[p].sName << "\"";
+
+        double dPatchNs = 0.0;
+        for (double dSampleRate : dRates)
+        {
+            double dNs = PresetNs(presets[p], dSampleRate);
+            if (dSampleRate == 44100.0)
+                dPatchNs = dNs;
+
+            int nRate = (int)dSampleRate;
+            s << ", \"ns_per_voice_sample_" << nRate << "\": " << Number(dNs)
+              << ", \"voices_per_core_" << nRate << "\": " << (long long)(1e9 / (dNs * dSampleRate));
+        }
+
+        sPreset generic = presets[p];
+        generic.RenderPatch = nullptr;
+        double dGenericNs = PresetNs(generic, 44100.0);
+        s << ", \"generic_ns_per_voice_sample_44100\": " << Number(dGenericNs)
+          << ", \"patch_speedup_44100\": " << Number(dGenericNs / dPatchNs) << " }";
+    }
+    s << "\n  ]";
+    return s.str();
+}
+
+// A runtime patch graph: the Hip Hop Bell partials as oscillator nodes,
+// mixed, through a tremolo, a low-pass filter and an envelope
+string BenchGraph()
+{
+    const size_t nBlock = 512;
+    const double dSampleRate = 44100.0;
+    vector<float> vOut(nBlock);
+
+    sPatchGraph graph;
+    int nMixer = graph.AddMixer();
+    const sPreset& bell = presets[5];
+    for (int p = 0; p < bell.nPartials; p++)
+        graph.Connect(graph.AddOscillator(bell.partials[p].nType, bell.partials[p].dRatio), nMixer, p, bell.partials[p].dAmplitude);
+    int nTremolo = graph.AddMultiply(nMixer, graph.AddLFO(OSC_SINE, 5.0, 0.3, 1.0));
+    int nFilter = graph.AddFilter(FILTER_LOWPASS, 2000.0, nTremolo);
+    graph.SetOutput(graph.AddEnvelope(sEnvelopeADSR(), nFilter));
+
+    unique_ptr<sCompiledGraph> pCompiled = graph.Compile(dSampleRate, nBlock);
+    size_t nSteps = pCompiled->vSteps.size();
+    size_t nBuffers = pCompiled->Buffers();
+
+    sGraphEngine engine;
+    engine.Load(move(pCompiled));
+    engine.NoteOn(220.0, 0.0);
+
+    double dTime = 1.0;
+    double dNs = NsPerSample(nBlock, [&]()
+    {
+        memset(vOut.data(), 0, nBlock * sizeof(float));
+        engine.Render(vOut.data(), nBlock, dTime);
+        dTime += nBlock / dSampleRate;
+        fSink = vOut[0];
+    });
+
+    return "{ \"nodes\": " + to_string(nSteps) + ", \"buffers\": " + to_string(nBuffers) + ", \"ns_per_sample\": " + Number(dNs) + " }";
+}
+
+// Block loop: 16 voices of the default preset rendered and converted by
+// olcNoiseMaker into the null backend, with no pacing. In stereo the voices
+// are spread across the field and interleaved.
+sVoiceManager benchVoices(16, 512);
+
+void BenchBlock(float* const* ppOut, unsigned int nChannels, size_t nFrames, uint64_t)
+{
+    for (unsigned int c = 0; c < nChannels; c++)
+        memset(ppOut[c], 0, nFrames * sizeof(float));
+    benchVoices.Render(ppOut, nChannels, nFrames);
+    for (unsigned int c = 0; c < nChannels; c++)
+        for (size_t n = 0; n < nFrames; n++)
+            ppOut[c][n] *= 0.05f;
+}
+
+string BenchBlockLoop(unsigned int nChannels)
+{
+    const unsigned int nSampleRate = 44100;
+    benchVoices.pPreset = &presets[5];
+    benchVoices.dSampleRate = nSampleRate;
+    for (int v = 0; v < 16; v++)
+    {
+        benchVoices.dPan = v / 7.5 - 1.0;
+        benchVoices.NoteOn(v, 110.0 * pow(2.0, v / 12.0), 0.0);
+    }
+
+    olcNoiseMaker<short> sound("null:fast", nSampleRate, nChannels, 8, 512);
+    sound.SetBlockFunction(BenchBlock);
+
+    // Time from the first block out, so thread start-up is not counted
+    while (sound.GetFrame() == 0)
+        this_thread::yield();
+    uint64_t nStartFrame = sound.GetFrame();
+    auto tStart = chrono::steady_clock::now();
+
+    this_thread::sleep_for(chrono::duration<double>(dMinSeconds * 5.0));
+
+    uint64_t nFrames = sound.GetFrame() - nStartFrame;
+    double dElapsed = chrono::duration<double>(chrono::steady_clock::now() - tStart).count();
+    sound.Stop();
+
+    double dAudio = (double)nFrames / nSampleRate;
+    return "{ \"voices\": 16, \"channels\": " + to_string(nChannels) + ", \"preset\": \"" + string(presets[5].sName) + "\", \"audio_seconds\": " + Number(dAudio)
+        + ", \"realtime_factor\": " + Number(dAudio / dElapsed) + " }";
+}
+
+int main(int argc, char* argv[])
+{
+    for (int i = 1; i < argc; i++)
+        if (string(argv[i]) == "--quick")
+            dMinSeconds = 0.02;
+
+    WavetableBank();
+
+    cout << "{\n";
+    cout << "  \"simd\": \"" << SimdKernels().sName << "\",\n";
+    cout << "  \"oscillators_ns_per_sample\": " << BenchOscillators() << ",\n";
+    cout << "  \"envelope_ns_per_sample\": " << BenchEnvelope() << ",\n";
+    cout << "  \"modulation_ns_per_sample\": " << BenchModulation() << ",\n";
+    cout << "  \"presets\": " << BenchPresets() << ",\n";
+    cout << "  \"graph\": " << BenchGraph() << ",\n";
+    cout << "  \"convert_ns_per_sample\": " << BenchConvert() << ",\n";
+    cout << "  \"effects_ns_per_frame\": " << BenchEffects() << ",\n";
+    cout << "  \"block_loop\": " << BenchBlockLoop(1) << ",\n";
+    cout << "  \"block_loop_stereo\": " << BenchBlockLoop(2) << "\n";
+    cout << "}" << endl;
+    return 0;
+}
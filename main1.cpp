@@ -1,273 +1,356 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <sstream>
 
 using namespace std;
 
 #include "olcNoiseMaker.h"
-
-// Convert frequency in hertz to angular velocity (radians per second)
-// This is needed because C++ trigonometric functions use radians, not Hz
-// Formula: Angular velocity = 2π × frequency (Hz)
-double w(double dHertz)
+#include "synth.h"
+#include "synthWavetable.h"
+#include "synthSimd.h"
+#include "synthVoices.h"
+#include "synthEvents.h"
+#include "synthOffline.h"
+#include "synthParallel.h"
+#include "synthPresets.h"
+#include "synthEffects.h"
+#include "synthInput.h"
+#include "synthMidiFile.h"
+#include "synthBatch.h"
+#include "synthSampler.h"
+
+const unsigned int nSampleRate = 44100; // Samples per second sent to the sound card
+double dMasterVolume = 0.4; // Only changed by the audio thread, through PARAM_MASTER_VOLUME
+int nPreset = 5; // Index into presets[] of the sound being played, owned by the input thread
+
+
+
+sEngineArena arena; // Holds the engine's memory, so the audio thread never needs the heap
+sVoiceManager voices(128, 512); // Every note being played, all allocated up front, remade from the arena in main()
+sEventQueue events(1024); // Notes and parameter changes from the input thread
+unique_ptr<sVoiceRenderPool> pRenderPool; // Worker threads the voices are shared out to, made in main()
+olcNoiseMaker<short>* pSound = nullptr; // Sound machine the voice counters are reported to, set in main()
+sEffectsBus effects; // Runs over the mix on the audio thread, set up in main()
+sConvolutionReverb* pReverb = nullptr; // Reverb on the effects bus, for PARAM_REVERB_MIX
+unique_ptr<sSampler> pSampler; // Recorded notes given with --sample, streamed from disk, made in main()
+
+// Plays the samples given with --sample, as they were recorded
+const sPreset samplerPreset = { "Sampler", 1, { { 1.0, 1.0, OSC_SAMPLE, 0.0, 0.0 } }, nullptr };
+
+// Called on the audio thread for every event taken off the queue
+void HandleEvent(const sEvent& e)
 {
-    return dHertz * 2.0 * PI;
+    const double dTime = (double)e.nFrame / (double)nSampleRate;
+
+    switch (e.nType)
+    {
+    case EVENT_NOTE_ON:
+        voices.NoteOn(e.nNote, e.dValue, dTime);
+        break;
+
+    case EVENT_NOTE_OFF:
+        voices.NoteOff(e.nNote, dTime);
+        break;
+
+    case EVENT_ALL_NOTES_OFF:
+        voices.AllNotesOff(dTime);
+        break;
+
+    case EVENT_PARAMETER:
+        switch (e.nParam)
+        {
+        case PARAM_PRESET:
+            if ((int)e.dValue >= 0 && (int)e.dValue < nPresetCount)
+                voices.pPreset = &presets[(int)e.dValue];
+            break;
+        case PARAM_MASTER_VOLUME:     dMasterVolume = e.dValue; break;
+        case PARAM_STEAL_POLICY:      voices.nStealPolicy = (int)e.dValue; break;
+        case PARAM_ATTACK_TIME:       voices.envelope.dAttackTime = e.dValue; break;
+        case PARAM_DECAY_TIME:        voices.envelope.dDecayTime = e.dValue; break;
+        case PARAM_SUSTAIN_AMPLITUDE: voices.envelope.dSustainAmplitude = e.dValue; break;
+        case PARAM_RELEASE_TIME:      voices.envelope.dReleaseTime = e.dValue; break;
+        case PARAM_PAN:               voices.dPan = e.dValue; break;
+        case PARAM_REVERB_MIX:
+            if (pReverb != nullptr)
+                pReverb->fWet = (float)e.dValue;
+            break;
+        }
+        break;
+    }
 }
 
-// Define constants for different oscillator types to make code more readable
-#define OSC_SINE 0         // Sine wave - smooth, pure tone
-#define OSC_SQUARE 1
-#define OSC_SAWTOOTH 2    // Square wave - harsh, buzzy sound with odd harmonics
-#define OSC_TRIANGLE 3    // Triangle wave - smoother than square, still with harmonics
-#define OSC_RAMP 4        // 
-#define OSC_PULSE 5      // Digital sawtooth/ramp - similar to analog saw but implemented differently
-#define OSC_NOISE 6      // Noise - random values, useful for percussion or effects
-
-/**
- * Oscillator function that generates different waveforms
- * 
- * @param dHertz - The base frequency of the oscillator in Hz (e.g., 440 for A4 note)
- * @param dTime - The current time in seconds (used to calculate the phase of the wave)
- * @param nType - The type of waveform to generate (uses the OSC_* constants)
- * @param dLFOHertz - Frequency of the Low Frequency Oscillator in Hz (for vibrato/modulation effects)
- * @param dLFOAmplitude - Amount of LFO modulation to apply (0.0 = none, higher values = more)
- * 
- * @return A value between -1.0 and 1.0 representing the amplitude of the waveform at time dTime
- */
-double osc(double dHertz, double dTime, int nType = OSC_SINE, double dLFOHertz = 0.0, double dLFOAmplitude = 0.0)
+// Per-sample version, kept for use with SetUserFunction()
+// It returns a value between -1.0 and 1.0 which is the amplitude of the sound wave
+
+double MakeNoise(double dTime) 
 {
-    // Calculate the frequency with LFO modulation applied
-    // This creates a vibrato effect by slightly varying the frequency over time
-    // The inner sin(w(dLFOHertz) * dTime) oscillates slowly at the LFO frequency
-    // This is then scaled by dLFOAmplitude and the base frequency (dHertz)
-    // The result modulates the phase of the main oscillator
-    double dFreq = sin(w(dHertz) * dTime + dLFOAmplitude * dHertz * sin(w(dLFOHertz) * dTime));
-
-    switch(nType)
+    float fSample = 0.0f;
+    uint64_t nFrame = (uint64_t)llround(dTime * (double)nSampleRate);
+    RenderWithEvents(events, nFrame, 1, HandleEvent, [&](size_t, size_t, uint64_t)
     {
-        case 0: // Sine wave
-            // The simplest and purest waveform with only the fundamental frequency
-            // No harmonics, produces a very clean tone
-            //return sin(w(dHertz) * dTime + 0.01 * dHertz * sin(w(5.0) * dTime)); // Old implementation without variable LFO
-            return sin(dFreq);
-        
-        case 1: // Square wave 
-            // Creates a harsh, buzzy sound rich in odd harmonics
-            // Implemented by checking if the sine wave is positive or negative
-            // and returning either 1.0 or -1.0 accordingly
-            // C++ feature: This uses the ternary operator (condition ? true_value : false_value)
-            return sin(dFreq) > 0.0 ? 1.0 : -1.0;
-        
-        case 2: // Sawtooth wave
-            // Rich in both odd and even harmonics, creates a bright, buzzy sound
-            // The formula creates a ramp that rises and then sharply falls
-            // Implementation steps:
-            // 1. dHertz * dTime creates a linearly increasing value
-            // 2. Add LFO modulation with sin(w(dLFOHertz) * dTime)
-            // 3. Use floor(...+ 0.5) to round to nearest integer
-            // 4. Scale to range -1.0 to 1.0 with the 2.0 * (...) part
-            return (2.0 * (dHertz * dTime + dLFOAmplitude * sin(w(dLFOHertz) * dTime) - floor(dHertz * dTime + dLFOAmplitude * sin(w(dLFOHertz) * dTime) + 0.5)));
-        
-        case 3: // Triangle wave
-            // Smoother than square wave but still contains odd harmonics
-            // Uses arcsin (asin) of a sine wave scaled by 2/PI to create the triangular shape
-            // Math concept: asin() is the inverse of sin(), and scaling shapes the output
-            //return (2.0 * fabs(2.0 * (dHertz * dTime - floor(dHertz * dTime + 0.5))) - 1.0); // Old implementation using absolute value
-            return asin(sin(dFreq) * (2.0 / PI));
-            
-        case 4: // Ramp wave
-            // Similar to sawtooth but with a different implementation
-            // Creates a ramp that rises linearly and then resets
-            // Different from sawtooth: No 0.5 offset in the floor function
-            // LFO modulation is applied to the phase calculation for vibrato effect
-            return (2.0 * (dHertz * dTime + dLFOAmplitude * sin(w(dLFOHertz) * dTime) - floor(dHertz * dTime + dLFOAmplitude * sin(w(dLFOHertz) * dTime))));
-        
-        case 5: // Pulse wave
-            // Similar to square wave but oscillates between 0 and 1 (not -1 and 1)
-            // Often used for retro video game sounds and percussion
-            // Uses the ternary operator to check if the sine wave is positive
-            return (sin(dFreq) > 0.0) ? 1.0 : 0.0;
-        
-        case 6: // Noise wave
-            // Generates random values between -1.0 and 1.0
-            // For noise, we use the LFO to modulate the amplitude rather than frequency
-            // This creates a tremolo effect (volume variation) rather than vibrato (pitch variation)
-            // Implementation steps:
-            // 1. (double)rand() / (double)RAND_MAX generates random value between 0.0 and 1.0
-            // 2. Scale by a value that oscillates with the LFO
-            // 3. Shift to center around zero
-            // C++ feature: Type casting with (double) converts integers to floating point
-            return ((double)rand() / (double)RAND_MAX) * (2.0 + dLFOAmplitude * sin(w(dLFOHertz) * dTime)) - (1.0 + dLFOAmplitude * sin(w(dLFOHertz) * dTime) * 0.5);
-        
-        case 7: // White noise
-            // Another implementation of noise, identical to case 6
-            // Could be modified to implement different noise colors (pink, brown, etc.)
-            // White noise has equal energy per frequency band
-            // Useful for percussion sounds, wind effects, and texture
-            return ((double)rand() / (double)RAND_MAX) * (2.0 + dLFOAmplitude * sin(w(dLFOHertz) * dTime)) - (1.0 + dLFOAmplitude * sin(w(dLFOHertz) * dTime) * 0.5);
-        
-    }
+        voices.Render(&fSample, 1);
+    });
+    return fSample * dMasterVolume;
 }
 
-struct sEnvelopeADSR
+// This function is called by the olcNoiseMaker class to generate a block of sound.
+// The block is cut at the frame of every pending event, so notes start and
+// stop on the exact sample they were scheduled for. Every playing voice is
+// rendered by the SIMD kernels picked for this CPU, spread over the render
+// pool's worker threads, and panned into the channels. The effects bus then
+// runs over the whole block.
+void MakeNoiseBlock(float* const* ppOut, unsigned int nChannels, size_t nFrames, uint64_t nStartFrame)
 {
+    for (unsigned int c = 0; c < nChannels; c++)
+        memset(ppOut[c], 0, nFrames * sizeof(float));
 
-    double dAttackTime; // Time to reach max volume
-    double dDecayTime; // Time to reach sustain level
-    double dStartAmplitude; // Start volume
-    double dSustainAmplitude; // Sustain level 
-    double dReleaseTime; // Time to release sound
-    double dTriggerOnTime;
-    double dTriggerOffTime;
-    bool bNoteOn;
-    
-    sEnvelopeADSR()
+    // one render deadline for the whole block, however many spans it is cut into
+    pRenderPool->BeginBlock(nFrames, voices.dSampleRate);
+    RenderWithEvents(events, nStartFrame, nFrames, HandleEvent, [&](size_t nOffset, size_t nSpan, uint64_t)
     {
-        dAttackTime = 0.100; // 10ms
-        dDecayTime = 0.01; // 100ms
-        dStartAmplitude = 1.0; // 100%
-        dSustainAmplitude = 0.8; // 80%
-        dReleaseTime = 0.200; // 100ms
-        dTriggerOnTime = 0.0;
-        dTriggerOffTime = 0.0;
-        bNoteOn = false;
+        float* ppSpan[nMaxEffectChannels];
+        for (unsigned int c = 0; c < nChannels && c < nMaxEffectChannels; c++)
+            ppSpan[c] = ppOut[c] + nOffset;
+        pRenderPool->Render(voices, ppSpan, nChannels, nSpan);
+    });
 
-    }
+    for (unsigned int c = 0; c < nChannels; c++)
+        for (size_t n = 0; n < nFrames; n++)
+            ppOut[c][n] *= (float)dMasterVolume;
+
+    effects.Process(ppOut, nChannels, nFrames);
+
+    if (pSound != nullptr)
+        pSound->ReportVoices((unsigned int)voices.ActiveVoices(), voices.CostliestVoice());
+}
+
+// One-line summary of the sound machine's realtime health
+void PrintHealth(const olcNoiseHealth& health)
+{
+    cout << "Blocks: " << health.nBlocks
+         << ", render p99: " << health.Percentile(0.99) * 100.0 << "% of budget"
+         << ", slowest: " << health.dMaxRender * 1000.0 << " ms of " << health.dBudget * 1000.0 << " ms"
+         << ", deadline misses: " << health.nDeadlineMisses
+         << ", underruns: " << health.nUnderruns
+         << ", min free blocks: " << health.nMinFreeBlocks
+         << ", voices: " << health.nActiveVoices
+         << ", costliest voice: " << health.dCostliestVoice * 1e6 << " us" << endl;
+}
 
+// Writes vSamples to sFile as sFormat: "16", "24" or "32" bit integers,
+// dithered below 32 bits, or "float"
+bool WriteWavAs(const string& sFile, const vector<float>& vSamples, const string& sFormat)
+{
+    if (sFormat == "24")
+        return WriteWav<olcInt24>(sFile, vSamples, nSampleRate, true);
+    if (sFormat == "32")
+        return WriteWav<int32_t>(sFile, vSamples, nSampleRate);
+    if (sFormat == "float")
+        return WriteWav<float>(sFile, vSamples, nSampleRate);
+    return WriteWav<short>(sFile, vSamples, nSampleRate, true);
+}
+
+// Renders a scripted phrase offline and writes it to sFile: two minutes of
+// rising arpeggios, four notes per beat, a new chord every bar
+int RenderOffline(const string& sFile, unsigned int nThreads, const string& sFormat)
+{
+    const int nChords[4][4] = { { 0, 4, 7, 12 }, { 5, 9, 12, 17 }, { 7, 11, 14, 19 }, { 3, 7, 10, 15 } };
+    const uint64_t nStep = nSampleRate / 8;
 
-    double GetAmplitude(double dTime)
+    vector<sEvent> vEvents;
+    for (uint64_t i = 0; i < 120 * 8; i++)
     {
-        double dAmplitude = 0.0;
-        double dLifeTime = dTime - dTriggerOnTime;
+        int k = nChords[(i / 16) % 4][i % 4] + 12 * (int)((i / 4) % 2);
+        uint64_t nOn = i * nStep;
+        vEvents.push_back(sEvent::NoteOn(k, NoteHertz(nKeyboardBaseNote + k), nOn));
+        vEvents.push_back(sEvent::NoteOff(k, nOn + nStep * 3 / 2));
+    }
 
-        if (bNoteOn)
-        {
-            // Attack phase
-            if (dLifeTime <= dAttackTime)
-            {
-                dAmplitude = (dLifeTime / dAttackTime); // Scale from 0.0 to 1.0
-            }
+    // note offs overlap the next note ons, so put the list back in frame order
+    stable_sort(vEvents.begin(), vEvents.end(), [](const sEvent& a, const sEvent& b) { return a.nFrame < b.nFrame; });
 
-            // Decay phase
-            if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
-            {
-                
-               dAmplitude = ((dLifeTime - dAttackTime) / dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
-            }
+    sOfflineSettings settings;
+    settings.dSampleRate = nSampleRate;
+    settings.nThreads = nThreads;
+    settings.pPresets = presets;
+    settings.nPresetCount = nPresetCount;
+    settings.nPreset = nPreset;
+    settings.envelope = voices.envelope;
+    settings.dMasterVolume = dMasterVolume;
 
-            // Sustain phase
-            if (dLifeTime > (dAttackTime + dDecayTime))
-            {
-                dAmplitude = dSustainAmplitude;
-            }
-        }
-        else
-        {
-            // Release phase
-            dAmplitude = ((dTime - dTriggerOffTime) / dReleaseTime) * (0.0 - dSustainAmplitude) + dSustainAmplitude;
-        }
+    vector<float> vSamples;
+    sOfflineStats stats = OfflineRender(vEvents, settings, vSamples);
 
-        // Ensure amplitude is not negative
-        if (dAmplitude <= 0.0001)
-        {
-            dAmplitude = 0.0;
-        }
+    cout << "Rendered " << stats.nNotes << " notes, " << (double)stats.nFrames / nSampleRate << " s of audio in "
+         << stats.dRenderSeconds << " s on " << stats.nThreads << " threads (" << stats.dRealtimeFactor << "x realtime)" << endl;
 
-        return dAmplitude;
+    if (!WriteWavAs(sFile, vSamples, sFormat))
+    {
+        cout << "Could not write " << sFile << endl;
+        return 1;
     }
+    return 0;
+}
+
+// Preset named sName, by its number or its name, or -1
+int FindPreset(const string& sName)
+{
+    char* pEnd = nullptr;
+    long nNumber = strtol(sName.c_str(), &pEnd, 10);
+    if (!sName.empty() && *pEnd == '\0')
+        return nNumber >= 0 && nNumber < nPresetCount ? (int)nNumber : -1;
+
+    for (int p = 0; p < nPresetCount; p++)
+        if (sName == presets[p].sName)
+            return p;
+    return -1;
+}
 
-    void NoteOn(double dTimeOn)
+// Renders every MIDI file and score in vInputs (or in the directories
+// named there) to a WAV file of the same name in sDirectory, one file per
+// thread, and reports how long each took
+int RenderBatchFiles(const string& sPreset, const string& sDirectory, const vector<string>& vInputs, unsigned int nThreads, const string& sFormat)
+{
+    sBatchSettings settings;
+    settings.dSampleRate = nSampleRate;
+    settings.nThreads = nThreads;
+    settings.pPresets = presets;
+    settings.nPresetCount = nPresetCount;
+    settings.nPreset = FindPreset(sPreset);
+    settings.envelope = voices.envelope;
+    settings.dMasterVolume = dMasterVolume;
+
+    if (settings.nPreset < 0)
     {
-        dTriggerOnTime = dTimeOn;
-        bNoteOn = true;
+        cout << "No preset " << sPreset << ", choose one of:" << endl;
+        for (int p = 0; p < nPresetCount; p++)
+            cout << p << ". " << presets[p].sName << endl;
+        return 1;
     }
 
-    void NoteOff(double dTimeOff)
+    vector<string> vFiles;
+    for (const string& sInput : vInputs)
+        if (!ListScoreFiles(sInput, vFiles))
+            cout << "Cannot read " << sInput << endl;
+
+    if (!MakeDirectory(sDirectory))
     {
-        dTriggerOffTime = dTimeOff;
-        bNoteOn = false;
+        cout << "Cannot make " << sDirectory << endl;
+        return 1;
     }
 
-};
+    vector<sBatchJob> vJobs = BatchJobs(vFiles, sDirectory);
 
-double dFrequencyOutput = 0.0; // Frequency of the sound wave in hertz
-sEnvelopeADSR envelope; // Declare the envelope object
+    cout << "Rendering " << vJobs.size() << " files with " << presets[settings.nPreset].sName << endl;
 
+    vector<sBatchResult> vResults;
+    sBatchStats stats;
+    if (sFormat == "24")
+        stats = RenderBatch<olcInt24>(vJobs, settings, vResults);
+    else if (sFormat == "32")
+    {
+        settings.bDither = false;
+        stats = RenderBatch<int32_t>(vJobs, settings, vResults);
+    }
+    else if (sFormat == "float")
+        stats = RenderBatch<float>(vJobs, settings, vResults);
+    else
+        stats = RenderBatch<short>(vJobs, settings, vResults);
 
+    for (size_t i = 0; i < vJobs.size(); i++)
+    {
+        const sBatchResult& result = vResults[i];
+        if (result.bOk)
+            cout << vJobs[i].sOutput << ": " << result.nEvents << " events, " << (double)result.nFrames / nSampleRate << " s of audio in "
+                 << result.dRenderSeconds << " s (" << result.dRealtimeFactor << "x realtime)" << endl;
+        else
+            cout << result.sError << endl;
+    }
 
-// This function is called by the olcNoiseMaker class to generate sound
-// It returns a value between -1.0 and 1.0 which is the amplitude of the sound wave
+    cout << "Rendered " << stats.nJobs - stats.nFailed << " of " << stats.nJobs << " files, " << stats.dAudioSeconds << " s of audio in "
+         << stats.dWallSeconds << " s on " << stats.nThreads << " threads (" << stats.dFilesPerSecond << " files/s, "
+         << stats.dRealtimeFactor << "x realtime)" << endl;
+    return stats.nFailed > 0 ? 1 : 0;
+}
 
-double MakeNoise(double dTime) 
+// Prints what a key press plays: the preset's partials and the envelope
+void PrintNote(const sEvent& e, const sPreset& preset, const sEnvelopeADSR& envelope, const olcNoiseHealth& health)
 {
-    // Try these different combinations by uncommenting them:
-
-    // 1. Rich pad sound with multiple oscillators
-    // double dOutput = envelope.GetAmplitude(dTime) * 
-    // (   
-    //     + 1.0 * osc(dFrequencyOutput, dTime, OSC_SINE, 2.0, 0.01)      // Main tone
-    //     + 0.5 * osc(dFrequencyOutput * 0.5, dTime, OSC_TRIANGLE, 1.5, 0.02)  // Sub oscillator
-    //     + 0.25 * osc(dFrequencyOutput * 2.0, dTime, OSC_SAWTOOTH, 3.0, 0.005) // High harmonics
-    // ); 
-
-    // 2. Retro game sound
-    
-    // double dOutput = envelope.GetAmplitude(dTime) * 
-    // (   
-    //     + 1.0 * osc(dFrequencyOutput, dTime, OSC_SQUARE, 0.0, 0.0)     // Main tone
-    //     + 0.5 * osc(dFrequencyOutput * 1.5, dTime, OSC_PULSE, 0.0, 0.0) // High harmony
-    // ); 
-    
-
-    // 3. Bass sound
-    
-    // double dOutput = envelope.GetAmplitude(dTime) * 
-    // (   
-    //     + 1.0 * osc(dFrequencyOutput, dTime, OSC_TRIANGLE, 0.0, 0.0)    // Main tone
-    //     + 1.0 * osc(dFrequencyOutput * 1.5, dTime, OSC_TRIANGLE, 0.0, 0.0)
-    //     + 0.5 * osc(dFrequencyOutput * 0.5, dTime, OSC_SINE, 0.0, 0.0)  // Sub bass
-    // ); 
-    
+    cout << "\n=== Sound Information ===" << endl;
+    cout << "Base Frequency: " << e.dValue << " Hz" << endl;
+    cout << "Preset: " << preset.sName << endl;
+    cout << "Note Components:" << endl;
+    for (int p = 0; p < preset.nPartials; p++)
+    {
+        const sPartial& partial = preset.partials[p];
+        cout << (p + 1) << ". " << (e.dValue * partial.dRatio) << " Hz (" << sOscNames[partial.nType] << ")" << endl;
+    }
+    cout << "Envelope Settings:" << endl;
+    cout << "- Attack: " << envelope.dAttackTime * 1000 << " ms" << endl;
+    cout << "- Decay: " << envelope.dDecayTime * 1000 << " ms" << endl;
+    cout << "- Sustain: " << envelope.dSustainAmplitude * 100 << "%" << endl;
+    cout << "- Release: " << envelope.dReleaseTime * 1000 << " ms" << endl;
+    PrintHealth(health);
+    cout << "=====================" << endl;
+}
 
-    // 4. Lead sound with vibrato
-    /*
-    double dOutput = envelope.GetAmplitude(dTime) * 
-    (   
-        + 1.0 * osc(dFrequencyOutput, dTime, OSC_SAWTOOTH, 5.0, 0.02)   // Main tone with vibrato
-        + 0.25 * osc(dFrequencyOutput * 2.0, dTime, OSC_SINE, 5.0, 0.02) // High harmony
-    ); 
-    */
-
-    // 5. Ambient pad
-    /*
-    double dOutput = envelope.GetAmplitude(dTime) * 
-    (   
-        + 1.0 * osc(dFrequencyOutput, dTime, OSC_SINE, 0.5, 0.01)      // Main tone
-        + 0.5 * osc(dFrequencyOutput * 1.5, dTime, OSC_SINE, 0.7, 0.01) // Harmony
-        + 0.25 * osc(dFrequencyOutput * 2.0, dTime, OSC_SINE, 0.3, 0.01) // High harmony
-    ); 
-    */
-
-    // 6. Hip Hop Bell
-    
-    double dOutput = envelope.GetAmplitude(dTime) * 
-    (   
-        + 1.0 * osc(dFrequencyOutput, dTime, OSC_TRIANGLE, 0.0, 0.0)     // Main tone
-        + 0.5 * osc(dFrequencyOutput * 1.5, dTime, OSC_TRIANGLE, 0.0, 0.0) // Perfect fifth
-        + 0.25 * osc(dFrequencyOutput * 2.0, dTime, OSC_TRIANGLE, 0.0, 0.0) // Octave up
-        + 0.125 * osc(dFrequencyOutput * 3.0, dTime, OSC_TRIANGLE, 0.0, 0.0) // Octave + fifth
-    ); 
-    
-    
-    return dOutput * 0.4; // MASTER VOLUME
+// Score of the demo phrase played when there is no keyboard: a rising and
+// falling arpeggio from A2, swept left to right
+string DemoScore()
+{
+    const int nPhrase[] = { 0, 4, 7, 12, 7, 4 };
+    ostringstream score;
+    for (int i = 0; i < 6; i++)
+    {
+        int k = nPhrase[i];
+        score << i * 0.25 << " set pan " << k / 12.0 - 0.5 << "\n";
+        score << i * 0.25 << " on " << nKeyboardBaseNote + k << "\n";
+        score << i * 0.25 + 0.2 << " off " << nKeyboardBaseNote + k << "\n";
+    }
+    return score.str();
 }
 
-int main() 
+int main(int argc, char* argv[]) 
 {
 
     
     cout << "oneloader tutorial - synthesizer part 1" << endl;
 
+    // --input <source>, --threads <n>, --format <f> and --sample <file.wav>
+    // can go anywhere; the other arguments are positional
+    string sInput, sFormat;
+    unsigned int nThreads = 0;
+    vector<string> vArgs, vSamples;
+    for (int i = 1; i < argc; i++)
+    {
+        if (string(argv[i]) == "--input" && i + 1 < argc)
+            sInput = argv[++i];
+        else if (string(argv[i]) == "--threads" && i + 1 < argc)
+            nThreads = (unsigned int)atoi(argv[++i]);
+        else if (string(argv[i]) == "--format" && i + 1 < argc)
+            sFormat = argv[++i];
+        else if (string(argv[i]) == "--sample" && i + 1 < argc)
+            vSamples.push_back(argv[++i]);
+        else
+            vArgs.push_back(argv[i]);
+    }
+
+    // builds the band-limited wavetables before any audio is rendered
+    WavetableBank();
+    cout << "Using " << SimdKernels().sName << " kernels" << endl;
+
+    // --offline <file.wav> [threads] [16|24|32|float] renders without a sound card
+    if (vArgs.size() > 1 && vArgs[0] == "--offline")
+        return RenderOffline(vArgs[1], vArgs.size() > 2 ? (unsigned int)atoi(vArgs[2].c_str()) : nThreads, vArgs.size() > 3 ? vArgs[3] : sFormat);
+
+    // --batch <preset> <out dir> <files or dirs...> renders every score to its own WAV file
+    if (vArgs.size() > 3 && vArgs[0] == "--batch")
+        return RenderBatchFiles(vArgs[1], vArgs[2], vector<string>(vArgs.begin() + 3, vArgs.end()), nThreads, sFormat);
+
     // gets all sound hardware
     vector<string> devices = olcNoiseMaker<short>::Enumerate();
 
@@ -280,63 +363,182 @@ int main()
     // displays findings 
     for (auto d : devices) cout << "Found Output Device: " << d << endl;
 
-    // creates sound machine
-    olcNoiseMaker<short> sound(devices[0], 44100, 1, 16, 512); 
-
-    // links the noise function with sound machine class
-    sound.SetUserFunction(MakeNoise);
+    // the first device is used unless one is named on the command line,
+    // e.g. "null", "wav:out.wav" or "alsa:default"
+    string sDevice = vArgs.size() > 0 ? vArgs[0] : devices[0];
+    cout << "Using Output Device: " << sDevice << endl;
+
+    // everything the audio thread touches is allocated here, from the arena,
+    // before playback starts. The arena is frozen once the sound machine is
+    // running, so anything allocated later is counted as a late allocation.
+    sArenaScope arenaScope(arena);
+    voices = sVoiceManager(128, 512);
+
+    // the audio thread is not running yet, so the voices can be set up directly
+    voices.pPreset = &presets[nPreset];
+    voices.dSampleRate = nSampleRate;
+    voices.nStealPolicy = STEAL_OLDEST;
+
+    // --sample <file.wav>[@note], once per recorded note, plays the samples
+    // instead of a preset. The note is the one the file says it was
+    // recorded at, unless given.
+    if (!vSamples.empty())
+    {
+        pSampler.reset(new sSampler(voices.Capacity()));
+        for (const string& sSample : vSamples)
+        {
+            size_t nAt = sSample.rfind('@');
+            int nRootNote = -1;
+            string sError;
+            if (nAt != string::npos && !NoteNumber(sSample.substr(nAt + 1), nRootNote))
+                nAt = string::npos;
+            if (!pSampler->AddSample(sSample.substr(0, nAt), nRootNote, sError))
+            {
+                cout << sError << endl;
+                return 1;
+            }
+        }
+        pSampler->Start();
+        voices.pSampler = pSampler.get();
+        voices.pPreset = &samplerPreset;
+        cout << "Playing " << pSampler->SampleCount() << " samples" << endl;
+    }
 
-    // ====================== BASE-FREQUENCY =====================================
-    double dOctaveBaseFrequency = 110; // First note in the octave (A2 - 110Hertz)
-    double d12thRootOf2 = pow(2.0, 1.0 / 12.0); 
+    pRenderPool.reset(new sVoiceRenderPool(sVoiceRenderPool::DefaultWorkers(), voices.Capacity(), 512));
+    cout << "Rendering voices on " << pRenderPool->Workers() + 1 << " threads" << endl;
 
-    int nCurrentKey = -1; // Add this line before your while loop
+    // a gentle high shelf cut, then a room, both set up before the audio
+    // thread starts
+    effects.Add(unique_ptr<sBiquadEffect>(new sBiquadEffect(BIQUAD_HIGHSHELF, 8000.0, 0.7, -3.0, nSampleRate)));
+    pReverb = effects.Add(unique_ptr<sConvolutionReverb>(new sConvolutionReverb(MakeReverbImpulse(1.5, nSampleRate), 2, 512)));
+    pReverb->fWet = 0.15f;
 
-    while (1)
+    // creates sound machine, in stereo
+    olcNoiseMaker<short> sound(sDevice, nSampleRate, 2, 16, 512); 
+    if (!sound.IsRunning())
     {
-        bool bKeyPressed = false;
+        cout << "Could not open sound device " << sDevice << endl;
+        return 1;
+    }
 
-        for (int k = 0; k < 27; k++)
+    // latency can be given after the device as a block count and block size,
+    // e.g. "4 64" for live play
+    if (vArgs.size() > 2)
+        sound.SetLatency((unsigned int)atoi(vArgs[1].c_str()), (unsigned int)atoi(vArgs[2].c_str()));
+
+    // links the block noise function with sound machine class
+    pSound = &sound;
+    sound.SetBlockFunction(MakeNoiseBlock);
+    arena.Freeze();
+
+    // picks where notes come from: the keyboard, a score, a MIDI file, or
+    // with no keyboard to hand, the demo phrase
+    unique_ptr<sInputSource> pInput;
+    unique_ptr<istream> pScore;
+    bool bKeyboard = false;
+#if defined(_WIN32)
+    if (sInput.empty())
+        sInput = "keys";
+#endif
+
+    if (sInput == "keys")
+    {
+#if defined(_WIN32)
+        sConsoleKeyboard* pKeys = new sConsoleKeyboard();
+        cout << "Play on AZSXDCFVGBHNJMK,L.QWERTYUIO, Esc to quit" << endl;
+#else
+        sTerminalKeyboard* pKeys = new sTerminalKeyboard();
+        cout << "Play on AZSXDCFVGBHNJMK,L.QWERTYUIO, Esc to quit" << endl;
+#endif
+        pKeys->bPanKeys = true;
+        pInput.reset(pKeys);
+        bKeyboard = true;
+    }
+#if defined(__linux__)
+    else if (sInput.compare(0, 6, "evdev:") == 0)
+    {
+        sEvdevKeyboard* pKeys = new sEvdevKeyboard(sInput.substr(6));
+        pInput.reset(pKeys);
+        if (!pKeys->IsOpen())
         {
-            if (GetAsyncKeyState((unsigned char)("AZSXDCFVGBHNJMK\xbcL\xbeQWERTYUIOP"[k])) & 0x8000)
+            cout << "Could not open " << sInput.substr(6) << endl;
+            return 1;
+        }
+        pKeys->bPanKeys = true;
+        bKeyboard = true;
+        cout << "Play on AZSXDCFVGBHNJMK,L.QWERTYUIO, Esc to quit" << endl;
+    }
+#endif
+    else if (sInput.compare(0, 7, "script:") == 0)
+    {
+        string sFile = sInput.substr(7);
+        if (sFile != "-")
+        {
+            pScore.reset(new ifstream(sFile));
+            if (!*pScore)
             {
-                if (nCurrentKey != k)
-                {
-                    dFrequencyOutput = dOctaveBaseFrequency * pow(d12thRootOf2, k);
-                    envelope.NoteOn(sound.GetTime());
-                    nCurrentKey = k;
-
-                    // Display sound information
-                    cout << "\n=== Sound Information ===" << endl;
-                    cout << "Base Frequency: " << dFrequencyOutput << " Hz" << endl;
-                    cout << "Note Components:" << endl;
-                    cout << "1. Main tone: " << dFrequencyOutput << " Hz (Triangle)" << endl;
-                    cout << "2. Perfect fifth: " << (dFrequencyOutput * 1.5) << " Hz (Triangle)" << endl;
-                    cout << "3. Octave up: " << (dFrequencyOutput * 2.0) << " Hz (Triangle)" << endl;
-                    cout << "4. Octave + fifth: " << (dFrequencyOutput * 3.0) << " Hz (Triangle)" << endl;
-                    cout << "Envelope Settings:" << endl;
-                    cout << "- Attack: " << envelope.dAttackTime * 1000 << " ms" << endl;
-                    cout << "- Decay: " << envelope.dDecayTime * 1000 << " ms" << endl;
-                    cout << "- Sustain: " << envelope.dSustainAmplitude * 100 << "%" << endl;
-                    cout << "- Release: " << envelope.dReleaseTime * 1000 << " ms" << endl;
-                    cout << "=====================" << endl;
-                }
-                bKeyPressed = true;
+                cout << "Could not open " << sFile << endl;
+                return 1;
             }
         }
+        pInput.reset(new sScriptSource(sFile == "-" ? cin : *pScore));
+    }
+    else if (sInput.compare(0, 5, "midi:") == 0)
+    {
+        vector<sTimedEvent> vEvents;
+        string sError;
+        if (!LoadMidiFile(sInput.substr(5), vEvents, sError))
+        {
+            cout << sError << endl;
+            return 1;
+        }
+        cout << "Playing " << vEvents.size() << " events from " << sInput.substr(5) << endl;
+        pInput.reset(new sEventListSource(move(vEvents)));
+    }
+    else
+    {
+        cout << "No keyboard input, playing a demo phrase (--input keys to play)" << endl;
+        pScore.reset(new istringstream(DemoScore()));
+        pInput.reset(new sScriptSource(*pScore));
+    }
 
-        if (!bKeyPressed)
+    // this thread sleeps on the input until the source ends, so it costs
+    // nothing while no notes are coming in. The audio thread owns the voice
+    // settings, so what is shown is this thread's copy, kept up to date
+    // from the events pushed; nothing has been pushed yet to change them.
+    const sPreset* pShownPreset = pSampler != nullptr ? &samplerPreset : &presets[nPreset];
+    sEnvelopeADSR shownEnvelope = voices.envelope;
+    uint64_t nLastFrame = PumpInput(*pInput, events, sound, nSampleRate, [&](const sEvent& e)
+    {
+        if (e.nType == EVENT_PARAMETER && e.nParam == PARAM_PRESET && (int)e.dValue >= 0 && (int)e.dValue < nPresetCount)
         {
-            if (nCurrentKey != -1)
+            nPreset = (int)e.dValue;
+            pShownPreset = &presets[nPreset];
+        }
+        if (e.nType == EVENT_PARAMETER)
+        {
+            switch (e.nParam)
             {
-                envelope.NoteOff(sound.GetTime());
-                cout << "\nNote Released" << endl;
-                nCurrentKey = -1;
+            case PARAM_ATTACK_TIME:       shownEnvelope.dAttackTime = e.dValue; break;
+            case PARAM_DECAY_TIME:        shownEnvelope.dDecayTime = e.dValue; break;
+            case PARAM_SUSTAIN_AMPLITUDE: shownEnvelope.dSustainAmplitude = e.dValue; break;
+            case PARAM_RELEASE_TIME:      shownEnvelope.dReleaseTime = e.dValue; break;
             }
         }
-    }
-
-
+        if (bKeyboard && e.nType == EVENT_NOTE_ON)
+            PrintNote(e, *pShownPreset, shownEnvelope, sound.GetHealth());
+    });
+    pInput.reset();
+
+    // let the last notes and the reverb ring out, on the engine clock so
+    // backends faster than realtime finish as soon as they are rendered
+    WaitForFrame(sound, nLastFrame + (uint64_t)((shownEnvelope.dReleaseTime + 1.5) * nSampleRate), nSampleRate);
+    PrintHealth(sound.GetHealth());
+    if (pSampler != nullptr)
+        cout << "Sample frames not streamed in time: " << pSampler->Underruns() << endl;
+    cout << "Engine arena: " << arena.Allocated() / 1024 << " KB used of " << arena.Reserved() / 1024
+         << " KB, late allocations: " << arena.LateAllocations() << endl;
+    PrintRealtimeReport(cout);
 
     return 0;
-}
\ No newline at end of file
+}
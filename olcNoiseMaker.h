@@ -53,23 +53,882 @@
 
 #pragma once
 
+#if defined(_WIN32)
 #pragma comment(lib, "winmm.lib")
-
 #include <Windows.h>  // Must be included before any C++ headers
+#endif
+
+#if defined(OLC_NOISE_ALSA)
+#include <alsa/asoundlib.h>  // Link with -lasound
+#endif
 
 #include <iostream>
 #include <cmath>
+#include <cstring>
 #include <fstream>
 #include <vector>
 #include <string>
 #include <thread>
 #include <atomic>
+#include <mutex>
+#include <memory>
 #include <condition_variable>
 #include <algorithm>
+#include <type_traits>
+#include <cstdint>
+#include <chrono>
+#include <limits>
 using namespace std;
 
+#include "synthRealtime.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OLC_NOISE_SSE2
+#endif
+
 const double PI = 2.0 * acos(0.0);
 
+// Shape of the sample stream a backend is asked to play
+struct olcNoiseFormat
+{
+	unsigned int nSampleRate;
+	unsigned int nChannels;
+	unsigned int nBitsPerSample;
+	bool bFloat;
+};
+
+// Realtime health of the engine, as returned by olcNoiseMaker::GetHealth().
+// Render times cover the user's block function and the conversion to the
+// output type; the budget is the time the block takes to play.
+struct olcNoiseHealth
+{
+	static const int nBuckets = 16;   // Histogram buckets, 1/8 of the budget each; the last also holds anything slower
+
+	uint64_t nBlocks;                 // Blocks rendered
+	uint64_t nDeadlineMisses;         // Blocks that took longer to render than to play
+	uint64_t nUnderruns;              // Times the backend ran out of audio to play
+	unsigned int nMinFreeBlocks;      // Fewest free blocks seen when starting a block
+	double dBudget;                   // Seconds of audio in one block
+	double dLastRender;               // Seconds taken by the latest block
+	double dMaxRender;                // Seconds taken by the slowest block
+	uint64_t nHistogram[nBuckets];    // Blocks by render time as a share of the budget
+	unsigned int nActiveVoices;       // Passed in by the renderer through ReportVoices()
+	double dCostliestVoice;           // Seconds, passed in likewise
+
+	// Share of the budget that fraction dQuantile of blocks rendered within,
+	// to the resolution of the histogram
+	double Percentile(double dQuantile) const
+	{
+		uint64_t nCount = 0;
+		for (int b = 0; b < nBuckets; b++)
+		{
+			nCount += nHistogram[b];
+			if (nCount > 0 && (double)nCount >= dQuantile * (double)nBlocks)
+				return (double)(b + 1) / 8.0;
+		}
+		return (double)nBuckets / 8.0;
+	}
+};
+
+// Audio backends
+// ~~~~~~~~~~~~~~
+// A backend moves finished blocks to wherever the audio is going. The engine
+// owns the block memory and fills one block at a time. It hands each filled
+// block to Submit() and then waits for a free block. The backend must call
+// BlockDone() once for every submitted block it has finished with, in the
+// order they were submitted, from any thread, to give the block back.
+//
+// Open() is given room for the largest latency the engine allows. The engine
+// may change its latency between blocks: Submit() says how many bytes of the
+// block are used, and QueueLimit() is how many blocks the engine keeps in
+// flight.
+//
+// Backends are picked by name with olcNoiseBackend::Create():
+//   "null"          - discards audio, paced by the clock like a sound card
+//   "null:fast"     - discards audio as fast as it can be rendered
+//   "wav:<file>"    - streams to a WAV file as fast as it can be rendered
+//   "alsa:<device>" - ALSA device, when built with OLC_NOISE_ALSA
+//   anything else   - a WinMM device name, as returned by Enumerate() (Windows)
+class olcNoiseBackend
+{
+public:
+	virtual ~olcNoiseBackend() {}
+
+	// pBlockMemory holds nBlockCount blocks of nBlockBytes each and stays
+	// valid until Close()
+	virtual bool Open(const olcNoiseFormat& format, char* pBlockMemory, unsigned int nBlockCount, unsigned int nBlockBytes) = 0;
+	virtual void Submit(unsigned int nBlock, unsigned int nBytes) = 0;
+	// False if the output could not be finished, e.g. a file that failed to write
+	virtual bool Close() = 0;
+
+	// Set by the engine, from its own thread, before it submits
+	virtual void SetQueueLimit(unsigned int nBlocks)
+	{
+		m_nQueueLimit = nBlocks;
+	}
+
+	void SetBlockDoneHandler(void(*func)(void*), void* pContext)
+	{
+		m_blockDone = func;
+		m_pBlockDoneContext = pContext;
+	}
+
+	// Times the device ran out of audio to play. Safe to read from any thread.
+	uint64_t Underruns() const
+	{
+		return m_nUnderruns.load(memory_order_relaxed);
+	}
+
+	static unique_ptr<olcNoiseBackend> Create(const string& sName);
+
+protected:
+	void BlockDone()
+	{
+		if (m_blockDone != nullptr)
+			m_blockDone(m_pBlockDoneContext);
+	}
+
+	unsigned int QueueLimit() const
+	{
+		return m_nQueueLimit;
+	}
+
+	// Called by backends that can tell when the device went dry
+	void Underrun()
+	{
+		m_nUnderruns.fetch_add(1, memory_order_relaxed);
+	}
+
+private:
+	void(*m_blockDone)(void*) = nullptr;
+	void* m_pBlockDoneContext = nullptr;
+	unsigned int m_nQueueLimit = 1;
+	atomic<uint64_t> m_nUnderruns{ 0 };
+};
+
+// Discards every block. When paced, Submit() sleeps so blocks are used up at
+// the rate a sound card holding QueueLimit() blocks would use them, and a
+// block submitted after the one before it would have finished playing counts
+// as an underrun.
+class olcNoiseBackendNull : public olcNoiseBackend
+{
+public:
+	olcNoiseBackendNull(bool bPaced = true)
+	{
+		m_bPaced = bPaced;
+	}
+
+	bool Open(const olcNoiseFormat& format, char* /*pBlockMemory*/, unsigned int nBlockCount, unsigned int /*nBlockBytes*/) override
+	{
+		m_nFrameBytes = format.nChannels * format.nBitsPerSample / 8;
+		m_dSampleRate = (double)format.nSampleRate;
+		m_vPlayEnd.assign(nBlockCount + 1, chrono::steady_clock::time_point());
+		m_nHead = 0;
+		m_nQueued = 0;
+		m_nSubmitted = 0;
+		return true;
+	}
+
+	void Submit(unsigned int /*nBlock*/, unsigned int nBytes) override
+	{
+		m_nSubmitted++;
+		if (!m_bPaced)
+		{
+			BlockDone();
+			return;
+		}
+
+		// Blocks play back to back. One that arrives after the last has
+		// finished starts late, which is an underrun.
+		auto tNow = chrono::steady_clock::now();
+		if (tNow > m_tPlayEnd)
+		{
+			if (m_nSubmitted > 1)
+				Underrun();
+			m_tPlayEnd = tNow;
+		}
+		m_tPlayEnd += chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>((double)(nBytes / m_nFrameBytes) / m_dSampleRate));
+		m_vPlayEnd[(m_nHead + m_nQueued) % m_vPlayEnd.size()] = m_tPlayEnd;
+		m_nQueued++;
+
+		GiveBack();
+	}
+
+	// Nothing else gives blocks back, so a lower limit has to be met here
+	void SetQueueLimit(unsigned int nBlocks) override
+	{
+		olcNoiseBackend::SetQueueLimit(nBlocks);
+		GiveBack();
+	}
+
+	bool Close() override
+	{
+		return true;
+	}
+
+private:
+	bool m_bPaced;
+	unsigned int m_nFrameBytes = 1;
+	double m_dSampleRate = 44100.0;
+	vector<chrono::steady_clock::time_point> m_vPlayEnd;   // When each queued block finishes playing
+	size_t m_nHead = 0;
+	unsigned int m_nQueued = 0;
+	uint64_t m_nSubmitted = 0;
+	chrono::steady_clock::time_point m_tPlayEnd;
+
+	// Gives back every block that has finished playing, waiting for the
+	// oldest while the engine would otherwise have no room
+	void GiveBack()
+	{
+		while (m_nQueued > 0)
+		{
+			auto tEnd = m_vPlayEnd[m_nHead];
+			if (m_nQueued < QueueLimit() && tEnd > chrono::steady_clock::now())
+				break;
+
+			this_thread::sleep_until(tEnd);
+			m_nHead = (m_nHead + 1) % m_vPlayEnd.size();
+			m_nQueued--;
+			BlockDone();
+		}
+	}
+};
+
+// Streams every block to a WAV file. The RIFF sizes are filled in on Close().
+class olcNoiseBackendWav : public olcNoiseBackend
+{
+public:
+	olcNoiseBackendWav(const string& sFile)
+	{
+		m_sFile = sFile;
+	}
+
+	bool Open(const olcNoiseFormat& format, char* pBlockMemory, unsigned int /*nBlockCount*/, unsigned int nBlockBytes) override
+	{
+		m_pBlockMemory = pBlockMemory;
+		m_nBlockBytes = nBlockBytes;
+		m_nDataBytes = 0;
+
+		m_file.open(m_sFile, ios::binary | ios::trunc);
+		if (!m_file.is_open())
+			return false;
+
+		WriteHeader(format, 0);
+		return (bool)m_file;
+	}
+
+	void Submit(unsigned int nBlock, unsigned int nBytes) override
+	{
+		Write(m_pBlockMemory + (size_t)nBlock * m_nBlockBytes, nBytes);
+		BlockDone();
+	}
+
+	// Appends raw sample data, for writers that do not work in whole blocks.
+	// False once anything written to the file has failed, e.g. a full disk.
+	bool Write(const char* pData, size_t nBytes)
+	{
+		m_file.write(pData, nBytes);
+		m_nDataBytes += nBytes;
+		return (bool)m_file;
+	}
+
+	bool Close() override
+	{
+		if (!m_file.is_open())
+			return false;
+
+		// Patch the chunk sizes now the length is known
+		uint32_t nData = (uint32_t)min<uint64_t>(m_nDataBytes, 0xFFFFFFFFu - 36);
+		m_file.seekp(4);
+		WriteU32(36 + nData);
+		m_file.seekp(40);
+		WriteU32(nData);
+		m_file.close();
+		return !m_file.fail();
+	}
+
+private:
+	string m_sFile;
+	ofstream m_file;
+	char* m_pBlockMemory = nullptr;
+	unsigned int m_nBlockBytes = 0;
+	uint64_t m_nDataBytes = 0;
+
+	void WriteU16(uint16_t n)
+	{
+		char b[2] = { (char)(n & 0xFF), (char)(n >> 8) };
+		m_file.write(b, 2);
+	}
+
+	void WriteU32(uint32_t n)
+	{
+		char b[4] = { (char)(n & 0xFF), (char)((n >> 8) & 0xFF), (char)((n >> 16) & 0xFF), (char)(n >> 24) };
+		m_file.write(b, 4);
+	}
+
+	void WriteHeader(const olcNoiseFormat& format, uint32_t nData)
+	{
+		uint16_t nBlockAlign = (uint16_t)(format.nChannels * format.nBitsPerSample / 8);
+		m_file.write("RIFF", 4);
+		WriteU32(36 + nData);
+		m_file.write("WAVEfmt ", 8);
+		WriteU32(16);
+		WriteU16(format.bFloat ? 3 : 1); // WAVE_FORMAT_IEEE_FLOAT or WAVE_FORMAT_PCM
+		WriteU16((uint16_t)format.nChannels);
+		WriteU32(format.nSampleRate);
+		WriteU32(format.nSampleRate * nBlockAlign);
+		WriteU16(nBlockAlign);
+		WriteU16((uint16_t)format.nBitsPerSample);
+		m_file.write("data", 4);
+		WriteU32(nData);
+	}
+};
+
+#if defined(OLC_NOISE_ALSA)
+// Plays through ALSA. Submit() blocks in snd_pcm_writei() until the device
+// has room, which paces the engine. The ALSA buffer is sized to the engine's
+// latency on the first block and again whenever the latency changes; audio
+// already queued is played out first.
+class olcNoiseBackendAlsa : public olcNoiseBackend
+{
+public:
+	olcNoiseBackendAlsa(const string& sDevice)
+	{
+		m_sDevice = sDevice.empty() ? "default" : sDevice;
+	}
+
+	bool Open(const olcNoiseFormat& format, char* pBlockMemory, unsigned int nBlockCount, unsigned int nBlockBytes) override
+	{
+		if (format.bFloat && format.nBitsPerSample == 32) m_pcmFormat = SND_PCM_FORMAT_FLOAT_LE;
+		else if (format.nBitsPerSample == 16) m_pcmFormat = SND_PCM_FORMAT_S16_LE;
+		else if (format.nBitsPerSample == 24) m_pcmFormat = SND_PCM_FORMAT_S24_3LE;
+		else if (format.nBitsPerSample == 32) m_pcmFormat = SND_PCM_FORMAT_S32_LE;
+		else if (format.nBitsPerSample == 8) m_pcmFormat = SND_PCM_FORMAT_S8;
+		else return false;
+
+		if (snd_pcm_open(&m_pcm, m_sDevice.c_str(), SND_PCM_STREAM_PLAYBACK, 0) < 0)
+		{
+			m_pcm = nullptr;
+			return false;
+		}
+
+		m_format = format;
+		m_pBlockMemory = pBlockMemory;
+		m_nBlockBytes = nBlockBytes;
+		m_nFrameBytes = format.nChannels * format.nBitsPerSample / 8;
+		m_nConfiguredFrames = 0;
+		m_nConfiguredBlocks = 0;
+		return true;
+	}
+
+	void Submit(unsigned int nBlock, unsigned int nBytes) override
+	{
+		char* pData = m_pBlockMemory + (size_t)nBlock * m_nBlockBytes;
+		snd_pcm_uframes_t nLeft = nBytes / m_nFrameBytes;
+
+		if (nLeft != m_nConfiguredFrames || QueueLimit() != m_nConfiguredBlocks)
+			if (!Configure((unsigned int)nLeft))
+				nLeft = 0;
+
+		while (nLeft > 0)
+		{
+			snd_pcm_sframes_t nWritten = snd_pcm_writei(m_pcm, pData, nLeft);
+			if (nWritten < 0)
+			{
+				// Underrun or suspend - recover and carry on with this block
+				if (nWritten == -EPIPE)
+					Underrun();
+				if (snd_pcm_recover(m_pcm, (int)nWritten, 1) < 0)
+					break;
+				continue;
+			}
+			pData += nWritten * m_nFrameBytes;
+			nLeft -= nWritten;
+		}
+		BlockDone();
+	}
+
+	bool Close() override
+	{
+		if (m_pcm != nullptr)
+		{
+			snd_pcm_drain(m_pcm);
+			snd_pcm_close(m_pcm);
+			m_pcm = nullptr;
+		}
+		return true;
+	}
+
+private:
+	string m_sDevice;
+	snd_pcm_t* m_pcm = nullptr;
+	snd_pcm_format_t m_pcmFormat;
+	olcNoiseFormat m_format;
+	char* m_pBlockMemory = nullptr;
+	unsigned int m_nBlockBytes = 0;
+	unsigned int m_nFrameBytes = 1;
+	snd_pcm_uframes_t m_nConfiguredFrames = 0;
+	unsigned int m_nConfiguredBlocks = 0;
+
+	// Sizes the ALSA buffer to QueueLimit() blocks of nBlockFrames
+	bool Configure(unsigned int nBlockFrames)
+	{
+		if (m_nConfiguredFrames != 0)
+			snd_pcm_drain(m_pcm);
+
+		unsigned int nLatency = (unsigned int)((uint64_t)nBlockFrames * QueueLimit() * 1000000 / m_format.nSampleRate);
+		if (snd_pcm_set_params(m_pcm, m_pcmFormat, SND_PCM_ACCESS_RW_INTERLEAVED, m_format.nChannels, m_format.nSampleRate, 1, nLatency) < 0)
+			return false;
+
+		m_nConfiguredFrames = nBlockFrames;
+		m_nConfiguredBlocks = QueueLimit();
+		return true;
+	}
+};
+#endif
+
+#if defined(_WIN32)
+// Plays through a WinMM wave out device. The sound card calls back when it
+// has finished with a block.
+class olcNoiseBackendWinMM : public olcNoiseBackend
+{
+public:
+	olcNoiseBackendWinMM(unsigned int nDeviceID)
+	{
+		m_nDeviceID = nDeviceID;
+	}
+
+	static vector<string> Enumerate()
+	{
+		int nDeviceCount = waveOutGetNumDevs();
+		vector<string> sDevices;
+		WAVEOUTCAPS woc;
+		for (int n = 0; n < nDeviceCount; n++)
+			if (waveOutGetDevCaps(n, &woc, sizeof(WAVEOUTCAPS)) == S_OK)
+			{
+				// Convert device name from CHAR[32] to std::string
+				sDevices.push_back(string(woc.szPname));
+			}
+		return sDevices;
+	}
+
+	bool Open(const olcNoiseFormat& format, char* pBlockMemory, unsigned int nBlockCount, unsigned int nBlockBytes) override
+	{
+		WAVEFORMATEX waveFormat;
+		waveFormat.wFormatTag = format.bFloat ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+		waveFormat.nSamplesPerSec = format.nSampleRate;
+		waveFormat.wBitsPerSample = format.nBitsPerSample;
+		waveFormat.nChannels = format.nChannels;
+		waveFormat.nBlockAlign = (waveFormat.wBitsPerSample / 8) * waveFormat.nChannels;
+		waveFormat.nAvgBytesPerSec = waveFormat.nSamplesPerSec * waveFormat.nBlockAlign;
+		waveFormat.cbSize = 0;
+
+		// Open Device if valid
+		if (waveOutOpen(&m_hwDevice, m_nDeviceID, &waveFormat, (DWORD_PTR)waveOutProcWrap, (DWORD_PTR)this, CALLBACK_FUNCTION) != S_OK)
+			return false;
+		m_bOpen = true;
+
+		// Link headers to block memory
+		m_vWaveHeaders.assign(nBlockCount, WAVEHDR());
+		for (unsigned int n = 0; n < nBlockCount; n++)
+		{
+			ZeroMemory(&m_vWaveHeaders[n], sizeof(WAVEHDR));
+			m_vWaveHeaders[n].dwBufferLength = nBlockBytes;
+			m_vWaveHeaders[n].lpData = (LPSTR)(pBlockMemory + (size_t)n * nBlockBytes);
+		}
+		return true;
+	}
+
+	void Submit(unsigned int nBlock, unsigned int nBytes) override
+	{
+		WAVEHDR* pHeader = &m_vWaveHeaders[nBlock];
+		if (pHeader->dwFlags & WHDR_PREPARED)
+			waveOutUnprepareHeader(m_hwDevice, pHeader, sizeof(WAVEHDR));
+		pHeader->dwBufferLength = nBytes;
+
+		// Send block to sound device
+		m_nQueued++;
+		waveOutPrepareHeader(m_hwDevice, pHeader, sizeof(WAVEHDR));
+		waveOutWrite(m_hwDevice, pHeader, sizeof(WAVEHDR));
+	}
+
+	bool Close() override
+	{
+		if (!m_bOpen)
+			return true;
+
+		m_bClosing = true;
+		waveOutReset(m_hwDevice);
+		for (auto& header : m_vWaveHeaders)
+			if (header.dwFlags & WHDR_PREPARED)
+				waveOutUnprepareHeader(m_hwDevice, &header, sizeof(WAVEHDR));
+		waveOutClose(m_hwDevice);
+		m_bOpen = false;
+		return true;
+	}
+
+private:
+	unsigned int m_nDeviceID;
+	HWAVEOUT m_hwDevice;
+	bool m_bOpen = false;
+	atomic<bool> m_bClosing{ false };
+	atomic<int> m_nQueued{ 0 };       // Blocks with the device
+	vector<WAVEHDR> m_vWaveHeaders;
+
+	// Handler for soundcard request for more data
+	void waveOutProc(HWAVEOUT hWaveOut, UINT uMsg, DWORD_PTR dwParam1, DWORD_PTR dwParam2)
+	{
+		if (uMsg != WOM_DONE) return;
+
+		// The device finished its last block before the next one arrived
+		if (--m_nQueued == 0 && !m_bClosing)
+			Underrun();
+		BlockDone();
+	}
+
+	// Static wrapper for sound card handler
+	static void CALLBACK waveOutProcWrap(HWAVEOUT hWaveOut, UINT uMsg, DWORD_PTR dwInstance, DWORD_PTR dwParam1, DWORD_PTR dwParam2)
+	{
+		((olcNoiseBackendWinMM*)dwInstance)->waveOutProc(hWaveOut, uMsg, dwParam1, dwParam2);
+	}
+};
+#endif
+
+inline unique_ptr<olcNoiseBackend> olcNoiseBackend::Create(const string& sName)
+{
+	if (sName == "null")
+		return unique_ptr<olcNoiseBackend>(new olcNoiseBackendNull(true));
+	if (sName == "null:fast")
+		return unique_ptr<olcNoiseBackend>(new olcNoiseBackendNull(false));
+	if (sName.compare(0, 4, "wav:") == 0)
+		return unique_ptr<olcNoiseBackend>(new olcNoiseBackendWav(sName.substr(4)));
+#if defined(OLC_NOISE_ALSA)
+	if (sName.compare(0, 5, "alsa:") == 0)
+		return unique_ptr<olcNoiseBackend>(new olcNoiseBackendAlsa(sName.substr(5)));
+#endif
+#if defined(_WIN32)
+	vector<string> devices = olcNoiseBackendWinMM::Enumerate();
+	for (size_t i = 0; i < devices.size(); i++)
+		if (devices[i] == sName)
+			return unique_ptr<olcNoiseBackend>(new olcNoiseBackendWinMM((unsigned int)i));
+#endif
+	return nullptr;
+}
+
+// Bytes in a cache line. Block memory is laid out in whole lines.
+const size_t nCacheLineBytes = 64;
+
+// Heap array of a trivial type whose first element starts a cache line.
+// Zeroed when allocated.
+template<class T>
+class olcAlignedArray
+{
+public:
+	olcAlignedArray()
+	{
+	}
+
+	explicit olcAlignedArray(size_t nSize)
+	{
+		Assign(nSize);
+	}
+
+	~olcAlignedArray()
+	{
+		Free();
+	}
+
+	olcAlignedArray(const olcAlignedArray&) = delete;
+	olcAlignedArray& operator=(const olcAlignedArray&) = delete;
+
+	void Assign(size_t nSize)
+	{
+		static_assert(is_trivial<T>::value, "aligned arrays hold trivial types");
+		Free();
+		if (nSize == 0)
+			return;
+
+		// From the engine arena being set up, if there is one
+		m_pArena = sArenaScope::Current();
+		if (m_pArena != nullptr)
+			m_pRaw = (char*)m_pArena->Allocate(nSize * sizeof(T), nCacheLineBytes);
+		else
+			m_pRaw = new char[nSize * sizeof(T) + nCacheLineBytes];
+		uintptr_t nAddress = ((uintptr_t)m_pRaw + nCacheLineBytes - 1) & ~(uintptr_t)(nCacheLineBytes - 1);
+		m_pData = (T*)nAddress;
+		m_nSize = nSize;
+		memset(m_pData, 0, nSize * sizeof(T));
+	}
+
+	void Free()
+	{
+		if (m_pArena != nullptr)
+			m_pArena->Free(m_pRaw);
+		else
+			delete[] m_pRaw;
+		m_pArena = nullptr;
+		m_pRaw = nullptr;
+		m_pData = nullptr;
+		m_nSize = 0;
+	}
+
+	T* Data() { return m_pData; }
+	const T* Data() const { return m_pData; }
+	size_t Size() const { return m_nSize; }
+	T& operator[](size_t i) { return m_pData[i]; }
+	const T& operator[](size_t i) const { return m_pData[i]; }
+
+private:
+	sEngineArena* m_pArena = nullptr;
+	char* m_pRaw = nullptr;
+	T* m_pData = nullptr;
+	size_t m_nSize = 0;
+};
+
+// Interleaves nChannels planar channels of nFrames samples each into pOut,
+// frame by frame. Stereo goes four frames at a time with SSE2.
+inline void olcInterleave(const float* const* ppIn, unsigned int nChannels, size_t nFrames, float* pOut)
+{
+	if (nChannels == 2)
+	{
+		const float* pLeft = ppIn[0];
+		const float* pRight = ppIn[1];
+		size_t n = 0;
+#if defined(OLC_NOISE_SSE2)
+		for (; n + 4 <= nFrames; n += 4)
+		{
+			__m128 vLeft = _mm_loadu_ps(pLeft + n);
+			__m128 vRight = _mm_loadu_ps(pRight + n);
+			_mm_storeu_ps(pOut + 2 * n, _mm_unpacklo_ps(vLeft, vRight));
+			_mm_storeu_ps(pOut + 2 * n + 4, _mm_unpackhi_ps(vLeft, vRight));
+		}
+#endif
+		for (; n < nFrames; n++)
+		{
+			pOut[2 * n] = pLeft[n];
+			pOut[2 * n + 1] = pRight[n];
+		}
+		return;
+	}
+
+	for (unsigned int c = 0; c < nChannels; c++)
+	{
+		const float* pIn = ppIn[c];
+		for (size_t n = 0; n < nFrames; n++)
+			pOut[n * nChannels + c] = pIn[n];
+	}
+}
+
+// Output samples
+// ~~~~~~~~~~~~~~
+// The engine renders float blocks; olcNoiseMaker<T> hands the backend blocks
+// of T, which can be short, olcInt24, int32_t or float. olcSampleConverter
+// does the conversion a whole block at a time: scale to full scale, add
+// dither if wanted, clip and round, four samples per instruction with SSE2.
+
+// Packed little-endian 24-bit sample, three bytes with no padding
+struct olcInt24
+{
+	uint8_t b[3];
+};
+
+// What the backend is told about sample type T. Max() is full scale, the
+// value a sample of 1.0 becomes.
+template<class T>
+struct olcSampleType
+{
+	static_assert(is_integral<T>::value || is_floating_point<T>::value, "samples are integers or floating point");
+	static const unsigned int nBits = sizeof(T) * 8;
+	static const bool bFloat = is_floating_point<T>::value;
+	static constexpr double Max() { return bFloat ? 1.0 : (double)numeric_limits<T>::max(); }
+};
+
+template<>
+struct olcSampleType<olcInt24>
+{
+	static const unsigned int nBits = 24;
+	static const bool bFloat = false;
+	static constexpr double Max() { return 8388607.0; }
+};
+
+class olcSampleConverter
+{
+public:
+	olcSampleConverter(bool bDither = false, uint32_t nSeed = 1)
+	{
+		SetDither(bDither);
+		Seed(nSeed);
+	}
+
+	// TPDF dither: the difference of two uniform random values, up to one
+	// step either way, is added before rounding so the rounding error is
+	// noise rather than distortion. Integer types only.
+	void SetDither(bool bDither)
+	{
+		m_bDither = bDither;
+	}
+
+	bool GetDither() const
+	{
+		return m_bDither;
+	}
+
+	void Seed(uint32_t nSeed)
+	{
+		for (int k = 0; k < 4; k++)
+		{
+			uint32_t z = (nSeed + (uint32_t)k) * 0x9E3779B9u;
+			z = (z ^ (z >> 16)) * 0x85EBCA6Bu;
+			m_nState[k] = (z ^ (z >> 13)) | 1u;
+		}
+	}
+
+	// Floating point output is only clipped
+	void Convert(const float* pIn, float* pOut, size_t nFrames)
+	{
+		for (size_t n = 0; n < nFrames; n++)
+			pOut[n] = Clip(pIn[n], 1.0f);
+	}
+
+	void Convert(const float* pIn, double* pOut, size_t nFrames)
+	{
+		for (size_t n = 0; n < nFrames; n++)
+			pOut[n] = (double)Clip(pIn[n], 1.0f);
+	}
+
+	void Convert(const float* pIn, int32_t* pOut, size_t nFrames)
+	{
+		Quantize(pIn, pOut, nFrames, olcSampleType<int32_t>::Max());
+	}
+
+	void Convert(const float* pIn, olcInt24* pOut, size_t nFrames)
+	{
+		int32_t nChunk[nChunkSamples];
+		for (size_t n = 0; n < nFrames; n += nChunkSamples)
+		{
+			size_t nCount = nFrames - n < nChunkSamples ? nFrames - n : nChunkSamples;
+			Quantize(pIn + n, nChunk, nCount, olcSampleType<olcInt24>::Max());
+			for (size_t i = 0; i < nCount; i++)
+			{
+				uint32_t v = (uint32_t)nChunk[i];
+				pOut[n + i].b[0] = (uint8_t)v;
+				pOut[n + i].b[1] = (uint8_t)(v >> 8);
+				pOut[n + i].b[2] = (uint8_t)(v >> 16);
+			}
+		}
+	}
+
+	// Any other integer type, such as short
+	template<class T>
+	void Convert(const float* pIn, T* pOut, size_t nFrames)
+	{
+		static_assert(is_integral<T>::value && sizeof(T) < sizeof(int32_t), "no conversion to this sample type");
+		int32_t nChunk[nChunkSamples];
+		for (size_t n = 0; n < nFrames; n += nChunkSamples)
+		{
+			size_t nCount = nFrames - n < nChunkSamples ? nFrames - n : nChunkSamples;
+			Quantize(pIn + n, nChunk, nCount, olcSampleType<T>::Max());
+			for (size_t i = 0; i < nCount; i++)
+				pOut[n + i] = (T)nChunk[i];
+		}
+	}
+
+private:
+	static const size_t nChunkSamples = 256;
+	bool m_bDither;
+	uint32_t m_nState[4];   // xorshift32, one per SSE2 lane
+
+	// Clips to +-fCeiling, NaN to -fCeiling like the SSE2 path
+	static float Clip(float f, float fCeiling)
+	{
+		f = f > -fCeiling ? f : -fCeiling;
+		return f < fCeiling ? f : fCeiling;
+	}
+
+	// Uniform between 0.0 and 1.0 from the top 23 bits of n, with no int to
+	// float conversion
+	static float Uniform(uint32_t n)
+	{
+		uint32_t nBits = (n >> 9) | 0x3F800000u;
+		float f;
+		memcpy(&f, &nBits, sizeof(f));
+		return f - 1.0f;
+	}
+
+	static uint32_t NextRandom(uint32_t& n)
+	{
+		n ^= n << 13;
+		n ^= n >> 17;
+		n ^= n << 5;
+		return n;
+	}
+
+#if defined(OLC_NOISE_SSE2)
+	static __m128i NextRandom(__m128i& v)
+	{
+		v = _mm_xor_si128(v, _mm_slli_epi32(v, 13));
+		v = _mm_xor_si128(v, _mm_srli_epi32(v, 17));
+		v = _mm_xor_si128(v, _mm_slli_epi32(v, 5));
+		return v;
+	}
+
+	static __m128 Uniform(__m128i v)
+	{
+		__m128i vBits = _mm_or_si128(_mm_srli_epi32(v, 9), _mm_set1_epi32(0x3F800000));
+		return _mm_sub_ps(_mm_castsi128_ps(vBits), _mm_set1_ps(1.0f));
+	}
+#endif
+
+	// Scales by dMax, dithers, clips to +-dMax and rounds to nearest
+	void Quantize(const float* pIn, int32_t* pOut, size_t nFrames, double dMax)
+	{
+		// Full scale of a 32-bit int rounds up as a float, so clip a step below
+		float fScale = (float)dMax;
+		float fCeiling = (double)fScale > dMax ? nextafterf(fScale, 0.0f) : fScale;
+		size_t n = 0;
+
+#if defined(OLC_NOISE_SSE2)
+		__m128 vScale = _mm_set1_ps(fScale);
+		__m128 vHigh = _mm_set1_ps(fCeiling);
+		__m128 vLow = _mm_set1_ps(-fCeiling);
+		__m128i vState = _mm_loadu_si128((const __m128i*)m_nState);
+		for (; n + 4 <= nFrames; n += 4)
+		{
+			__m128 v = _mm_mul_ps(_mm_loadu_ps(pIn + n), vScale);
+			if (m_bDither)
+			{
+				__m128 vA = Uniform(NextRandom(vState));
+				v = _mm_add_ps(v, _mm_sub_ps(vA, Uniform(NextRandom(vState))));
+			}
+
+			// max() picks vLow for NaN, as the scalar loop below does
+			v = _mm_min_ps(_mm_max_ps(v, vLow), vHigh);
+			_mm_storeu_si128((__m128i*)(pOut + n), _mm_cvtps_epi32(v));
+		}
+		_mm_storeu_si128((__m128i*)m_nState, vState);
+#endif
+
+		for (; n < nFrames; n++)
+		{
+			float f = pIn[n] * fScale;
+			if (m_bDither)
+			{
+				uint32_t& nState = m_nState[n & 3];
+				float fA = Uniform(NextRandom(nState));
+				f += fA - Uniform(NextRandom(nState));
+			}
+
+			pOut[n] = (int32_t)lrintf(Clip(f, fCeiling));
+		}
+	}
+};
+
+// Largest latency SetLatency() can switch to without recreating the device.
+// Block memory for this much is allocated up front.
+const unsigned int nMaxLatencyBlocks = 32;
+const unsigned int nMaxLatencySamples = 4096;
+
 template<class T>
 class olcNoiseMaker
 {
@@ -79,120 +938,237 @@ public:
 		Create(sOutputDevice, nSampleRate, nChannels, nBlocks, nBlockSamples);
 	}
 
+	olcNoiseMaker(unique_ptr<olcNoiseBackend> pBackend, unsigned int nSampleRate = 44100, unsigned int nChannels = 1, unsigned int nBlocks = 8, unsigned int nBlockSamples = 512)
+	{
+		Create(move(pBackend), nSampleRate, nChannels, nBlocks, nBlockSamples);
+	}
+
 	~olcNoiseMaker()
 	{
 		Destroy();
 	}
 
 	bool Create(string sOutputDevice, unsigned int nSampleRate = 44100, unsigned int nChannels = 1, unsigned int nBlocks = 8, unsigned int nBlockSamples = 512)
+	{
+		return Create(olcNoiseBackend::Create(sOutputDevice), nSampleRate, nChannels, nBlocks, nBlockSamples);
+	}
+
+	bool Create(unique_ptr<olcNoiseBackend> pBackend, unsigned int nSampleRate = 44100, unsigned int nChannels = 1, unsigned int nBlocks = 8, unsigned int nBlockSamples = 512)
 	{
 		m_bReady = false;
 		m_nSampleRate = nSampleRate;
-		m_nChannels = nChannels;
-		m_nBlockCount = nBlocks;
-		m_nBlockSamples = nBlockSamples;
-		m_nBlockFree = m_nBlockCount;
-		m_nBlockCurrent = 0;
-		m_pBlockMemory = nullptr;
-		m_pWaveHeaders = nullptr;
+		m_nChannels = max(nChannels, 1u);
+		m_nMaxBlocks = max(max(nBlocks, nMaxLatencyBlocks), 2u);
+		m_nMaxBlockSamples = max(max(nBlockSamples, nMaxLatencySamples), 16u);
+		m_nBlockCount = 0;
+		m_nBlockSamples = 0;
+		m_nSubmitted = 0;
+		m_nCompleted = 0;
+		m_bParked = false;
+		SetLatency(nBlocks, nBlockSamples);
+		m_nBlockBytes = 0;
+		m_nGlobalFrame = 0;
+		m_nPublishTime = 0;
+		ResetHealth();
 
 		m_userFunction = nullptr;
+		m_blockFunction = nullptr;
+		m_channelFunction = nullptr;
 
 		// Validate device
-		vector<string> devices = Enumerate();
-		bool found = false;
-		int nDeviceID = -1;
-		
-		for (size_t i = 0; i < devices.size(); i++) {
-			if (devices[i] == sOutputDevice) {
-				found = true;
-				nDeviceID = i;
-				break;
-			}
-		}
+		m_pBackend = move(pBackend);
+		if (m_pBackend == nullptr)
+			return Destroy();
 
-		if (found)
-		{
-			// Device is available
-			WAVEFORMATEX waveFormat;
-			waveFormat.wFormatTag = WAVE_FORMAT_PCM;
-			waveFormat.nSamplesPerSec = m_nSampleRate;
-			waveFormat.wBitsPerSample = sizeof(T) * 8;
-			waveFormat.nChannels = m_nChannels;
-			waveFormat.nBlockAlign = (waveFormat.wBitsPerSample / 8) * waveFormat.nChannels;
-			waveFormat.nAvgBytesPerSec = waveFormat.nSamplesPerSec * waveFormat.nBlockAlign;
-			waveFormat.cbSize = 0;
-
-			// Open Device if valid
-			if (waveOutOpen(&m_hwDevice, nDeviceID, &waveFormat, (DWORD_PTR)waveOutProcWrap, (DWORD_PTR)this, CALLBACK_FUNCTION) != S_OK)
-				return Destroy();
-		}
+		// Allocate Wave|Block Memory, enough for the largest latency. Each
+		// block holds every channel, interleaved, and starts a cache line.
+		size_t nFrameBytes = (size_t)m_nChannels * sizeof(T);
+		m_nBlockBytes = (m_nMaxBlockSamples * nFrameBytes + nCacheLineBytes - 1) / nCacheLineBytes * nCacheLineBytes;
+		m_blockMemory.Assign(m_nMaxBlocks * m_nBlockBytes);
 
-		// Allocate Wave|Block Memory
-		m_pBlockMemory = new T[m_nBlockCount * m_nBlockSamples];
-		if (m_pBlockMemory == nullptr)
-			return Destroy();
-		ZeroMemory(m_pBlockMemory, sizeof(T) * m_nBlockCount * m_nBlockSamples);
+		// Float blocks the user renders into before conversion to T, one
+		// per channel, each starting a cache line
+		size_t nChannelStride = (m_nMaxBlockSamples + 15) & ~(size_t)15;
+		m_blockScratch.Assign(nChannelStride * m_nChannels);
+		m_vChannels.assign(m_nChannels, nullptr);
+		for (unsigned int c = 0; c < m_nChannels; c++)
+			m_vChannels[c] = m_blockScratch.Data() + c * nChannelStride;
+		if (m_nChannels > 1)
+			m_blockInterleaved.Assign((size_t)m_nMaxBlockSamples * m_nChannels);
 
-		m_pWaveHeaders = new WAVEHDR[m_nBlockCount];
-		if (m_pWaveHeaders == nullptr)
-			return Destroy();
-		ZeroMemory(m_pWaveHeaders, sizeof(WAVEHDR) * m_nBlockCount);
+		// Open Device if valid
+		olcNoiseFormat format;
+		format.nSampleRate = m_nSampleRate;
+		format.nChannels = m_nChannels;
+		format.nBitsPerSample = olcSampleType<T>::nBits;
+		format.bFloat = olcSampleType<T>::bFloat;
 
-		// Link headers to block memory
-		for (unsigned int n = 0; n < m_nBlockCount; n++)
-		{
-			m_pWaveHeaders[n].dwBufferLength = m_nBlockSamples * sizeof(T);
-			m_pWaveHeaders[n].lpData = (LPSTR)(m_pBlockMemory + (n * m_nBlockSamples));
-		}
+		m_pBackend->SetBlockDoneHandler(BlockDoneWrap, this);
+		if (!m_pBackend->Open(format, m_blockMemory.Data(), m_nMaxBlocks, (unsigned int)m_nBlockBytes))
+			return Destroy();
 
 		m_bReady = true;
 
 		m_thread = thread(&olcNoiseMaker::MainThread, this);
 
-		// Start the ball rolling
-		unique_lock<mutex> lm(m_muxBlockNotZero);
-		m_cvBlockNotZero.notify_one();
-
 		return true;
 	}
 
 	bool Destroy()
 	{
+		if (m_thread.joinable())
+			Stop();
+
+		if (m_pBackend != nullptr)
+		{
+			m_pBackend->Close();
+			m_pBackend.reset();
+		}
+
+		m_blockMemory.Free();
+		m_blockScratch.Free();
+		m_blockInterleaved.Free();
+		m_vChannels.clear();
 		return false;
 	}
 
 	void Stop()
 	{
-		m_bReady = false;
+		{
+			unique_lock<mutex> lm(m_muxPark);
+			m_bReady = false;
+		}
+		m_cvPark.notify_one();
 		m_thread.join();
 	}
 
+	// Changes the latency to nBlocks blocks of nBlockSamples samples each,
+	// from the next block on. Safe to call from any thread while playing.
+	// Values are clamped to 2..32 blocks of 16..4096 samples (or the size
+	// passed to Create(), if larger).
+	void SetLatency(unsigned int nBlocks, unsigned int nBlockSamples)
+	{
+		m_nRequestedBlocks = min(max(nBlocks, 2u), m_nMaxBlocks);
+		m_nRequestedSamples = min(max(nBlockSamples, 16u), m_nMaxBlockSamples);
+	}
+
+	// Blocks in flight and their size, as currently in use
+	unsigned int GetBlockCount()
+	{
+		return m_nBlockCount.load(memory_order_relaxed);
+	}
+
+	unsigned int GetBlockSamples()
+	{
+		return m_nBlockSamples.load(memory_order_relaxed);
+	}
+
+	// Seconds of audio the engine keeps queued ahead of the device
+	double GetLatency()
+	{
+		return (double)GetBlockCount() * (double)GetBlockSamples() / (double)m_nSampleRate;
+	}
+
 	// Override to process current sample
-	virtual double UserProcess(double dTime)
+	virtual double UserProcess(double /*dTime*/)
 	{
 		return 0.0;
 	}
 
+	// Override to process a whole block of samples. The default implementation
+	// is a compatibility shim which calls the per-sample user function (or
+	// UserProcess) once for every sample in the block.
+	virtual void UserProcessBlock(float* pOut, size_t nFrames, uint64_t nStartFrame)
+	{
+		double dTimeStep = 1.0 / (double)m_nSampleRate;
+		for (size_t n = 0; n < nFrames; n++)
+		{
+			double dTime = (double)(nStartFrame + n) * dTimeStep;
+			if (m_userFunction == nullptr)
+				pOut[n] = (float)UserProcess(dTime);
+			else
+				pOut[n] = (float)m_userFunction(dTime);
+		}
+	}
+
+	// Time in seconds at the start of the next block to be rendered
 	double GetTime()
 	{
-		return m_dGlobalTime;
+		return (double)m_nGlobalFrame.load(memory_order_acquire) / (double)m_nSampleRate;
+	}
+
+	// True from a successful Create() until the engine stops. False if the
+	// backend could not be opened.
+	bool IsRunning()
+	{
+		return m_bReady;
+	}
+
+	// First sample frame of the next block to be rendered. It is published
+	// once per block and only ever goes up.
+	uint64_t GetFrame()
+	{
+		return m_nGlobalFrame.load(memory_order_acquire);
+	}
+
+	// Frame to stamp a live event with, such as a key press. This is GetFrame()
+	// plus the wall-clock time since that frame was published, capped to one
+	// block, so events keep their real spacing instead of snapping to blocks.
+	uint64_t GetEventFrame()
+	{
+		uint64_t nFrame = m_nGlobalFrame.load(memory_order_acquire);
+		int64_t nPublished = m_nPublishTime.load(memory_order_relaxed);
+		int64_t nNow = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+		if (nNow <= nPublished)
+			return nFrame;
+
+		uint64_t nElapsed = (uint64_t)((double)(nNow - nPublished) * 1e-9 * (double)m_nSampleRate);
+		return nFrame + min(nElapsed, (uint64_t)(GetBlockSamples() - 1));
+	}
+
+	// Snapshot of the realtime counters. Safe to call from any thread; each
+	// counter is read on its own, so a snapshot taken mid-block may be one
+	// block out between fields.
+	olcNoiseHealth GetHealth()
+	{
+		olcNoiseHealth health;
+		health.nBlocks = m_nHealthBlocks.load(memory_order_relaxed);
+		health.nDeadlineMisses = m_nHealthMisses.load(memory_order_relaxed);
+		health.nUnderruns = m_pBackend != nullptr ? m_pBackend->Underruns() : 0;
+		health.nMinFreeBlocks = m_nHealthMinFree.load(memory_order_relaxed);
+		health.dBudget = (double)GetBlockSamples() / (double)m_nSampleRate;
+		health.dLastRender = (double)m_nHealthLastNs.load(memory_order_relaxed) * 1e-9;
+		health.dMaxRender = (double)m_nHealthMaxNs.load(memory_order_relaxed) * 1e-9;
+		for (int b = 0; b < olcNoiseHealth::nBuckets; b++)
+			health.nHistogram[b] = m_nHealthHistogram[b].load(memory_order_relaxed);
+		health.nActiveVoices = m_nHealthVoices.load(memory_order_relaxed);
+		health.dCostliestVoice = (double)m_nHealthVoiceNs.load(memory_order_relaxed) * 1e-9;
+		return health;
+	}
+
+	// For the block function to pass in its voice count and the render time,
+	// in seconds, of its most expensive voice. Lock-free, safe on the audio thread.
+	void ReportVoices(unsigned int nActiveVoices, double dCostliestVoice)
+	{
+		m_nHealthVoices.store(nActiveVoices, memory_order_relaxed);
+		m_nHealthVoiceNs.store((int64_t)(dCostliestVoice * 1e9), memory_order_relaxed);
 	}
 
 	
 
 public:
+	// Names of the output devices that can be passed to the constructor. The
+	// "null" backend is always available and is listed last.
 	static vector<string> Enumerate()
 	{
-		int nDeviceCount = waveOutGetNumDevs();
 		vector<string> sDevices;
-		WAVEOUTCAPS woc;
-		for (int n = 0; n < nDeviceCount; n++)
-			if (waveOutGetDevCaps(n, &woc, sizeof(WAVEOUTCAPS)) == S_OK)
-			{
-				// Convert device name from CHAR[32] to std::string
-				sDevices.push_back(string(woc.szPname));
-			}
+#if defined(_WIN32)
+		sDevices = olcNoiseBackendWinMM::Enumerate();
+#endif
+#if defined(OLC_NOISE_ALSA)
+		sDevices.push_back("alsa:default");
+#endif
+		sDevices.push_back("null");
 		return sDevices;
 	}
 
@@ -201,103 +1177,243 @@ public:
 		m_userFunction = func;
 	}
 
-	double clip(double dSample, double dMax)
+	// Block function fills nFrames samples starting at sample frame nStartFrame.
+	// When set it takes priority over the per-sample user function. Its mono
+	// output is played on every channel.
+	void SetBlockFunction(void(*func)(float* pOut, size_t nFrames, uint64_t nStartFrame))
 	{
-		if (dSample >= 0.0)
-			return fmin(dSample, dMax);
-		else
-			return fmax(dSample, -dMax);
+		m_blockFunction = func;
+	}
+
+	// Multichannel block function: fills nFrames samples of each of the
+	// nChannels planar buffers in ppOut. Takes priority over the others.
+	void SetBlockFunction(void(*func)(float* const* ppOut, unsigned int nChannels, size_t nFrames, uint64_t nStartFrame))
+	{
+		m_channelFunction = func;
+	}
+
+	unsigned int GetChannels()
+	{
+		return m_nChannels;
+	}
+
+	// Turns TPDF dither on or off for integer output, from the next block on.
+	// Safe to call from any thread while playing.
+	void SetDither(bool bDither)
+	{
+		m_bDither.store(bDither, memory_order_relaxed);
 	}
 
 
 private:
 	double(*m_userFunction)(double);
+	void(*m_blockFunction)(float*, size_t, uint64_t);
+	void(*m_channelFunction)(float* const*, unsigned int, size_t, uint64_t);
 
 	unsigned int m_nSampleRate;
 	unsigned int m_nChannels;
-	unsigned int m_nBlockCount;
-	unsigned int m_nBlockSamples;
-	unsigned int m_nBlockCurrent;
+	unsigned int m_nMaxBlocks;           // Block memory is m_nMaxBlocks blocks of m_nMaxBlockSamples
+	unsigned int m_nMaxBlockSamples;
+	atomic<unsigned int> m_nBlockCount;  // Latency in use, changed only by the audio thread
+	atomic<unsigned int> m_nBlockSamples;
+	atomic<unsigned int> m_nRequestedBlocks;
+	atomic<unsigned int> m_nRequestedSamples;
 
-	T* m_pBlockMemory;
-	WAVEHDR *m_pWaveHeaders;
-	HWAVEOUT m_hwDevice;
+	olcAlignedArray<char> m_blockMemory;      // m_nMaxBlocks blocks of m_nBlockBytes
+	size_t m_nBlockBytes;
+	olcAlignedArray<float> m_blockScratch;    // Planar channels the user renders into
+	vector<float*> m_vChannels;               // Start of each channel in m_blockScratch
+	olcAlignedArray<float> m_blockInterleaved;   // Frames in output order, for more than one channel
+	olcSampleConverter m_converter;      // Audio thread only
+	atomic<bool> m_bDither{ false };
+	unique_ptr<olcNoiseBackend> m_pBackend;
 
 	thread m_thread;
 	atomic<bool> m_bReady;
-	atomic<unsigned int> m_nBlockFree;
-	condition_variable m_cvBlockNotZero;
-	mutex m_muxBlockNotZero;
 
-	atomic<double> m_dGlobalTime;
+	// Ring of blocks. The audio thread fills them in turn and counts them
+	// out; the backend counts them back in. A block is free while fewer
+	// than m_nBlockCount are in flight.
+	uint64_t m_nSubmitted;               // Audio thread only
+	atomic<uint64_t> m_nCompleted;       // Backend only
+	atomic<bool> m_bParked;              // Audio thread is asleep on m_cvPark
+	condition_variable m_cvPark;
+	mutex m_muxPark;
 
-	// Handler for soundcard request for more data
-	void waveOutProc(HWAVEOUT hWaveOut, UINT uMsg, DWORD dwParam1, DWORD dwParam2)
+	atomic<uint64_t> m_nGlobalFrame;
+	atomic<int64_t> m_nPublishTime;    // steady_clock nanoseconds when m_nGlobalFrame was last published
+
+	// Health counters, written only by the audio thread
+	atomic<uint64_t> m_nHealthBlocks;
+	atomic<uint64_t> m_nHealthMisses;
+	atomic<unsigned int> m_nHealthMinFree;
+	atomic<int64_t> m_nHealthLastNs;
+	atomic<int64_t> m_nHealthMaxNs;
+	atomic<uint64_t> m_nHealthHistogram[olcNoiseHealth::nBuckets];
+	atomic<unsigned int> m_nHealthVoices;
+	atomic<int64_t> m_nHealthVoiceNs;
+
+	void ResetHealth()
 	{
-		if (uMsg != WOM_DONE) return;
+		m_nHealthBlocks = 0;
+		m_nHealthMisses = 0;
+		m_nHealthMinFree = m_nMaxBlocks;
+		m_nHealthLastNs = 0;
+		m_nHealthMaxNs = 0;
+		for (int b = 0; b < olcNoiseHealth::nBuckets; b++)
+			m_nHealthHistogram[b] = 0;
+		m_nHealthVoices = 0;
+		m_nHealthVoiceNs = 0;
+	}
+
+	// Counts one rendered block. Only the audio thread writes the counters,
+	// so plain loads and stores are enough.
+	void RecordBlock(unsigned int nFree, unsigned int nBlockSamples, int64_t nRenderNs)
+	{
+		const memory_order relaxed = memory_order_relaxed;
+		int64_t nBudgetNs = (int64_t)nBlockSamples * 1000000000 / m_nSampleRate;
 
-		m_nBlockFree++;
-		unique_lock<mutex> lm(m_muxBlockNotZero);
-		m_cvBlockNotZero.notify_one();
+		if (nFree < m_nHealthMinFree.load(relaxed))
+			m_nHealthMinFree.store(nFree, relaxed);
+		if (nRenderNs > nBudgetNs)
+			m_nHealthMisses.store(m_nHealthMisses.load(relaxed) + 1, relaxed);
+		if (nRenderNs > m_nHealthMaxNs.load(relaxed))
+			m_nHealthMaxNs.store(nRenderNs, relaxed);
+		m_nHealthLastNs.store(nRenderNs, relaxed);
+
+		int nBucket = (int)min<int64_t>(nRenderNs * 8 / max<int64_t>(nBudgetNs, 1), olcNoiseHealth::nBuckets - 1);
+		m_nHealthHistogram[nBucket].store(m_nHealthHistogram[nBucket].load(relaxed) + 1, relaxed);
+		m_nHealthBlocks.store(m_nHealthBlocks.load(relaxed) + 1, relaxed);
 	}
 
-	// Static wrapper for sound card handler
-	static void CALLBACK waveOutProcWrap(HWAVEOUT hWaveOut, UINT uMsg, DWORD dwInstance, DWORD dwParam1, DWORD dwParam2)
+	// Handler for the backend giving a block back. Lock-free unless the
+	// audio thread has parked.
+	void BlockDone()
 	{
-		((olcNoiseMaker*)dwInstance)->waveOutProc(hWaveOut, uMsg, dwParam1, dwParam2);
+		m_nCompleted.fetch_add(1, memory_order_seq_cst);
+		if (m_bParked.load(memory_order_seq_cst))
+		{
+			unique_lock<mutex> lm(m_muxPark);
+			m_cvPark.notify_one();
+		}
 	}
 
-	// Main thread. This loop responds to requests from the soundcard to fill 'blocks'
-	// with audio data. If no requests are available it goes dormant until the sound
-	// card is ready for more data. The block is fille by the "user" in some manner
-	// and then issued to the soundcard.
-	void MainThread()
+	bool BlockFree(unsigned int nBlockCount)
 	{
-		m_dGlobalTime = 0.0;
-		double dTimeStep = 1.0 / (double)m_nSampleRate;
+		return m_nSubmitted - m_nCompleted.load(memory_order_seq_cst) < nBlockCount;
+	}
 
-		// Goofy hack to get maximum integer for a type at run-time
-		T nMaxSample = (T)pow(2, (sizeof(T) * 8) - 1) - 1;
-		double dMaxSample = (double)nMaxSample;
-		T nPreviousSample = 0;
+	// Waits until a block is free: spins first, as blocks often come back
+	// within microseconds, then yields, then parks until BlockDone() wakes
+	// it. Returns false if the engine is stopping.
+	bool WaitForFreeBlock(unsigned int nBlockCount)
+	{
+		for (int i = 0; i < 2000; i++)
+			if (BlockFree(nBlockCount))
+				return true;
+
+		auto tYieldEnd = chrono::steady_clock::now() + chrono::microseconds(200);
+		while (chrono::steady_clock::now() < tYieldEnd)
+		{
+			if (BlockFree(nBlockCount))
+				return true;
+			if (!m_bReady)
+				return false;
+			this_thread::yield();
+		}
+
+		// BlockDone() counts the block in and then checks m_bParked; this
+		// thread sets m_bParked and then checks the count. One of the two
+		// always sees the other, so no wake-up is lost.
+		unique_lock<mutex> lm(m_muxPark);
+		m_bParked.store(true, memory_order_seq_cst);
+		m_cvPark.wait(lm, [&] { return BlockFree(nBlockCount) || !m_bReady; });
+		m_bParked.store(false, memory_order_relaxed);
+		return m_bReady;
+	}
+
+	// Static wrapper for backend handler
+	static void BlockDoneWrap(void* pContext)
+	{
+		((olcNoiseMaker*)pContext)->BlockDone();
+	}
+
+	// Fills pBlock with the next nBlockSamples frames, starting at nFrame.
+	// Nothing in here may allocate, lock or wait, which builds with
+	// SYNTH_RT_GUARD check.
+	void RenderBlock(T* pBlock, unsigned int nBlockSamples, uint64_t nFrame)
+	{
+		sRealtimeScope realtime;
+
+		// User Process - one call renders the whole block
+		float* const* ppChannels = m_vChannels.data();
+		if (m_channelFunction != nullptr)
+			m_channelFunction(ppChannels, m_nChannels, nBlockSamples, nFrame);
+		else
+		{
+			if (m_blockFunction == nullptr)
+				UserProcessBlock(ppChannels[0], nBlockSamples, nFrame);
+			else
+				m_blockFunction(ppChannels[0], nBlockSamples, nFrame);
+
+			for (unsigned int c = 1; c < m_nChannels; c++)
+				memcpy(ppChannels[c], ppChannels[0], nBlockSamples * sizeof(float));
+		}
+
+		// Convert to output sample type, interleaving the channels first
+		m_converter.SetDither(m_bDither.load(memory_order_relaxed));
+		if (m_nChannels == 1)
+			m_converter.Convert(ppChannels[0], pBlock, nBlockSamples);
+		else
+		{
+			olcInterleave(ppChannels, m_nChannels, nBlockSamples, m_blockInterleaved.Data());
+			m_converter.Convert(m_blockInterleaved.Data(), pBlock, (size_t)nBlockSamples * m_nChannels);
+		}
+	}
+
+	// Main thread. This loop responds to requests from the backend to fill 'blocks'
+	// with audio data. If no requests are available it goes dormant until the
+	// backend is ready for more data. The block is filled by the "user" in some
+	// manner and then submitted to the backend.
+	void MainThread()
+	{
+		uint64_t nFrame = 0;
+		m_nPublishTime = 0;
+		m_nGlobalFrame = 0;
 
 		while (m_bReady)
 		{
-			// Wait for block to become available
-			if (m_nBlockFree == 0)
+			// Pick up a latency change between blocks
+			unsigned int nBlockCount = m_nRequestedBlocks.load(memory_order_relaxed);
+			unsigned int nBlockSamples = m_nRequestedSamples.load(memory_order_relaxed);
+			if (nBlockCount != m_nBlockCount || nBlockSamples != m_nBlockSamples)
 			{
-				unique_lock<mutex> lm(m_muxBlockNotZero);
-				m_cvBlockNotZero.wait(lm);
+				m_nBlockCount.store(nBlockCount, memory_order_relaxed);
+				m_nBlockSamples.store(nBlockSamples, memory_order_relaxed);
+				m_pBackend->SetQueueLimit(nBlockCount);
 			}
 
+			// Wait for block to become available
+			if (!WaitForFreeBlock(nBlockCount))
+				break;
+
 			// Block is here, so use it
-			m_nBlockFree--;
+			unsigned int nFree = nBlockCount - (unsigned int)(m_nSubmitted - m_nCompleted.load(memory_order_acquire));
+			unsigned int nCurrentBlock = (unsigned int)(m_nSubmitted % m_nMaxBlocks);
+			auto tRenderStart = chrono::steady_clock::now();
+			RenderBlock((T*)(m_blockMemory.Data() + (size_t)nCurrentBlock * m_nBlockBytes), nBlockSamples, nFrame);
 
-			// Prepare block for processing
-			if (m_pWaveHeaders[m_nBlockCurrent].dwFlags & WHDR_PREPARED)
-				waveOutUnprepareHeader(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
+			RecordBlock(nFree, nBlockSamples, chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - tRenderStart).count());
 
-			T nNewSample = 0;
-			int nCurrentBlock = m_nBlockCurrent * m_nBlockSamples;
-			
-			for (unsigned int n = 0; n < m_nBlockSamples; n++)
-			{
-				// User Process
-				if (m_userFunction == nullptr)
-					nNewSample = (T)(clip(UserProcess(m_dGlobalTime), 1.0) * dMaxSample);
-				else
-					nNewSample = (T)(clip(m_userFunction(m_dGlobalTime), 1.0) * dMaxSample);
-
-				m_pBlockMemory[nCurrentBlock + n] = nNewSample;
-				nPreviousSample = nNewSample;
-				m_dGlobalTime = m_dGlobalTime + dTimeStep;
-			}
+			// Publish the clock once per block
+			nFrame += nBlockSamples;
+			m_nPublishTime.store(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count(), memory_order_relaxed);
+			m_nGlobalFrame.store(nFrame, memory_order_release);
 
-			// Send block to sound device
-			waveOutPrepareHeader(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
-			waveOutWrite(m_hwDevice, &m_pWaveHeaders[m_nBlockCurrent], sizeof(WAVEHDR));
-			m_nBlockCurrent++;
-			m_nBlockCurrent %= m_nBlockCount;
+			// Send block to the backend. It may hand the block straight back
+			// from inside Submit(), so count it out first.
+			m_nSubmitted++;
+			m_pBackend->Submit(nCurrentBlock, (unsigned int)(nBlockSamples * m_nChannels * sizeof(T)));
 		}
 	}
 };
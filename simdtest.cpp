@@ -0,0 +1,236 @@
+/*
+    Equivalence test for the SIMD kernels, headless.
+
+    Renders the same input through the scalar kernels and through every
+    wider set this CPU runs (SSE2, AVX2), and fails if any sample differs
+    by more than a small tolerance. The wide kernels step the phase in
+    single precision per lane, so they are close to the scalar ones but
+    not bit-exact: an edge can land a hundredth of a sample early or late,
+    which on a steep edge is more than the tolerance. The allowance grows
+    with the local slope to cover that, and the jumps of the naive
+    (aliasing) square, sawtooth, ramp and pulse may move a whole sample.
+
+      oscillator    RenderOscillator() of every OSC_* type, with and without
+                    an LFO, at audio rate and at control rate with linear
+                    and cubic interpolation
+      wavetable     RenderWavetable(), the same cases
+      ramp          MulRamp(), rising, falling and flat
+      muladd        MulAdd() and MulAddSpectrum()
+      patch         every compiled preset's RenderPatch() under an
+                    attack ramp
+
+    Blocks are rendered at odd lengths, several in a row, so the tails of
+    the vector loops and the state carried between blocks are covered.
+
+    Build and run:
+      g++ -std=c++14 -O2 simdtest.cpp -o simdtest
+      ./simdtest          # prints every check, exits 1 if any fails
+*/
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstdlib>
+
+using namespace std;
+
+#include "olcNoiseMaker.h"
+#include "synth.h"
+#include "synthWavetable.h"
+#include "synthSimd.h"
+#include "synthPresets.h"
+
+const double dSampleRate = 44100.0;
+const size_t nBlocks = 8;
+const size_t nBlockFrames = 509;        // Odd, so every vector loop has a tail
+const float fTolerance = 2e-4f;         // Largest difference allowed from the scalar kernels
+const float fTimingSlack = 0.01f;       // Samples an edge may move, times the local slope, added to it
+
+int nFailures = 0;
+
+// Prints one check and counts it if the largest difference is too big
+void Check(const string& sName, const sSimdKernels& kernels, float fMaxDiff)
+{
+    bool bOk = fMaxDiff <= fTolerance && !std::isnan(fMaxDiff);
+    if (!bOk)
+        nFailures++;
+    cout << (bOk ? "ok    " : "FAIL  ") << kernels.sName << " " << sName << ", max difference " << fMaxDiff << endl;
+}
+
+float MaxDiff(const vector<float>& a, const vector<float>& b)
+{
+    float fMax = 0.0f;
+    for (size_t n = 0; n < a.size(); n++)
+    {
+        float fDiff = fabs(a[n] - b[n]);
+        if (!(fDiff <= fMax))
+            fMax = fDiff;
+    }
+    return fMax;
+}
+
+// Largest difference of the wide output b from the scalar output a, less
+// what fTimingSlack explains. With bJumps, a sample may match a's sample
+// either side instead, for waveforms that jump in one sample.
+float MaxSignalDiff(const vector<float>& a, const vector<float>& b, bool bJumps = false)
+{
+    float fMax = 0.0f;
+    for (size_t n = 0; n < a.size(); n++)
+    {
+        float fBefore = n > 0 ? a[n - 1] : a[n];
+        float fAfter = n + 1 < a.size() ? a[n + 1] : a[n];
+        float fSlope = max(fabs(a[n] - fBefore), fabs(fAfter - a[n]));
+
+        float fDiff = fabs(a[n] - b[n]);
+        if (bJumps)
+            fDiff = min(fDiff, min(fabs(fBefore - b[n]), fabs(fAfter - b[n])));
+        fDiff = max(0.0f, fDiff - fTimingSlack * fSlope);
+        if (!(fDiff <= fMax))
+            fMax = fDiff;
+    }
+    return fMax;
+}
+
+// Fills v with a repeatable pattern between -1.0 and 1.0
+void Pattern(vector<float>& v, uint32_t nSeed)
+{
+    for (float& f : v)
+    {
+        nSeed = nSeed * 1664525u + 1013904223u;
+        f = (float)(nSeed >> 8) / (float)(1u << 23) - 1.0f;
+    }
+}
+
+// nBlocks blocks of an oscillator rendered through one kernel set
+template<class OSC, class RENDER>
+vector<float> RenderBlocks(OSC osc, RENDER render)
+{
+    vector<float> vOut(nBlocks * nBlockFrames, 0.0f);
+    for (size_t b = 0; b < nBlocks; b++)
+        render(osc, &vOut[b * nBlockFrames], nBlockFrames);
+    return vOut;
+}
+
+void CheckOscillators(const sSimdKernels& scalar, const sSimdKernels& kernels)
+{
+    struct sCase { const char* sName; double dLFOHertz; double dLFOAmplitude; int nModPeriod; int nModInterpolation; };
+    const sCase cases[] =
+    {
+        { "",                    0.0, 0.0,  1, MOD_LINEAR },
+        { " lfo audio rate",     5.0, 0.02, 1, MOD_LINEAR },
+        { " lfo linear",         5.0, 0.02, 32, MOD_LINEAR },
+        { " lfo cubic",          5.0, 0.02, 32, MOD_CUBIC },
+    };
+
+    for (int nType = OSC_SINE; nType <= OSC_BROWN_NOISE; nType++)
+    {
+        bool bJumps = nType == OSC_SQUARE || nType == OSC_SAWTOOTH || nType == OSC_RAMP || nType == OSC_PULSE;
+        for (const sCase& c : cases)
+        {
+            sOscillator osc;
+            osc.Set(220.0, dSampleRate, nType, c.dLFOHertz, c.dLFOAmplitude);
+            osc.nModPeriod = c.nModPeriod;
+            osc.nModInterpolation = c.nModInterpolation;
+            vector<float> vScalar = RenderBlocks(osc, [&](sOscillator& o, float* p, size_t n) { scalar.RenderOscillator(o, p, n, 0.8f); });
+            vector<float> vWide = RenderBlocks(osc, [&](sOscillator& o, float* p, size_t n) { kernels.RenderOscillator(o, p, n, 0.8f); });
+            Check(string("oscillator ") + sOscNames[nType] + c.sName, kernels, MaxSignalDiff(vScalar, vWide, bJumps));
+
+            sWavetableOscillator table;
+            table.Set(220.0, dSampleRate, nType, c.dLFOHertz, c.dLFOAmplitude);
+            table.nModPeriod = c.nModPeriod;
+            table.nModInterpolation = c.nModInterpolation;
+            vScalar = RenderBlocks(table, [&](sWavetableOscillator& o, float* p, size_t n) { scalar.RenderWavetable(o, p, n, 0.8f); });
+            vWide = RenderBlocks(table, [&](sWavetableOscillator& o, float* p, size_t n) { kernels.RenderWavetable(o, p, n, 0.8f); });
+            Check(string("wavetable ") + sOscNames[nType] + c.sName, kernels, MaxSignalDiff(vScalar, vWide));
+        }
+    }
+}
+
+void CheckRampAndMix(const sSimdKernels& scalar, const sSimdKernels& kernels)
+{
+    const float ramps[][2] = { { 0.0f, 1.0f / nBlockFrames }, { 1.0f, -0.5f / nBlockFrames }, { 0.7f, 0.0f } };
+    for (const auto& ramp : ramps)
+    {
+        vector<float> vScalar(nBlockFrames), vWide;
+        Pattern(vScalar, 1);
+        vWide = vScalar;
+        scalar.MulRamp(vScalar.data(), nBlockFrames, ramp[0], ramp[1]);
+        kernels.MulRamp(vWide.data(), nBlockFrames, ramp[0], ramp[1]);
+        Check("ramp " + to_string(ramp[0]) + " step " + to_string(ramp[1]), kernels, MaxDiff(vScalar, vWide));
+    }
+
+    vector<float> vIn(nBlockFrames), vScalar(nBlockFrames), vWide;
+    Pattern(vIn, 2);
+    Pattern(vScalar, 3);
+    vWide = vScalar;
+    scalar.MulAdd(vIn.data(), vScalar.data(), nBlockFrames, 0.3f);
+    kernels.MulAdd(vIn.data(), vWide.data(), nBlockFrames, 0.3f);
+    Check("muladd", kernels, MaxDiff(vScalar, vWide));
+
+    vector<float> vARe(nBlockFrames), vAIm(nBlockFrames), vBRe(nBlockFrames), vBIm(nBlockFrames);
+    Pattern(vARe, 4);
+    Pattern(vAIm, 5);
+    Pattern(vBRe, 6);
+    Pattern(vBIm, 7);
+    vector<float> vScalarRe(nBlockFrames), vScalarIm(nBlockFrames);
+    Pattern(vScalarRe, 8);
+    Pattern(vScalarIm, 9);
+    vector<float> vWideRe = vScalarRe, vWideIm = vScalarIm;
+    scalar.MulAddSpectrum(vARe.data(), vAIm.data(), vBRe.data(), vBIm.data(), vScalarRe.data(), vScalarIm.data(), nBlockFrames);
+    kernels.MulAddSpectrum(vARe.data(), vAIm.data(), vBRe.data(), vBIm.data(), vWideRe.data(), vWideIm.data(), nBlockFrames);
+    Check("muladd spectrum", kernels, max(MaxDiff(vScalarRe, vWideRe), MaxDiff(vScalarIm, vWideIm)));
+}
+
+// Every compiled preset, one voice at 220 Hz, the way sVoiceManager sets it up
+void CheckPatches(const sSimdKernels& scalar, const sSimdKernels& kernels)
+{
+    for (int p = 0; p < nPresetCount; p++)
+    {
+        const sPreset& preset = presets[p];
+        if (preset.RenderPatch == nullptr)
+            continue;
+
+        auto render = [&](const sSimdKernels& k)
+        {
+            sWavetableOscillator osc[nMaxPartials];
+            for (int i = 0; i < preset.nPartials; i++)
+            {
+                const sPartial& partial = preset.partials[i];
+                osc[i].Set(220.0 * partial.dRatio, dSampleRate, partial.nType, partial.dLFOHertz, partial.dLFOAmplitude);
+            }
+
+            vector<float> vOut(nBlocks * nBlockFrames, 0.0f);
+            for (size_t b = 0; b < nBlocks; b++)
+            {
+                float fStart = (float)b / nBlocks;
+                preset.RenderPatch(osc, &vOut[b * nBlockFrames], nBlockFrames, fStart, 1.0f / (nBlocks * nBlockFrames), k);
+            }
+            return vOut;
+        };
+
+        Check(string("patch ") + preset.sName, kernels, MaxSignalDiff(render(scalar), render(kernels)));
+    }
+}
+
+int main()
+{
+    WavetableBank();
+
+    const sSimdKernels& scalar = SimdKernelsFor(SIMD_SCALAR);
+    int nLevels = 0;
+    for (int nLevel = SIMD_SSE2; nLevel <= DetectSimdLevel(); nLevel++, nLevels++)
+    {
+        const sSimdKernels& kernels = SimdKernelsFor(nLevel);
+        CheckOscillators(scalar, kernels);
+        CheckRampAndMix(scalar, kernels);
+        CheckPatches(scalar, kernels);
+    }
+
+    if (nLevels == 0)
+        cout << "Only the scalar kernels run on this CPU, nothing to compare" << endl;
+    else
+        cout << (nFailures == 0 ? "All SIMD kernels match the scalar ones" : to_string(nFailures) + " checks failed")
+             << " (tolerance " << fTolerance << ")" << endl;
+    return nFailures == 0 ? 0 : 1;
+}
@@ -0,0 +1,586 @@
+/*
+    Synthesizer DSP building blocks shared by the programs in this folder:
+    oscillators, envelopes and the helpers they need.
+*/
+
+#pragma once
+
+#include <cmath>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+#include "olcNoiseMaker.h"
+#include "synthNoise.h"
+
+// Convert frequency in hertz to angular velocity (radians per second)
+// This is needed because C++ trigonometric functions use radians, not Hz
+// Formula: Angular velocity = 2π × frequency (Hz)
+inline double w(double dHertz)
+{
+    return dHertz * 2.0 * PI;
+}
+
+// Equal-tempered frequency of MIDI note nNote (69 is A4, 440 Hz; 45 is A2,
+// 110 Hz), looked up in a table built on first use
+inline double NoteHertz(int nNote)
+{
+    struct sNoteTable
+    {
+        double dHertz[128];
+
+        sNoteTable()
+        {
+            for (int n = 0; n < 128; n++)
+                dHertz[n] = 440.0 * pow(2.0, (n - 69) / 12.0);
+        }
+    };
+    static const sNoteTable table;
+
+    if (nNote >= 0 && nNote < 128)
+        return table.dHertz[nNote];
+    return 440.0 * pow(2.0, (nNote - 69) / 12.0);
+}
+
+// Define constants for different oscillator types to make code more readable
+#define OSC_SINE 0         // Sine wave - smooth, pure tone
+#define OSC_SQUARE 1
+#define OSC_SAWTOOTH 2    // Square wave - harsh, buzzy sound with odd harmonics
+#define OSC_TRIANGLE 3    // Triangle wave - smoother than square, still with harmonics
+#define OSC_RAMP 4        // 
+#define OSC_PULSE 5      // Digital sawtooth/ramp - similar to analog saw but implemented differently
+#define OSC_NOISE 6      // Noise - random values, useful for percussion or effects
+#define OSC_PINK_NOISE 7  // Pink noise - softer, equal energy per octave
+#define OSC_BROWN_NOISE 8 // Brown noise - deep rumble, most energy in the lows
+#define OSC_SAMPLE 9      // Sample playback - a recorded note streamed from disk, see synthSampler.h
+
+/**
+ * Oscillator function that generates different waveforms
+ * 
+ * @param dHertz - The base frequency of the oscillator in Hz (e.g., 440 for A4 note)
+ * @param dTime - The current time in seconds (used to calculate the phase of the wave)
+ * @param nType - The type of waveform to generate (uses the OSC_* constants)
+ * @param dLFOHertz - Frequency of the Low Frequency Oscillator in Hz (for vibrato/modulation effects)
+ * @param dLFOAmplitude - Amount of LFO modulation to apply (0.0 = none, higher values = more)
+ * 
+ * @return A value between -1.0 and 1.0 representing the amplitude of the waveform at time dTime
+ */
+inline double osc(double dHertz, double dTime, int nType = OSC_SINE, double dLFOHertz = 0.0, double dLFOAmplitude = 0.0)
+{
+    // Calculate the frequency with LFO modulation applied
+    // This creates a vibrato effect by slightly varying the frequency over time
+    // The inner sin(w(dLFOHertz) * dTime) oscillates slowly at the LFO frequency
+    // This is then scaled by dLFOAmplitude and the base frequency (dHertz)
+    // The result modulates the phase of the main oscillator
+    // The LFO is worked out once and shared by every case below, and the
+    // modulated sine only for the cases that use it
+    double dLFO = dLFOAmplitude != 0.0 ? sin(w(dLFOHertz) * dTime) : 0.0;
+    bool bSineFamily = nType == 0 || nType == 1 || nType == 3 || nType == 5;
+    double dFreq = bSineFamily ? sin(w(dHertz) * dTime + dLFOAmplitude * dHertz * dLFO) : 0.0;
+
+    // Noise generator for the noise cases, one per thread
+    static thread_local sNoise noise;
+
+    switch(nType)
+    {
+        case 0: // Sine wave
+            // The simplest and purest waveform with only the fundamental frequency
+            // No harmonics, produces a very clean tone
+            //return sin(w(dHertz) * dTime + 0.01 * dHertz * sin(w(5.0) * dTime)); // Old implementation without variable LFO
+            return sin(dFreq);
+        
+        case 1: // Square wave 
+            // Creates a harsh, buzzy sound rich in odd harmonics
+            // Implemented by checking if the sine wave is positive or negative
+            // and returning either 1.0 or -1.0 accordingly
+            // C++ feature: This uses the ternary operator (condition ? true_value : false_value)
+            return sin(dFreq) > 0.0 ? 1.0 : -1.0;
+        
+        case 2: // Sawtooth wave
+            // Rich in both odd and even harmonics, creates a bright, buzzy sound
+            // The formula creates a ramp that rises and then sharply falls
+            // Implementation steps:
+            // 1. dHertz * dTime creates a linearly increasing value
+            // 2. Add LFO modulation with sin(w(dLFOHertz) * dTime)
+            // 3. Use floor(...+ 0.5) to round to nearest integer
+            // 4. Scale to range -1.0 to 1.0 with the 2.0 * (...) part
+            return (2.0 * (dHertz * dTime + dLFOAmplitude * dLFO - floor(dHertz * dTime + dLFOAmplitude * dLFO + 0.5)));
+        
+        case 3: // Triangle wave
+            // Smoother than square wave but still contains odd harmonics
+            // Uses arcsin (asin) of a sine wave scaled by 2/PI to create the triangular shape
+            // Math concept: asin() is the inverse of sin(), and scaling shapes the output
+            //return (2.0 * fabs(2.0 * (dHertz * dTime - floor(dHertz * dTime + 0.5))) - 1.0); // Old implementation using absolute value
+            return asin(sin(dFreq) * (2.0 / PI));
+            
+        case 4: // Ramp wave
+            // Similar to sawtooth but with a different implementation
+            // Creates a ramp that rises linearly and then resets
+            // Different from sawtooth: No 0.5 offset in the floor function
+            // LFO modulation is applied to the phase calculation for vibrato effect
+            return (2.0 * (dHertz * dTime + dLFOAmplitude * dLFO - floor(dHertz * dTime + dLFOAmplitude * dLFO)));
+        
+        case 5: // Pulse wave
+            // Similar to square wave but oscillates between 0 and 1 (not -1 and 1)
+            // Often used for retro video game sounds and percussion
+            // Uses the ternary operator to check if the sine wave is positive
+            return (sin(dFreq) > 0.0) ? 1.0 : 0.0;
+        
+        case 6: // Noise wave
+            // Generates random values between -1.0 and 1.0
+            // For noise, we use the LFO to modulate the amplitude rather than frequency
+            // This creates a tremolo effect (volume variation) rather than vibrato (pitch variation)
+            // Implementation steps:
+            // 1. noise.Sample() gives a random value between -1.0 and 1.0 from a generator
+            //    owned by this thread, so there is no shared state like rand() has
+            // 2. Scale by a value that oscillates with the LFO
+            return noise.Sample(NOISE_WHITE) * (1.0 + dLFOAmplitude * dLFO * 0.5);
+        
+        case 7: // Pink noise
+            // Equal energy per octave rather than per frequency, so it sounds
+            // softer and more natural than white noise: rain, wind, cymbals
+            return noise.Sample(NOISE_PINK) * (1.0 + dLFOAmplitude * dLFO * 0.5);
+
+        case 8: // Brown noise
+            // Falls off twice as fast as pink noise, a deep rumble: surf, thunder
+            return noise.Sample(NOISE_BROWN) * (1.0 + dLFOAmplitude * dLFO * 0.5);
+
+        default:
+            return 0.0;
+    }
+}
+
+// Envelope stage of a voice
+#define ENV_IDLE 0
+#define ENV_ATTACK 1
+#define ENV_DECAY 2
+#define ENV_SUSTAIN 3
+#define ENV_RELEASE 4
+
+// Shape of the attack, decay and release stages
+#define ENV_CURVE_LINEAR 0         // Straight lines, as GetAmplitude() draws them
+#define ENV_CURVE_EXPONENTIAL 1    // Falls (or rises) by the same ratio every sample, like an analog RC
+
+struct sEnvelopeADSR
+{
+
+    double dAttackTime; // Time to reach max volume
+    double dDecayTime; // Time to reach sustain level
+    double dStartAmplitude; // Start volume
+    double dSustainAmplitude; // Sustain level 
+    double dReleaseTime; // Time to release sound
+    double dTriggerOnTime;
+    double dTriggerOffTime;
+    bool bNoteOn;
+    int nCurve; // ENV_CURVE_* shape of the stages, used by sEnvelopeGenerator
+    
+    sEnvelopeADSR()
+    {
+        dAttackTime = 0.100; // 10ms
+        dDecayTime = 0.01; // 100ms
+        dStartAmplitude = 1.0; // 100%
+        dSustainAmplitude = 0.8; // 80%
+        dReleaseTime = 0.200; // 100ms
+        dTriggerOnTime = 0.0;
+        dTriggerOffTime = 0.0;
+        bNoteOn = false;
+        nCurve = ENV_CURVE_LINEAR;
+
+    }
+
+
+    double GetAmplitude(double dTime)
+    {
+        double dAmplitude = 0.0;
+        double dLifeTime = dTime - dTriggerOnTime;
+
+        if (bNoteOn)
+        {
+            // Attack phase
+            if (dLifeTime <= dAttackTime)
+            {
+                dAmplitude = (dLifeTime / dAttackTime); // Scale from 0.0 to 1.0
+            }
+
+            // Decay phase
+            if (dLifeTime > dAttackTime && dLifeTime <= (dAttackTime + dDecayTime))
+            {
+                
+               dAmplitude = ((dLifeTime - dAttackTime) / dDecayTime) * (dSustainAmplitude - dStartAmplitude) + dStartAmplitude;
+            }
+
+            // Sustain phase
+            if (dLifeTime > (dAttackTime + dDecayTime))
+            {
+                dAmplitude = dSustainAmplitude;
+            }
+        }
+        else
+        {
+            // Release phase
+            dAmplitude = ((dTime - dTriggerOffTime) / dReleaseTime) * (0.0 - dSustainAmplitude) + dSustainAmplitude;
+        }
+
+        // Ensure amplitude is not negative
+        if (dAmplitude <= 0.0001)
+        {
+            dAmplitude = 0.0;
+        }
+
+        return dAmplitude;
+    }
+
+    void NoteOn(double dTimeOn)
+    {
+        dTriggerOnTime = dTimeOn;
+        bNoteOn = true;
+    }
+
+    void NoteOff(double dTimeOff)
+    {
+        dTriggerOffTime = dTimeOff;
+        bNoteOn = false;
+    }
+
+};
+
+/**
+ * Envelope that runs as a stage machine instead of from absolute time.
+ *
+ * It holds the current level, the stage, the samples left in that stage and
+ * a per-sample rate: the increment for linear stages, the ratio the distance
+ * to the target shrinks by for exponential ones. Nothing is worked out from
+ * the trigger times, so a sample costs one add (or multiply) and a stage
+ * change happens once, not a test on every sample.
+ *
+ * NextSegment() hands the envelope out as straight pieces, so a whole block
+ * of gains is a few ramps the SIMD kernels apply in one pass. Exponential
+ * stages are cut into pieces of nExpSegment samples, exact at both ends.
+ *
+ * NoteOn() ramps up from whatever level the envelope is at and NoteOff()
+ * releases from it, so neither clicks. The release always takes
+ * dReleaseTime. Once it is over the stage is ENV_IDLE and the voice can go.
+ *
+ * The state is four plain values, so sVoiceManager keeps one array of each
+ * and many voices can be stepped together.
+ */
+struct sEnvelopeGenerator
+{
+    int nStage;
+    float fLevel;
+    float fRate;          // Increment per sample (linear) or ratio per sample (exponential)
+    uint32_t nLeft;       // Samples left in the stage
+
+    static const uint32_t nExpSegment = 32;
+
+    sEnvelopeGenerator()
+    {
+        nStage = ENV_IDLE;
+        fLevel = 0.0f;
+        fRate = 0.0f;
+        nLeft = 0;
+    }
+
+    bool IsIdle() const
+    {
+        return nStage == ENV_IDLE;
+    }
+
+    void NoteOn(const sEnvelopeADSR& env, double dSampleRate)
+    {
+        Enter(ENV_ATTACK, env, dSampleRate);
+    }
+
+    void NoteOff(const sEnvelopeADSR& env, double dSampleRate)
+    {
+        if (nStage != ENV_IDLE && nStage != ENV_RELEASE)
+            Enter(ENV_RELEASE, env, dSampleRate);
+    }
+
+    // Next straight piece of the envelope, at most nMaxFrames long: the gain
+    // is fStart + n * fStep for the n-th sample of it. Moves the envelope to
+    // the end of the piece and returns its length.
+    size_t NextSegment(const sEnvelopeADSR& env, double dSampleRate, size_t nMaxFrames, float& fStart, float& fStep)
+    {
+        // Sustain follows the setting, so it can be changed while notes are held
+        if (nStage == ENV_SUSTAIN)
+            fLevel = (float)env.dSustainAmplitude;
+
+        fStart = fLevel;
+        fStep = 0.0f;
+        if (nStage == ENV_IDLE || nStage == ENV_SUSTAIN || nMaxFrames == 0)
+            return nMaxFrames;
+
+        uint32_t n = (uint32_t)min<size_t>(nMaxFrames, nLeft);
+        if (env.nCurve == ENV_CURVE_EXPONENTIAL)
+            n = n < nExpSegment ? n : nExpSegment;
+
+        float fTarget = Target(env);
+        float fEnd;
+        if (n == nLeft)
+            fEnd = fTarget;
+        else if (env.nCurve == ENV_CURVE_EXPONENTIAL)
+            fEnd = fTarget + (fLevel - fTarget) * powf(fRate, (float)n);
+        else
+            fEnd = fLevel + fRate * (float)n;
+
+        fStep = (fEnd - fLevel) / (float)n;
+        fLevel = fEnd;
+        nLeft -= n;
+
+        if (nLeft == 0)
+            Enter(nStage == ENV_ATTACK ? ENV_DECAY : (nStage == ENV_DECAY ? ENV_SUSTAIN : ENV_IDLE), env, dSampleRate);
+        return n;
+    }
+
+private:
+    float Target(const sEnvelopeADSR& env) const
+    {
+        switch (nStage)
+        {
+        case ENV_ATTACK:  return (float)env.dStartAmplitude;
+        case ENV_DECAY:
+        case ENV_SUSTAIN: return (float)env.dSustainAmplitude;
+        default:          return 0.0f;
+        }
+    }
+
+    // Starts stage nNewStage from the current level. Stages with no length
+    // are passed straight through.
+    void Enter(int nNewStage, const sEnvelopeADSR& env, double dSampleRate)
+    {
+        nStage = nNewStage;
+        float fTarget = Target(env);
+
+        double dSamples = 0.0;
+        switch (nStage)
+        {
+        case ENV_ATTACK:
+            // Same slope whatever level it starts from, so a retriggered
+            // note reaches the top sooner
+            if (env.dStartAmplitude > 0.0)
+                dSamples = env.dAttackTime * dSampleRate * max(0.0, (env.dStartAmplitude - fLevel) / env.dStartAmplitude);
+            break;
+        case ENV_DECAY:   dSamples = env.dDecayTime * dSampleRate; break;
+        case ENV_RELEASE: dSamples = env.dReleaseTime * dSampleRate; break;
+        }
+
+        nLeft = (uint32_t)min(floor(dSamples + 0.5), 4294967295.0);
+        if (nStage == ENV_SUSTAIN || nStage == ENV_IDLE || nLeft == 0)
+        {
+            fLevel = fTarget;
+            fRate = 0.0f;
+            nLeft = 0;
+            if (nStage == ENV_ATTACK || nStage == ENV_DECAY || nStage == ENV_RELEASE)
+                Enter(nStage == ENV_ATTACK ? ENV_DECAY : (nStage == ENV_DECAY ? ENV_SUSTAIN : ENV_IDLE), env, dSampleRate);
+            return;
+        }
+
+        // Exponential stages are 60 dB of the way there when they end
+        if (env.nCurve == ENV_CURVE_EXPONENTIAL)
+            fRate = (float)pow(0.001, 1.0 / (double)nLeft);
+        else
+            fRate = (fTarget - fLevel) / (float)nLeft;
+    }
+};
+
+const int nMaxPartials = 4;
+
+// One oscillator of a preset: amplitude, frequency ratio to the played note,
+// waveform type and LFO settings, exactly as they are passed to osc()
+struct sPartial
+{
+    double dAmplitude;
+    double dRatio;
+    int nType;
+    double dLFOHertz;
+    double dLFOAmplitude;
+};
+
+struct sWavetableOscillator;
+struct sSimdKernels;
+
+// A preset is a sum of up to nMaxPartials oscillators shaped by the envelope
+struct sPreset
+{
+    const char* sName;
+    int nPartials;
+    sPartial partials[nMaxPartials];
+
+    // Render loop compiled for exactly these partials (see synthPatch.h), or
+    // nullptr. Writes the partials, Set() up in pOsc, times the gain ramp
+    // fStart + n * fStep into pOut.
+    void(*RenderPatch)(sWavetableOscillator* pOsc, float* pOut, size_t nFrames, float fStart, float fStep, const sSimdKernels& kernels);
+};
+
+// Sine of a phase given in cycles (1.0 = one full turn), accurate to about 1e-7.
+// The phase is folded into a quarter turn and evaluated as a polynomial, so it
+// costs a handful of multiply-adds instead of a full-range sin() call.
+inline double sinTurns(double dPhase)
+{
+    double x = dPhase - floor(dPhase + 0.5); // -0.5 to 0.5
+    if (x > 0.25) x = 0.5 - x;
+    else if (x < -0.25) x = -0.5 - x;
+
+    double r = 2.0 * PI * x; // -PI/2 to PI/2
+    double r2 = r * r;
+    return r * (1.0 - r2 / 6.0 * (1.0 - r2 / 20.0 * (1.0 - r2 / 42.0 * (1.0 - r2 / 72.0 * (1.0 - r2 / 110.0)))));
+}
+
+// How the SIMD kernels fill in the LFO between control points
+#define MOD_LINEAR 0    // Straight lines between them
+#define MOD_CUBIC 1     // A smooth curve through them, with the slope of the LFO at each
+
+const int nDefaultModPeriod = 32;   // Samples between control points, best kept a multiple of 8
+
+/**
+ * Stateful oscillator that keeps its own wrapped phase instead of deriving it
+ * from absolute time like osc() does.
+ *
+ * Phase is stored in cycles between 0.0 and 1.0 and advanced by a fixed
+ * increment every sample, so precision is the same after 100 hours as it is
+ * after 1 second. The LFO keeps its own phase in the same way. Modulation
+ * depth follows osc(): dLFOAmplitude * dHertz radians of phase for the sine
+ * family, dLFOAmplitude cycles for sawtooth and ramp, amplitude for noise.
+ * Noise comes from the oscillator's own generator; Seed() makes it repeatable.
+ *
+ * Changing frequency or waveform with Set() keeps the phase running, so there
+ * are no clicks when a new note is played.
+ *
+ * The LFO moves slowly, so the block kernels in synthSimd.h only work it out
+ * every nModPeriod samples and interpolate in between (nModInterpolation,
+ * MOD_*). A period of 1 works it out on every sample, as Sample() does.
+ */
+struct sOscillator
+{
+    int nType;
+    double dPhase;        // Position within the current cycle, 0.0 to 1.0
+    double dPhaseInc;     // Cycles advanced per sample
+    double dLFOPhase;
+    double dLFOPhaseInc;
+    double dLFODepth;     // Modulation depth in cycles (or amplitude for noise)
+    int nModPeriod;       // Samples between LFO control points in the block kernels
+    int nModInterpolation;
+    sNoise noise;         // Generator for the noise types
+
+    sOscillator()
+    {
+        nType = OSC_SINE;
+        dPhase = 0.0;
+        dPhaseInc = 0.0;
+        dLFOPhase = 0.0;
+        dLFOPhaseInc = 0.0;
+        dLFODepth = 0.0;
+        nModPeriod = nDefaultModPeriod;
+        nModInterpolation = MOD_LINEAR;
+    }
+
+    void Set(double dHertz, double dSampleRate, int nNewType = OSC_SINE, double dLFOHertz = 0.0, double dLFOAmplitude = 0.0)
+    {
+        nType = nNewType;
+        dPhaseInc = dHertz / dSampleRate;
+        dLFOPhaseInc = dLFOHertz / dSampleRate;
+
+        if (nType == OSC_SAWTOOTH || nType == OSC_RAMP || nType >= OSC_NOISE)
+            dLFODepth = dLFOAmplitude;
+        else
+            dLFODepth = dLFOAmplitude * dHertz / (2.0 * PI);
+    }
+
+    void Reset()
+    {
+        dPhase = 0.0;
+        dLFOPhase = 0.0;
+    }
+
+    void Seed(uint64_t nSeed)
+    {
+        noise.Seed(nSeed);
+    }
+
+    // Returns the next sample and advances the oscillator by one sample
+    double Sample()
+    {
+        switch (nType)
+        {
+        case OSC_SINE:     return Tick<OSC_SINE>();
+        case OSC_SQUARE:   return Tick<OSC_SQUARE>();
+        case OSC_SAWTOOTH: return Tick<OSC_SAWTOOTH>();
+        case OSC_TRIANGLE: return Tick<OSC_TRIANGLE>();
+        case OSC_RAMP:     return Tick<OSC_RAMP>();
+        case OSC_PULSE:    return Tick<OSC_PULSE>();
+        default:           return Tick<OSC_NOISE>();
+        }
+    }
+
+    // Adds dAmplitude * waveform to nFrames samples of pOut. The waveform type
+    // is resolved once for the whole block.
+    void Render(float* pOut, size_t nFrames, double dAmplitude)
+    {
+        switch (nType)
+        {
+        case OSC_SINE:     RenderType<OSC_SINE>(pOut, nFrames, dAmplitude); break;
+        case OSC_SQUARE:   RenderType<OSC_SQUARE>(pOut, nFrames, dAmplitude); break;
+        case OSC_SAWTOOTH: RenderType<OSC_SAWTOOTH>(pOut, nFrames, dAmplitude); break;
+        case OSC_TRIANGLE: RenderType<OSC_TRIANGLE>(pOut, nFrames, dAmplitude); break;
+        case OSC_RAMP:     RenderType<OSC_RAMP>(pOut, nFrames, dAmplitude); break;
+        case OSC_PULSE:    RenderType<OSC_PULSE>(pOut, nFrames, dAmplitude); break;
+        default:           RenderNoise(pOut, nFrames, dAmplitude); break;
+        }
+    }
+
+    // Noise without LFO is a whole block from the generator
+    void RenderNoise(float* pOut, size_t nFrames, double dAmplitude)
+    {
+        if (dLFODepth != 0.0)
+        {
+            RenderType<OSC_NOISE>(pOut, nFrames, dAmplitude);
+            return;
+        }
+
+        noise.Render(nType - OSC_NOISE, pOut, nFrames, (float)dAmplitude);
+        dPhase += dPhaseInc * (double)nFrames;
+        dPhase -= floor(dPhase);
+        dLFOPhase += dLFOPhaseInc * (double)nFrames;
+        dLFOPhase -= floor(dLFOPhase);
+    }
+
+    template<int TYPE>
+    void RenderType(float* pOut, size_t nFrames, double dAmplitude)
+    {
+        for (size_t n = 0; n < nFrames; n++)
+            pOut[n] += (float)(dAmplitude * Tick<TYPE>());
+    }
+
+    template<int TYPE>
+    double Tick()
+    {
+        double dLFO = dLFODepth != 0.0 ? dLFODepth * sinTurns(dLFOPhase) : 0.0;
+        double p = dPhase;
+        if (TYPE != OSC_NOISE && dLFO != 0.0)
+        {
+            p += dLFO;
+            p -= floor(p);
+        }
+
+        double dOut;
+        switch (TYPE)
+        {
+        case OSC_SINE:     dOut = sinTurns(p); break;
+        case OSC_SQUARE:   dOut = p < 0.5 ? 1.0 : -1.0; break;
+        case OSC_SAWTOOTH: dOut = p < 0.5 ? 2.0 * p : 2.0 * p - 2.0; break;
+        case OSC_TRIANGLE: dOut = p < 0.25 ? 4.0 * p : (p < 0.75 ? 2.0 - 4.0 * p : 4.0 * p - 4.0); break;
+        case OSC_RAMP:     dOut = 2.0 * p - 1.0; break;
+        case OSC_PULSE:    dOut = p < 0.5 ? 1.0 : 0.0; break;
+        default:           dOut = noise.Sample(nType - OSC_NOISE) * (1.0 + dLFO * 0.5); break;
+        }
+
+        dPhase += dPhaseInc;
+        if (dPhase >= 1.0) dPhase -= 1.0;
+        dLFOPhase += dLFOPhaseInc;
+        if (dLFOPhase >= 1.0) dLFOPhase -= 1.0;
+
+        return dOut;
+    }
+};
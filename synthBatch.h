@@ -0,0 +1,451 @@
+/*
+    Batch rendering: many scores to many WAV files, faster than realtime.
+
+    RenderBatch() takes a list of jobs, each a Standard MIDI file or a text
+    score (see synthInput.h) and the WAV file to write, and renders them on
+    a pool of threads, one job per thread at a time. Jobs are handed out in
+    order from a shared counter, so a long file only holds up its own
+    thread.
+
+    Each job streams: its events are played through its own sVoiceManager a
+    block at a time, the way the audio thread plays them, and every block is
+    converted and written to the file as soon as it is rendered. A job's
+    memory is its event list, its voices and one block, however long the
+    audio runs. Notes still held after the last event are released there,
+    and the file ends once every voice has finished its release.
+
+    Output is dry, with no effects bus, and the same input always renders
+    the same file.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include "olcNoiseMaker.h"
+#include "synth.h"
+#include "synthVoices.h"
+#include "synthEvents.h"
+#include "synthOffline.h"
+#include "synthInput.h"
+#include "synthMidiFile.h"
+
+struct sBatchSettings
+{
+    double dSampleRate;
+    unsigned int nThreads;         // 0 uses every hardware thread
+    unsigned int nChannels;        // 1 for mono, 2 for stereo with PARAM_PAN
+    size_t nVoices;                // Voices per job; beyond this notes are stolen
+    const sPreset* pPresets;       // Presets PARAM_PRESET indexes into
+    int nPresetCount;
+    int nPreset;                   // Preset in use before any PARAM_PRESET
+    sEnvelopeADSR envelope;        // Envelope in use before any PARAM_* change
+    double dMasterVolume;
+    bool bDither;                  // TPDF dither integer output
+    uint64_t nSeed;                // Noise seed; the same seed gives the same render
+
+    sBatchSettings()
+    {
+        dSampleRate = 44100.0;
+        nThreads = 0;
+        nChannels = 2;
+        nVoices = 128;
+        pPresets = nullptr;
+        nPresetCount = 0;
+        nPreset = 0;
+        dMasterVolume = 0.4;
+        bDither = true;
+        nSeed = 1;
+    }
+};
+
+struct sBatchJob
+{
+    string sInput;     // .mid or .midi for a MIDI file, anything else is a text score
+    string sOutput;    // WAV file written
+};
+
+struct sBatchResult
+{
+    bool bOk;
+    string sError;
+    size_t nEvents;
+    uint64_t nFrames;
+    double dRenderSeconds;     // Wall-clock time the job took, loading included
+    double dRealtimeFactor;    // Seconds of audio rendered per second of wall-clock time
+};
+
+struct sBatchStats
+{
+    size_t nJobs;
+    size_t nFailed;
+    unsigned int nThreads;
+    double dAudioSeconds;      // Audio written by every job together
+    double dWallSeconds;
+    double dFilesPerSecond;
+    double dRealtimeFactor;    // Seconds of audio rendered per second of wall-clock time, over all jobs
+};
+
+// True if sFile ends in sExtension, ignoring case
+inline bool HasExtension(const string& sFile, const string& sExtension)
+{
+    if (sFile.size() < sExtension.size())
+        return false;
+    for (size_t i = 0; i < sExtension.size(); i++)
+        if (tolower((unsigned char)sFile[sFile.size() - sExtension.size() + i]) != tolower((unsigned char)sExtension[i]))
+            return false;
+    return true;
+}
+
+inline bool IsMidiFileName(const string& sFile)
+{
+    return HasExtension(sFile, ".mid") || HasExtension(sFile, ".midi");
+}
+
+// Adds sPath to vFiles, or if it is a directory, the MIDI files and scores
+// (.mid, .midi, .txt, .score) in it, sorted by name. Returns false if
+// sPath cannot be read.
+inline bool ListScoreFiles(const string& sPath, vector<string>& vFiles)
+{
+    auto bScore = [](const string& sName)
+    {
+        return IsMidiFileName(sName) || HasExtension(sName, ".txt") || HasExtension(sName, ".score");
+    };
+
+    vector<string> vFound;
+#if defined(_WIN32)
+    DWORD nAttributes = GetFileAttributesA(sPath.c_str());
+    if (nAttributes == INVALID_FILE_ATTRIBUTES)
+        return false;
+    if (!(nAttributes & FILE_ATTRIBUTE_DIRECTORY))
+    {
+        vFiles.push_back(sPath);
+        return true;
+    }
+
+    WIN32_FIND_DATAA find;
+    HANDLE hFind = FindFirstFileA((sPath + "\\*").c_str(), &find);
+    if (hFind != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            if (!(find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) && bScore(find.cFileName))
+                vFound.push_back(sPath + "\\" + find.cFileName);
+        } while (FindNextFileA(hFind, &find));
+        FindClose(hFind);
+    }
+#else
+    struct stat info;
+    if (stat(sPath.c_str(), &info) != 0)
+        return false;
+    if (!S_ISDIR(info.st_mode))
+    {
+        vFiles.push_back(sPath);
+        return true;
+    }
+
+    DIR* pDir = opendir(sPath.c_str());
+    if (pDir == nullptr)
+        return false;
+    for (dirent* pEntry = readdir(pDir); pEntry != nullptr; pEntry = readdir(pDir))
+    {
+        string sFile = sPath + "/" + pEntry->d_name;
+        if (bScore(pEntry->d_name) && stat(sFile.c_str(), &info) == 0 && S_ISREG(info.st_mode))
+            vFound.push_back(sFile);
+    }
+    closedir(pDir);
+#endif
+
+    sort(vFound.begin(), vFound.end());
+    vFiles.insert(vFiles.end(), vFound.begin(), vFound.end());
+    return true;
+}
+
+// Makes directory sPath if it is not there already
+inline bool MakeDirectory(const string& sPath)
+{
+#if defined(_WIN32)
+    return _mkdir(sPath.c_str()) == 0 || errno == EEXIST;
+#else
+    return mkdir(sPath.c_str(), 0777) == 0 || errno == EEXIST;
+#endif
+}
+
+// sInput's file name with its extension swapped for .wav, in sDirectory
+inline string BatchOutputName(const string& sInput, const string& sDirectory)
+{
+    size_t nSlash = sInput.find_last_of("/\\");
+    string sName = nSlash == string::npos ? sInput : sInput.substr(nSlash + 1);
+    size_t nDot = sName.find_last_of('.');
+    if (nDot != string::npos && nDot > 0)
+        sName.resize(nDot);
+    return sDirectory + "/" + sName + ".wav";
+}
+
+// sFile in lower case with backslashes as '/', so two spellings of one file compare equal
+inline string BatchFileKey(const string& sFile)
+{
+    string sKey = sFile;
+    for (char& c : sKey)
+        c = c == '\\' ? '/' : (char)tolower((unsigned char)c);
+    return sKey;
+}
+
+// One job per input, written to sDirectory. Inputs that would share an
+// output name, like a/x.mid and b/x.mid or x.mid and x.txt, are numbered
+// after the first: x.wav, x-2.wav, x-3.wav.
+inline vector<sBatchJob> BatchJobs(const vector<string>& vInputs, const string& sDirectory)
+{
+    vector<sBatchJob> vJobs;
+    map<string, int> mapTaken;
+    for (const string& sInput : vInputs)
+    {
+        string sOutput = BatchOutputName(sInput, sDirectory);
+        string sBase = sOutput.substr(0, sOutput.size() - 4);
+        for (int n = 2; mapTaken.count(BatchFileKey(sOutput)) > 0; n++)
+            sOutput = sBase + "-" + to_string(n) + ".wav";
+        mapTaken[BatchFileKey(sOutput)] = 1;
+        vJobs.push_back({ sInput, sOutput });
+    }
+    return vJobs;
+}
+
+// Reads a MIDI file or text score into events on frames, in frame order.
+// Score lines with no time play at the time of the line before.
+inline bool LoadScoreEvents(const string& sFile, double dSampleRate, vector<sEvent>& vEvents, string& sError)
+{
+    vector<sTimedEvent> vTimed;
+    if (IsMidiFileName(sFile))
+    {
+        if (!LoadMidiFile(sFile, vTimed, sError))
+            return false;
+    }
+    else
+    {
+        ifstream file(sFile);
+        if (!file)
+        {
+            sError = "cannot open " + sFile;
+            return false;
+        }
+        if (!ReadScore(file, vTimed, sError))
+        {
+            sError = sFile + ": " + sError;
+            return false;
+        }
+    }
+
+    double dTime = 0.0;
+    vEvents.clear();
+    vEvents.reserve(vTimed.size());
+    for (sTimedEvent& e : vTimed)
+    {
+        if (e.dTime >= 0.0)
+            dTime = e.dTime;
+        e.event.nFrame = (uint64_t)llround(dTime * dSampleRate);
+        vEvents.push_back(e.event);
+    }
+
+    stable_sort(vEvents.begin(), vEvents.end(), [](const sEvent& a, const sEvent& b) { return a.nFrame < b.nFrame; });
+    return true;
+}
+
+// An event list read in order, with the Peek() and Pop() of sEventQueue so
+// RenderWithEvents() can play it
+class sEventListCursor
+{
+public:
+    sEventListCursor(const vector<sEvent>& vEvents) : m_vEvents(vEvents) {}
+
+    bool Peek(sEvent& e) const
+    {
+        if (m_nNext == m_vEvents.size())
+            return false;
+        e = m_vEvents[m_nNext];
+        return true;
+    }
+
+    bool Pop(sEvent& e)
+    {
+        if (!Peek(e))
+            return false;
+        m_nNext++;
+        return true;
+    }
+
+private:
+    const vector<sEvent>& m_vEvents;
+    size_t m_nNext = 0;
+};
+
+// Renders one job, streaming it to its WAV file as T
+template<class T>
+sBatchResult RenderBatchJob(const sBatchJob& job, const sBatchSettings& settings)
+{
+    const size_t nBlock = 1024;
+    auto tStart = chrono::steady_clock::now();
+
+    sBatchResult result = { false, "", 0, 0, 0.0, 0.0 };
+
+    vector<sEvent> vEvents;
+    if (!LoadScoreEvents(job.sInput, settings.dSampleRate, vEvents, result.sError))
+        return result;
+    result.nEvents = vEvents.size();
+
+    // Held notes are let go after the last event
+    vEvents.push_back(sEvent::AllNotesOff(vEvents.empty() ? 0 : vEvents.back().nFrame));
+
+    unsigned int nChannels = min(max(settings.nChannels, 1u), 2u);
+    vector<float> vChannels(nBlock * nChannels);
+    vector<float> vInterleaved(nBlock * nChannels);
+    vector<T> vOut(nBlock * nChannels);
+    float* ppChannels[2] = { &vChannels[0], &vChannels[nBlock * (nChannels - 1)] };
+
+    sVoiceManager voices(settings.nVoices, nBlock);
+    voices.pPreset = settings.nPreset >= 0 && settings.nPreset < settings.nPresetCount ? &settings.pPresets[settings.nPreset] : nullptr;
+    voices.envelope = settings.envelope;
+    voices.dSampleRate = settings.dSampleRate;
+    voices.nSeed = settings.nSeed;
+    double dGain = settings.dMasterVolume;
+
+    olcSampleConverter converter(settings.bDither, (uint32_t)settings.nSeed);
+    olcNoiseBackendWav wav(job.sOutput);
+    olcNoiseFormat format = { (unsigned int)settings.dSampleRate, nChannels, olcSampleType<T>::nBits, olcSampleType<T>::bFloat };
+    if (!wav.Open(format, (char*)vOut.data(), 1, (unsigned int)(vOut.size() * sizeof(T))))
+    {
+        result.sError = "cannot write " + job.sOutput;
+        return result;
+    }
+
+    auto handle = [&](const sEvent& e)
+    {
+        const double dTime = (double)e.nFrame / settings.dSampleRate;
+
+        switch (e.nType)
+        {
+        case EVENT_NOTE_ON:       voices.NoteOn(e.nNote, e.dValue, dTime); break;
+        case EVENT_NOTE_OFF:      voices.NoteOff(e.nNote, dTime); break;
+        case EVENT_ALL_NOTES_OFF: voices.AllNotesOff(dTime); break;
+        case EVENT_PARAMETER:
+            switch (e.nParam)
+            {
+            case PARAM_PRESET:
+                if ((int)e.dValue >= 0 && (int)e.dValue < settings.nPresetCount)
+                    voices.pPreset = &settings.pPresets[(int)e.dValue];
+                break;
+            case PARAM_MASTER_VOLUME:     dGain = e.dValue; break;
+            case PARAM_STEAL_POLICY:      voices.nStealPolicy = (int)e.dValue; break;
+            case PARAM_ATTACK_TIME:       voices.envelope.dAttackTime = e.dValue; break;
+            case PARAM_DECAY_TIME:        voices.envelope.dDecayTime = e.dValue; break;
+            case PARAM_SUSTAIN_AMPLITUDE: voices.envelope.dSustainAmplitude = e.dValue; break;
+            case PARAM_RELEASE_TIME:      voices.envelope.dReleaseTime = e.dValue; break;
+            case PARAM_PAN:               voices.dPan = e.dValue; break;
+            }
+            break;
+        }
+    };
+
+    // Blocks until the events have run out and the last release is over
+    sEventListCursor cursor(vEvents);
+    sEvent next;
+    uint64_t nFrame = 0;
+    while (cursor.Peek(next) || voices.ActiveVoices() > 0)
+    {
+        for (unsigned int c = 0; c < nChannels; c++)
+            fill(ppChannels[c], ppChannels[c] + nBlock, 0.0f);
+
+        RenderWithEvents(cursor, nFrame, nBlock, handle, [&](size_t nOffset, size_t nSpan, uint64_t)
+        {
+            float* ppSpan[2] = { ppChannels[0] + nOffset, ppChannels[1] + nOffset };
+            voices.Render(ppSpan, nChannels, nSpan);
+            for (unsigned int c = 0; c < nChannels; c++)
+                for (size_t n = 0; n < nSpan; n++)
+                    ppSpan[c][n] *= (float)dGain;
+        });
+
+        olcInterleave(ppChannels, nChannels, nBlock, vInterleaved.data());
+        converter.Convert(vInterleaved.data(), vOut.data(), vOut.size());
+        if (!wav.Write((const char*)vOut.data(), vOut.size() * sizeof(T)))
+        {
+            wav.Close();
+            result.sError = "error writing " + job.sOutput;
+            return result;
+        }
+        nFrame += nBlock;
+    }
+    if (!wav.Close())
+    {
+        result.sError = "error writing " + job.sOutput;
+        return result;
+    }
+
+    result.bOk = true;
+    result.nFrames = nFrame;
+    result.dRenderSeconds = chrono::duration<double>(chrono::steady_clock::now() - tStart).count();
+    result.dRealtimeFactor = result.dRenderSeconds > 0.0 ? ((double)nFrame / settings.dSampleRate) / result.dRenderSeconds : 0.0;
+    return result;
+}
+
+// Renders every job, filling vResults in job order. A job that fails is
+// reported in its result and does not stop the others. A job writing the
+// same file as an earlier one fails without running, so no two threads
+// ever write one file; BatchJobs() gives every input its own name.
+template<class T = short>
+sBatchStats RenderBatch(const vector<sBatchJob>& vJobs, const sBatchSettings& settings, vector<sBatchResult>& vResults)
+{
+    auto tStart = chrono::steady_clock::now();
+
+    unsigned int nThreads = settings.nThreads > 0 ? settings.nThreads : max(1u, thread::hardware_concurrency());
+    nThreads = (unsigned int)max<size_t>(1, min<size_t>(nThreads, vJobs.size()));
+
+    vResults.assign(vJobs.size(), sBatchResult());
+    vector<bool> vDuplicate(vJobs.size(), false);
+    map<string, size_t> mapOutputs;
+    for (size_t i = 0; i < vJobs.size(); i++)
+    {
+        auto it = mapOutputs.insert(make_pair(BatchFileKey(vJobs[i].sOutput), i));
+        if (!it.second)
+        {
+            vDuplicate[i] = true;
+            vResults[i].sError = vJobs[i].sOutput + " is already written from " + vJobs[it.first->second].sInput;
+        }
+    }
+
+    ParallelFor(vJobs.size(), nThreads, [&](size_t i)
+    {
+        if (!vDuplicate[i])
+            vResults[i] = RenderBatchJob<T>(vJobs[i], settings);
+    });
+
+    sBatchStats stats;
+    stats.nJobs = vJobs.size();
+    stats.nFailed = 0;
+    stats.nThreads = nThreads;
+    stats.dAudioSeconds = 0.0;
+    for (const sBatchResult& result : vResults)
+    {
+        stats.nFailed += result.bOk ? 0 : 1;
+        stats.dAudioSeconds += (double)result.nFrames / settings.dSampleRate;
+    }
+    stats.dWallSeconds = chrono::duration<double>(chrono::steady_clock::now() - tStart).count();
+    stats.dFilesPerSecond = stats.dWallSeconds > 0.0 ? (double)(stats.nJobs - stats.nFailed) / stats.dWallSeconds : 0.0;
+    stats.dRealtimeFactor = stats.dWallSeconds > 0.0 ? stats.dAudioSeconds / stats.dWallSeconds : 0.0;
+    return stats;
+}
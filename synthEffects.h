@@ -0,0 +1,767 @@
+/*
+    Post-mix effects.
+
+    sEffectsBus runs a chain of effects over the mixed voices, after the
+    master volume and before olcNoiseMaker converts the block for the
+    device. Every effect works on whole blocks of planar channels, in place:
+
+      sBiquadEffect          RBJ cookbook biquads (low/high/band pass, notch,
+                             peak and shelves), transposed direct form II
+      sStateVariableEffect   trapezoidal state variable filter, stable while
+                             its cutoff moves
+      sDelayEffect           feedback delay on a cache-aligned ring buffer
+      sConvolutionReverb     uniformly partitioned FFT convolution with an
+                             impulse response
+
+    All memory is allocated when an effect is made; Process() never touches
+    the heap. Setters are meant for the audio thread (for example from the
+    event handler), like every other engine parameter. The work per block
+    is fixed by the block length and the settings: the reverb does one FFT,
+    one inverse FFT and one multiply-add per partition of the impulse for
+    every nPartition samples.
+*/
+
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "olcNoiseMaker.h"
+#include "synthSimd.h"
+#include "synthNoise.h"
+
+// Most channels an effect keeps state for
+const unsigned int nMaxEffectChannels = 8;
+
+class sEffect
+{
+public:
+    bool bBypass = false;
+
+    virtual ~sEffect() {}
+
+    // Processes nFrames samples of nChannels planar channels in place
+    virtual void Process(float* const* ppChannels, unsigned int nChannels, size_t nFrames) = 0;
+
+    // Clears filter memory, delay lines and reverb tails
+    virtual void Reset() = 0;
+};
+
+// Biquad types
+#define BIQUAD_LOWPASS 0
+#define BIQUAD_HIGHPASS 1
+#define BIQUAD_BANDPASS 2
+#define BIQUAD_NOTCH 3
+#define BIQUAD_PEAK 4
+#define BIQUAD_LOWSHELF 5
+#define BIQUAD_HIGHSHELF 6
+
+// One channel of a biquad. Coefficients are worked out in double and run in
+// float, normalised so a0 is 1.
+struct sBiquad
+{
+    float b0 = 1.0f, b1 = 0.0f, b2 = 0.0f, a1 = 0.0f, a2 = 0.0f;
+    float z1 = 0.0f, z2 = 0.0f;
+
+    // dGainDB is only used by the peak and shelf types
+    void Set(int nType, double dHertz, double dQ, double dGainDB, double dSampleRate)
+    {
+        double w0 = 2.0 * PI * min(dHertz, dSampleRate * 0.49) / dSampleRate;
+        double dCos = cos(w0), dSin = sin(w0);
+        double dAlpha = dSin / (2.0 * max(dQ, 0.01));
+        double A = pow(10.0, dGainDB / 40.0);
+        double dRootA = 2.0 * sqrt(A) * dAlpha;
+
+        double nb0, nb1, nb2, na0, na1, na2;
+        switch (nType)
+        {
+        case BIQUAD_HIGHPASS:
+            nb0 = (1.0 + dCos) / 2.0; nb1 = -(1.0 + dCos); nb2 = nb0;
+            na0 = 1.0 + dAlpha; na1 = -2.0 * dCos; na2 = 1.0 - dAlpha;
+            break;
+        case BIQUAD_BANDPASS:
+            nb0 = dAlpha; nb1 = 0.0; nb2 = -dAlpha;
+            na0 = 1.0 + dAlpha; na1 = -2.0 * dCos; na2 = 1.0 - dAlpha;
+            break;
+        case BIQUAD_NOTCH:
+            nb0 = 1.0; nb1 = -2.0 * dCos; nb2 = 1.0;
+            na0 = 1.0 + dAlpha; na1 = -2.0 * dCos; na2 = 1.0 - dAlpha;
+            break;
+        case BIQUAD_PEAK:
+            nb0 = 1.0 + dAlpha * A; nb1 = -2.0 * dCos; nb2 = 1.0 - dAlpha * A;
+            na0 = 1.0 + dAlpha / A; na1 = -2.0 * dCos; na2 = 1.0 - dAlpha / A;
+            break;
+        case BIQUAD_LOWSHELF:
+            nb0 = A * ((A + 1.0) - (A - 1.0) * dCos + dRootA);
+            nb1 = 2.0 * A * ((A - 1.0) - (A + 1.0) * dCos);
+            nb2 = A * ((A + 1.0) - (A - 1.0) * dCos - dRootA);
+            na0 = (A + 1.0) + (A - 1.0) * dCos + dRootA;
+            na1 = -2.0 * ((A - 1.0) + (A + 1.0) * dCos);
+            na2 = (A + 1.0) + (A - 1.0) * dCos - dRootA;
+            break;
+        case BIQUAD_HIGHSHELF:
+            nb0 = A * ((A + 1.0) + (A - 1.0) * dCos + dRootA);
+            nb1 = -2.0 * A * ((A - 1.0) + (A + 1.0) * dCos);
+            nb2 = A * ((A + 1.0) + (A - 1.0) * dCos - dRootA);
+            na0 = (A + 1.0) - (A - 1.0) * dCos + dRootA;
+            na1 = 2.0 * ((A - 1.0) - (A + 1.0) * dCos);
+            na2 = (A + 1.0) - (A - 1.0) * dCos - dRootA;
+            break;
+        default:
+            nb0 = (1.0 - dCos) / 2.0; nb1 = 1.0 - dCos; nb2 = nb0;
+            na0 = 1.0 + dAlpha; na1 = -2.0 * dCos; na2 = 1.0 - dAlpha;
+            break;
+        }
+
+        b0 = (float)(nb0 / na0);
+        b1 = (float)(nb1 / na0);
+        b2 = (float)(nb2 / na0);
+        a1 = (float)(na1 / na0);
+        a2 = (float)(na2 / na0);
+    }
+
+    void Process(float* p, size_t nFrames)
+    {
+        float s1 = z1, s2 = z2;
+        for (size_t n = 0; n < nFrames; n++)
+        {
+            float x = p[n];
+            float y = b0 * x + s1;
+            s1 = b1 * x - a1 * y + s2;
+            s2 = b2 * x - a2 * y;
+            p[n] = y;
+        }
+        z1 = s1;
+        z2 = s2;
+    }
+
+    void Reset()
+    {
+        z1 = z2 = 0.0f;
+    }
+};
+
+class sBiquadEffect : public sEffect
+{
+public:
+    sBiquadEffect(int nType, double dHertz, double dQ, double dGainDB, double dSampleRate)
+    {
+        m_dSampleRate = dSampleRate;
+        Set(nType, dHertz, dQ, dGainDB);
+    }
+
+    // Keeps the filter memory, so it can be swept while playing
+    void Set(int nType, double dHertz, double dQ, double dGainDB = 0.0)
+    {
+        for (sBiquad& b : m_biquads)
+            b.Set(nType, dHertz, dQ, dGainDB, m_dSampleRate);
+    }
+
+    void Process(float* const* ppChannels, unsigned int nChannels, size_t nFrames) override
+    {
+        for (unsigned int c = 0; c < nChannels && c < nMaxEffectChannels; c++)
+            m_biquads[c].Process(ppChannels[c], nFrames);
+    }
+
+    void Reset() override
+    {
+        for (sBiquad& b : m_biquads)
+            b.Reset();
+    }
+
+private:
+    double m_dSampleRate;
+    sBiquad m_biquads[nMaxEffectChannels];
+};
+
+// State variable filter outputs
+#define SVF_LOWPASS 0
+#define SVF_HIGHPASS 1
+#define SVF_BANDPASS 2
+#define SVF_NOTCH 3
+
+// One channel of a trapezoidal (zero-delay feedback) state variable filter.
+// Its state is the two integrator outputs, so changing the cutoff between
+// blocks does not click.
+struct sStateVariableFilter
+{
+    int nMode = SVF_LOWPASS;
+    float k = 1.0f, a1 = 1.0f, a2 = 0.0f, a3 = 0.0f;
+    float ic1 = 0.0f, ic2 = 0.0f;
+
+    void Set(int nNewMode, double dHertz, double dQ, double dSampleRate)
+    {
+        double g = tan(PI * min(dHertz, dSampleRate * 0.49) / dSampleRate);
+        double dK = 1.0 / max(dQ, 0.01);
+        double dA1 = 1.0 / (1.0 + g * (g + dK));
+        nMode = nNewMode;
+        k = (float)dK;
+        a1 = (float)dA1;
+        a2 = (float)(g * dA1);
+        a3 = (float)(g * g * dA1);
+    }
+
+    void Process(float* p, size_t nFrames)
+    {
+        switch (nMode)
+        {
+        case SVF_HIGHPASS: Run<SVF_HIGHPASS>(p, nFrames); break;
+        case SVF_BANDPASS: Run<SVF_BANDPASS>(p, nFrames); break;
+        case SVF_NOTCH:    Run<SVF_NOTCH>(p, nFrames); break;
+        default:           Run<SVF_LOWPASS>(p, nFrames); break;
+        }
+    }
+
+    void Reset()
+    {
+        ic1 = ic2 = 0.0f;
+    }
+
+private:
+    // The output is picked once per block
+    template<int MODE>
+    void Run(float* p, size_t nFrames)
+    {
+        float s1 = ic1, s2 = ic2;
+        for (size_t n = 0; n < nFrames; n++)
+        {
+            float v0 = p[n];
+            float v3 = v0 - s2;
+            float v1 = a1 * s1 + a2 * v3;
+            float v2 = s2 + a2 * s1 + a3 * v3;
+            s1 = 2.0f * v1 - s1;
+            s2 = 2.0f * v2 - s2;
+
+            switch (MODE)
+            {
+            case SVF_HIGHPASS: p[n] = v0 - k * v1 - v2; break;
+            case SVF_BANDPASS: p[n] = v1; break;
+            case SVF_NOTCH:    p[n] = v0 - k * v1; break;
+            default:           p[n] = v2; break;
+            }
+        }
+        ic1 = s1;
+        ic2 = s2;
+    }
+};
+
+class sStateVariableEffect : public sEffect
+{
+public:
+    sStateVariableEffect(int nMode, double dHertz, double dQ, double dSampleRate)
+    {
+        m_dSampleRate = dSampleRate;
+        Set(nMode, dHertz, dQ);
+    }
+
+    void Set(int nMode, double dHertz, double dQ)
+    {
+        for (sStateVariableFilter& f : m_filters)
+            f.Set(nMode, dHertz, dQ, m_dSampleRate);
+    }
+
+    void Process(float* const* ppChannels, unsigned int nChannels, size_t nFrames) override
+    {
+        for (unsigned int c = 0; c < nChannels && c < nMaxEffectChannels; c++)
+            m_filters[c].Process(ppChannels[c], nFrames);
+    }
+
+    void Reset() override
+    {
+        for (sStateVariableFilter& f : m_filters)
+            f.Reset();
+    }
+
+private:
+    double m_dSampleRate;
+    sStateVariableFilter m_filters[nMaxEffectChannels];
+};
+
+// Ring buffer of samples, a power of two long and starting on a cache line.
+// Reads and writes go in contiguous runs, split only where the ring wraps.
+class sDelayLine
+{
+public:
+    // Holds at least nMaxDelay samples of history
+    void Allocate(size_t nMaxDelay)
+    {
+        size_t nSize = 1;
+        while (nSize < nMaxDelay + 1)
+            nSize <<= 1;
+        m_buffer.Assign(nSize);
+        m_nMask = nSize - 1;
+        m_nWrite = 0;
+    }
+
+    size_t MaxDelay() const
+    {
+        return m_nMask;
+    }
+
+    // For each of nFrames samples: reads the sample written nDelay samples
+    // ago, writes x + feedback * that, and outputs dry * x + wet * that
+    void Process(float* p, size_t nFrames, size_t nDelay, float fFeedback, float fDry, float fWet)
+    {
+        nDelay = min(max(nDelay, (size_t)1), m_nMask);
+        float* pBuffer = m_buffer.Data();
+        size_t nSize = m_nMask + 1;
+
+        size_t n = 0;
+        while (n < nFrames)
+        {
+            // A run stops where either end wraps, and is never longer than
+            // the delay so it only reads samples written before it started
+            size_t nRead = (m_nWrite - nDelay) & m_nMask;
+            size_t nRun = min(nFrames - n, nDelay);
+            nRun = min(nRun, nSize - m_nWrite);
+            nRun = min(nRun, nSize - nRead);
+
+            float* pWrite = pBuffer + m_nWrite;
+            const float* pRead = pBuffer + nRead;
+            float* pOut = p + n;
+            for (size_t i = 0; i < nRun; i++)
+            {
+                float x = pOut[i];
+                float y = pRead[i];
+                pWrite[i] = x + fFeedback * y;
+                pOut[i] = fDry * x + fWet * y;
+            }
+
+            m_nWrite = (m_nWrite + nRun) & m_nMask;
+            n += nRun;
+        }
+    }
+
+    void Reset()
+    {
+        memset(m_buffer.Data(), 0, m_buffer.Size() * sizeof(float));
+        m_nWrite = 0;
+    }
+
+private:
+    olcAlignedArray<float> m_buffer;
+    size_t m_nMask = 0;
+    size_t m_nWrite = 0;
+};
+
+class sDelayEffect : public sEffect
+{
+public:
+    sDelayEffect(double dMaxSeconds, double dSampleRate)
+    {
+        m_dSampleRate = dSampleRate;
+        for (sDelayLine& line : m_lines)
+            line.Allocate((size_t)ceil(dMaxSeconds * dSampleRate));
+        Set(dMaxSeconds * 0.5, 0.3, 0.3);
+    }
+
+    // Delay time is clamped to what was allocated
+    void Set(double dSeconds, double dFeedback, double dMix)
+    {
+        m_nDelay = (size_t)llround(dSeconds * m_dSampleRate);
+        m_fFeedback = (float)dFeedback;
+        m_fWet = (float)dMix;
+        m_fDry = (float)(1.0 - dMix);
+    }
+
+    void Process(float* const* ppChannels, unsigned int nChannels, size_t nFrames) override
+    {
+        for (unsigned int c = 0; c < nChannels && c < nMaxEffectChannels; c++)
+            m_lines[c].Process(ppChannels[c], nFrames, m_nDelay, m_fFeedback, m_fDry, m_fWet);
+    }
+
+    void Reset() override
+    {
+        for (sDelayLine& line : m_lines)
+            line.Reset();
+    }
+
+private:
+    double m_dSampleRate;
+    size_t m_nDelay;
+    float m_fFeedback, m_fDry, m_fWet;
+    sDelayLine m_lines[nMaxEffectChannels];
+};
+
+// Real FFT of nSize samples, a power of two, done as a complex FFT of half
+// the size. Spectra are nSize / 2 + 1 bins held as separate real and
+// imaginary arrays. Tables are built once; Forward() and Inverse() do not
+// allocate.
+class sRealFFT
+{
+public:
+    void Allocate(size_t nSize)
+    {
+        m_nSize = nSize;
+        m_nHalf = nSize / 2;
+
+        m_vBitReverse.assign(m_nHalf, 0);
+        int nBits = 0;
+        while (((size_t)1 << nBits) < m_nHalf)
+            nBits++;
+        for (size_t i = 0; i < m_nHalf; i++)
+        {
+            uint32_t r = 0;
+            for (int b = 0; b < nBits; b++)
+                if (i & ((size_t)1 << b))
+                    r |= 1u << (nBits - 1 - b);
+            m_vBitReverse[i] = r;
+        }
+
+        // Twiddles of the half-size FFT, then of the split into real bins
+        m_vCos.assign(m_nHalf / 2 + 1, 0.0f);
+        m_vSin.assign(m_nHalf / 2 + 1, 0.0f);
+        for (size_t k = 0; k < m_vCos.size(); k++)
+        {
+            m_vCos[k] = (float)cos(2.0 * PI * (double)k / (double)m_nHalf);
+            m_vSin[k] = (float)sin(2.0 * PI * (double)k / (double)m_nHalf);
+        }
+        m_vSplitCos.assign(m_nHalf + 1, 0.0f);
+        m_vSplitSin.assign(m_nHalf + 1, 0.0f);
+        for (size_t k = 0; k <= m_nHalf; k++)
+        {
+            m_vSplitCos[k] = (float)cos(2.0 * PI * (double)k / (double)m_nSize);
+            m_vSplitSin[k] = (float)sin(2.0 * PI * (double)k / (double)m_nSize);
+        }
+
+        m_vRe.assign(m_nHalf, 0.0f);
+        m_vIm.assign(m_nHalf, 0.0f);
+    }
+
+    size_t Size() const
+    {
+        return m_nSize;
+    }
+
+    size_t Bins() const
+    {
+        return m_nHalf + 1;
+    }
+
+    // nSize samples of pIn to Bins() bins
+    void Forward(const float* pIn, float* pRe, float* pIm)
+    {
+        // Even samples as the real part, odd as the imaginary
+        for (size_t n = 0; n < m_nHalf; n++)
+        {
+            uint32_t r = m_vBitReverse[n];
+            m_vRe[r] = pIn[2 * n];
+            m_vIm[r] = pIn[2 * n + 1];
+        }
+        Butterflies(-1.0f);
+
+        // Untangle: X[k] = E[k] + e^(-2 pi i k / N) O[k]
+        for (size_t k = 0; k <= m_nHalf; k++)
+        {
+            size_t j = k % m_nHalf, m = (m_nHalf - k) % m_nHalf;
+            float zr = m_vRe[j], zi = m_vIm[j];
+            float cr = m_vRe[m], ci = -m_vIm[m];
+            float er = 0.5f * (zr + cr), ei = 0.5f * (zi + ci);
+            float or_ = 0.5f * (zi - ci), oi = -0.5f * (zr - cr);
+            float wr = m_vSplitCos[k], wi = -m_vSplitSin[k];
+            pRe[k] = er + wr * or_ - wi * oi;
+            pIm[k] = ei + wr * oi + wi * or_;
+        }
+    }
+
+    // Bins() bins to nSize samples of pOut, scaled so Inverse(Forward(x)) is x
+    void Inverse(const float* pRe, const float* pIm, float* pOut)
+    {
+        for (size_t k = 0; k < m_nHalf; k++)
+        {
+            size_t m = m_nHalf - k;
+            float xr = pRe[k], xi = pIm[k];
+            float cr = pRe[m], ci = -pIm[m];
+            float er = 0.5f * (xr + cr), ei = 0.5f * (xi + ci);
+            float dr = 0.5f * (xr - cr), di = 0.5f * (xi - ci);
+
+            // O[k] = (X[k] - conj(X[N/2 - k])) e^(2 pi i k / N) / 2
+            float wr = m_vSplitCos[k], wi = m_vSplitSin[k];
+            float or_ = dr * wr - di * wi, oi = dr * wi + di * wr;
+
+            // Z[k] = E[k] + i O[k]
+            uint32_t r = m_vBitReverse[k];
+            m_vRe[r] = er - oi;
+            m_vIm[r] = ei + or_;
+        }
+        Butterflies(1.0f);
+
+        float fScale = 1.0f / (float)m_nHalf;
+        for (size_t n = 0; n < m_nHalf; n++)
+        {
+            pOut[2 * n] = m_vRe[n] * fScale;
+            pOut[2 * n + 1] = m_vIm[n] * fScale;
+        }
+    }
+
+private:
+    size_t m_nSize = 0;
+    size_t m_nHalf = 0;
+    sArenaVector<uint32_t> m_vBitReverse;
+    sArenaVector<float> m_vCos, m_vSin;             // Quarter turn of e^(2 pi i k / (N / 2))
+    sArenaVector<float> m_vSplitCos, m_vSplitSin;   // Half turn of e^(2 pi i k / N)
+    sArenaVector<float> m_vRe, m_vIm;               // Working buffer of the half-size FFT
+
+    // In-place radix-2 FFT of m_vRe/m_vIm, already in bit-reversed order.
+    // fSign is -1 forward and 1 inverse.
+    void Butterflies(float fSign)
+    {
+        float* pRe = m_vRe.data();
+        float* pIm = m_vIm.data();
+        for (size_t nSpan = 1; nSpan < m_nHalf; nSpan <<= 1)
+        {
+            size_t nStride = m_nHalf / (2 * nSpan);
+            for (size_t nStart = 0; nStart < m_nHalf; nStart += 2 * nSpan)
+            {
+                for (size_t j = 0; j < nSpan; j++)
+                {
+                    // e^(fSign 2 pi i j / (2 nSpan)), from the table
+                    size_t t = j * nStride;
+                    float wr, wi;
+                    if (t <= m_nHalf / 2)
+                    {
+                        wr = m_vCos[t];
+                        wi = m_vSin[t];
+                    }
+                    else
+                    {
+                        wr = -m_vCos[m_nHalf - t];
+                        wi = m_vSin[m_nHalf - t];
+                    }
+                    wi *= fSign;
+
+                    size_t a = nStart + j, b = a + nSpan;
+                    float tr = pRe[b] * wr - pIm[b] * wi;
+                    float ti = pRe[b] * wi + pIm[b] * wr;
+                    pRe[b] = pRe[a] - tr;
+                    pIm[b] = pIm[a] - ti;
+                    pRe[a] += tr;
+                    pIm[a] += ti;
+                }
+            }
+        }
+    }
+};
+
+// Exponentially decaying noise, a stand-in room for sConvolutionReverb: the
+// level falls 60 dB over dSeconds and high frequencies die away faster
+inline vector<float> MakeReverbImpulse(double dSeconds, double dSampleRate, uint64_t nSeed = 1)
+{
+    size_t nFrames = (size_t)ceil(dSeconds * dSampleRate);
+    vector<float> vImpulse(nFrames);
+    sRandom random(nSeed);
+
+    double dDecay = log(1000.0) / max(dSeconds * dSampleRate, 1.0);
+    float fLow = 0.0f;
+    double dEnergy = 0.0;
+    for (size_t n = 0; n < nFrames; n++)
+    {
+        // One-pole lowpass that closes as the tail goes on
+        float fAlpha = (float)(0.9 * exp(-3.0 * (double)n / (double)nFrames));
+        fLow += fAlpha * (random.Bipolar() - fLow);
+        float f = fLow * (float)exp(-dDecay * (double)n);
+        vImpulse[n] = f;
+        dEnergy += (double)f * f;
+    }
+
+    // Unit energy, so the wet level is about the dry level
+    float fScale = dEnergy > 0.0 ? (float)(1.0 / sqrt(dEnergy)) : 0.0f;
+    for (float& f : vImpulse)
+        f *= fScale;
+    return vImpulse;
+}
+
+// Convolution with an impulse response, uniformly partitioned and done by
+// overlap-save in the frequency domain. The impulse is cut into partitions
+// of nPartition samples; every nPartition input samples make one new
+// spectrum, and the output is the sum of the last K input spectra times
+// the K partition spectra. The wet signal lags the dry by nPartition
+// samples. Each channel has its own history; the impulse is shared.
+class sConvolutionReverb : public sEffect
+{
+public:
+    float fDry = 1.0f;
+    float fWet = 0.2f;
+
+    // nPartition is rounded up to a power of two
+    sConvolutionReverb(const vector<float>& vImpulse, unsigned int nChannels, size_t nPartition = 256, const sSimdKernels& kernels = SimdKernels())
+        : m_kernels(kernels)
+    {
+        m_nPartition = 16;
+        while (m_nPartition < nPartition)
+            m_nPartition <<= 1;
+        m_nChannels = max(1u, min(nChannels, nMaxEffectChannels));
+        m_fft.Allocate(2 * m_nPartition);
+        m_nBins = m_fft.Bins();
+        m_nStride = (m_nBins + 15) & ~(size_t)15;
+
+        // Spectrum of every partition of the impulse
+        m_nPartitions = max((size_t)1, (vImpulse.size() + m_nPartition - 1) / m_nPartition);
+        m_impulseRe.Assign(m_nPartitions * m_nStride);
+        m_impulseIm.Assign(m_nPartitions * m_nStride);
+        vector<float> vFrame(2 * m_nPartition, 0.0f);
+        for (size_t k = 0; k < m_nPartitions; k++)
+        {
+            fill(vFrame.begin(), vFrame.end(), 0.0f);
+            for (size_t n = 0; n < m_nPartition && k * m_nPartition + n < vImpulse.size(); n++)
+                vFrame[n] = vImpulse[k * m_nPartition + n];
+            m_fft.Forward(vFrame.data(), &m_impulseRe[k * m_nStride], &m_impulseIm[k * m_nStride]);
+        }
+
+        // Per channel: input spectra, the last two partitions of input and
+        // the partition of output being played
+        m_historyRe.Assign(m_nChannels * m_nPartitions * m_nStride);
+        m_historyIm.Assign(m_nChannels * m_nPartitions * m_nStride);
+        m_input.Assign(m_nChannels * 2 * m_nPartition);
+        m_output.Assign(m_nChannels * m_nPartition);
+        m_sumRe.Assign(m_nChannels * m_nStride);
+        m_sumIm.Assign(m_nChannels * m_nStride);
+        m_frame.Assign(2 * m_nPartition);
+        Reset();
+    }
+
+    size_t Partition() const
+    {
+        return m_nPartition;
+    }
+
+    size_t Partitions() const
+    {
+        return m_nPartitions;
+    }
+
+    void Process(float* const* ppChannels, unsigned int nChannels, size_t nFrames) override
+    {
+        nChannels = min(nChannels, m_nChannels);
+        size_t n = 0;
+        while (n < nFrames)
+        {
+            size_t nRun = min(nFrames - n, m_nPartition - m_nFill);
+            for (unsigned int c = 0; c < nChannels; c++)
+            {
+                float* p = ppChannels[c] + n;
+                float* pInput = &m_input[c * 2 * m_nPartition + m_nPartition + m_nFill];
+                const float* pWet = &m_output[c * m_nPartition + m_nFill];
+                for (size_t i = 0; i < nRun; i++)
+                {
+                    float x = p[i];
+                    pInput[i] = x;
+                    p[i] = fDry * x + fWet * pWet[i];
+                }
+            }
+
+            m_nFill += nRun;
+            n += nRun;
+            if (m_nFill == m_nPartition)
+            {
+                ConvolvePartition(nChannels);
+                m_nSlot = (m_nSlot + 1) % m_nPartitions;
+                m_nFill = 0;
+            }
+        }
+    }
+
+    void Reset() override
+    {
+        memset(m_historyRe.Data(), 0, m_historyRe.Size() * sizeof(float));
+        memset(m_historyIm.Data(), 0, m_historyIm.Size() * sizeof(float));
+        memset(m_input.Data(), 0, m_input.Size() * sizeof(float));
+        memset(m_output.Data(), 0, m_output.Size() * sizeof(float));
+        m_nFill = 0;
+        m_nSlot = 0;
+    }
+
+private:
+    const sSimdKernels& m_kernels;
+    sRealFFT m_fft;
+    size_t m_nPartition;
+    size_t m_nPartitions;
+    size_t m_nBins;
+    size_t m_nStride;          // Floats between spectra, a whole number of cache lines
+    unsigned int m_nChannels;
+    size_t m_nFill;            // Samples of the current partition taken in
+    size_t m_nSlot;            // History slot the next input spectrum goes in
+
+    olcAlignedArray<float> m_impulseRe, m_impulseIm;
+    olcAlignedArray<float> m_historyRe, m_historyIm;   // Ring of input spectra per channel
+    olcAlignedArray<float> m_input;                    // Last 2 partitions of input per channel
+    olcAlignedArray<float> m_output;                   // Wet output being played per channel
+    olcAlignedArray<float> m_sumRe, m_sumIm;
+    olcAlignedArray<float> m_frame;
+
+    // Takes the partition just filled to the frequency domain, multiplies the
+    // history by the impulse, and keeps the valid half of the result as the
+    // next partition of wet output. Each partition of the impulse is read
+    // once for all the channels, while it is still in cache.
+    void ConvolvePartition(unsigned int nChannels)
+    {
+        const size_t nChannelHistory = m_nPartitions * m_nStride;
+        for (unsigned int c = 0; c < nChannels; c++)
+        {
+            size_t nNew = c * nChannelHistory + m_nSlot * m_nStride;
+            m_fft.Forward(&m_input[c * 2 * m_nPartition], &m_historyRe[nNew], &m_historyIm[nNew]);
+        }
+
+        memset(m_sumRe.Data(), 0, nChannels * m_nStride * sizeof(float));
+        memset(m_sumIm.Data(), 0, nChannels * m_nStride * sizeof(float));
+        for (size_t k = 0; k < m_nPartitions; k++)
+        {
+            size_t nSlot = (m_nSlot + m_nPartitions - k) % m_nPartitions;
+            for (unsigned int c = 0; c < nChannels; c++)
+            {
+                size_t nHistory = c * nChannelHistory + nSlot * m_nStride;
+                m_kernels.MulAddSpectrum(&m_historyRe[nHistory], &m_historyIm[nHistory], &m_impulseRe[k * m_nStride], &m_impulseIm[k * m_nStride],
+                    &m_sumRe[c * m_nStride], &m_sumIm[c * m_nStride], m_nBins);
+            }
+        }
+
+        for (unsigned int c = 0; c < nChannels; c++)
+        {
+            // The second half of the circular result is the linear convolution
+            m_fft.Inverse(&m_sumRe[c * m_nStride], &m_sumIm[c * m_nStride], m_frame.Data());
+            memcpy(&m_output[c * m_nPartition], m_frame.Data() + m_nPartition, m_nPartition * sizeof(float));
+
+            // Slide the input along by one partition
+            float* pInput = &m_input[c * 2 * m_nPartition];
+            memcpy(pInput, pInput + m_nPartition, m_nPartition * sizeof(float));
+        }
+    }
+};
+
+// Effects in the order they were added. Add them before playing; Process()
+// runs on the audio thread.
+class sEffectsBus
+{
+public:
+    template<class EFFECT>
+    EFFECT* Add(unique_ptr<EFFECT> pEffect)
+    {
+        EFFECT* p = pEffect.get();
+        m_vEffects.push_back(move(pEffect));
+        return p;
+    }
+
+    size_t Count() const
+    {
+        return m_vEffects.size();
+    }
+
+    void Process(float* const* ppChannels, unsigned int nChannels, size_t nFrames)
+    {
+        for (auto& pEffect : m_vEffects)
+            if (!pEffect->bBypass)
+                pEffect->Process(ppChannels, nChannels, nFrames);
+    }
+
+    void Reset()
+    {
+        for (auto& pEffect : m_vEffects)
+            pEffect->Reset();
+    }
+
+private:
+    vector<unique_ptr<sEffect>> m_vEffects;
+};
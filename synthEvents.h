@@ -0,0 +1,171 @@
+/*
+    Events passed from the input thread to the audio thread.
+
+    sEventQueue is a wait-free single-producer/single-consumer ring. Exactly
+    one thread may Push() and exactly one other thread may Pop(). Neither side
+    ever blocks or allocates: Push() fails when the ring is full and Pop()
+    fails when it is empty. The audio thread drains it at the start of every
+    block, so it is the only thread that ever touches the voices.
+
+    Events carry the sample frame they take effect on. The renderer splits
+    its block at each event's frame, so timing is exact to the sample. Events
+    must be pushed in frame order; one whose frame has already passed is
+    applied at the start of the next block.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// Event types
+#define EVENT_NOTE_ON 0         // nNote starts at dValue Hz
+#define EVENT_NOTE_OFF 1        // nNote is released
+#define EVENT_ALL_NOTES_OFF 2
+#define EVENT_PARAMETER 3       // Parameter nParam is set to dValue
+
+// Parameters an EVENT_PARAMETER can set
+#define PARAM_PRESET 0
+#define PARAM_MASTER_VOLUME 1
+#define PARAM_STEAL_POLICY 2
+#define PARAM_ATTACK_TIME 3
+#define PARAM_DECAY_TIME 4
+#define PARAM_SUSTAIN_AMPLITUDE 5
+#define PARAM_RELEASE_TIME 6
+#define PARAM_PAN 7               // Where notes started after it sit, -1.0 left to 1.0 right
+#define PARAM_REVERB_MIX 8        // Wet level of the effects bus reverb
+
+struct sEvent
+{
+    int nType;
+    int nNote;
+    int nParam;
+    double dValue;
+    uint64_t nFrame;  // Sample frame the event takes effect on
+
+    static sEvent NoteOn(int nNote, double dHertz, uint64_t nFrame)
+    {
+        sEvent e = { EVENT_NOTE_ON, nNote, 0, dHertz, nFrame };
+        return e;
+    }
+
+    static sEvent NoteOff(int nNote, uint64_t nFrame)
+    {
+        sEvent e = { EVENT_NOTE_OFF, nNote, 0, 0.0, nFrame };
+        return e;
+    }
+
+    static sEvent AllNotesOff(uint64_t nFrame)
+    {
+        sEvent e = { EVENT_ALL_NOTES_OFF, 0, 0, 0.0, nFrame };
+        return e;
+    }
+
+    static sEvent Parameter(int nParam, double dValue, uint64_t nFrame)
+    {
+        sEvent e = { EVENT_PARAMETER, 0, nParam, dValue, nFrame };
+        return e;
+    }
+};
+
+// Renders nFrames starting at nStartFrame, cut into spans at the frames of
+// the events waiting in queue. Every event due by the start of a span is
+// handled before the span is rendered.
+//   handle(const sEvent&) applies one event
+//   render(size_t nOffset, size_t nSpan, uint64_t nSpanFrame) renders one span
+template<class QUEUE, class HANDLER, class RENDERER>
+void RenderWithEvents(QUEUE& queue, uint64_t nStartFrame, size_t nFrames, HANDLER handle, RENDERER render)
+{
+    size_t nOffset = 0;
+    while (nOffset < nFrames)
+    {
+        uint64_t nFrame = nStartFrame + nOffset;
+
+        sEvent e;
+        while (queue.Peek(e) && e.nFrame <= nFrame)
+        {
+            queue.Pop(e);
+            handle(e);
+        }
+
+        size_t nSpan = nFrames - nOffset;
+        if (queue.Peek(e) && e.nFrame < nFrame + nSpan)
+            nSpan = (size_t)(e.nFrame - nFrame);
+
+        render(nOffset, nSpan, nFrame);
+        nOffset += nSpan;
+    }
+}
+
+template<class T>
+class sSpscQueue
+{
+public:
+    // nCapacity is rounded up to a power of 2
+    sSpscQueue(size_t nCapacity = 1024)
+    {
+        size_t nSize = 2;
+        while (nSize < nCapacity)
+            nSize <<= 1;
+
+        m_vItems.resize(nSize);
+        m_nMask = nSize - 1;
+        m_nHead = 0;
+        m_nTail = 0;
+    }
+
+    // Producer only. Returns false, dropping the item, if the ring is full.
+    bool Push(const T& item)
+    {
+        size_t nTail = m_nTail.load(memory_order_relaxed);
+        if (nTail - m_nHead.load(memory_order_acquire) > m_nMask)
+            return false;
+
+        m_vItems[nTail & m_nMask] = item;
+        m_nTail.store(nTail + 1, memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Returns false if the ring is empty.
+    bool Pop(T& item)
+    {
+        size_t nHead = m_nHead.load(memory_order_relaxed);
+        if (nHead == m_nTail.load(memory_order_acquire))
+            return false;
+
+        item = m_vItems[nHead & m_nMask];
+        m_nHead.store(nHead + 1, memory_order_release);
+        return true;
+    }
+
+    // Consumer only. The item Pop() would return next, without removing it.
+    bool Peek(T& item) const
+    {
+        size_t nHead = m_nHead.load(memory_order_relaxed);
+        if (nHead == m_nTail.load(memory_order_acquire))
+            return false;
+
+        item = m_vItems[nHead & m_nMask];
+        return true;
+    }
+
+    size_t Capacity() const
+    {
+        return m_nMask + 1;
+    }
+
+private:
+    vector<T> m_vItems;
+    size_t m_nMask;
+
+    // Head and tail on their own cache lines so the two threads do not
+    // fight over the same line
+    alignas(64) atomic<size_t> m_nHead;   // Next item to pop, written by the consumer
+    alignas(64) atomic<size_t> m_nTail;   // Next slot to push, written by the producer
+};
+
+typedef sSpscQueue<sEvent> sEventQueue;
@@ -0,0 +1,528 @@
+/*
+    Modular patches built at runtime.
+
+    sPatchGraph describes a patch as a graph of nodes: oscillators, LFOs,
+    envelopes, mixers, multipliers and filters, each reading up to
+    nMaxGraphInputs other nodes. It is edited freely on any thread, then
+    Compile() turns it into an sCompiledGraph:
+
+    1. Only nodes the output depends on are kept. They are put in
+       topological order once, so every node runs after all its inputs.
+       A graph with a cycle does not compile.
+    2. Each node's output gets a block buffer. A buffer goes back on the
+       free list after the last node that reads it, so later nodes reuse it.
+       All buffers come from one arena sized for the most that are ever live
+       at once.
+
+    Running the compiled schedule is a walk down an array of steps, with no
+    allocation, no sorting and no lookups.
+
+    sGraphEngine plays one voice through a compiled graph. Load() hands it a
+    new graph from any thread; the audio thread swaps it in at the start of
+    the next block and hands the old one back through a second slot, so
+    neither side ever waits and nothing is freed on the audio thread.
+
+    Oscillators and LFOs are osc(), envelopes are sEnvelopeADSR, both driven
+    by absolute time, so an edit that is swapped in mid-note carries on
+    without a jump. Filters keep their memory across an edit as long as the
+    node is still there.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "synth.h"
+#include "synthRealtime.h"
+
+// Node types
+#define NODE_OSCILLATOR 0   // dGain * osc(dRatio * note + dHertz), times input 0 if connected
+#define NODE_LFO 1          // dOffset + dGain * osc(dHertz), for modulating other nodes
+#define NODE_ENVELOPE 2     // Envelope level following the note, times input 0 if connected
+#define NODE_MIXER 3        // Sum of the inputs, each times its gain
+#define NODE_MULTIPLY 4     // dGain * input 0 * input 1
+#define NODE_FILTER 5       // One-pole filter of input 0; input 1 scales the cutoff by 1 + input
+
+// Filter modes
+#define FILTER_LOWPASS 0
+#define FILTER_HIGHPASS 1
+
+const int nMaxGraphInputs = 4;
+
+struct sGraphNode
+{
+    int nType;                // NODE_*
+    int nWaveform;            // OSC_* for oscillators and LFOs, FILTER_* for filters
+    double dRatio;            // Oscillator frequency as a multiple of the note played
+    double dHertz;            // Fixed frequency added on, LFO rate or filter cutoff
+    double dGain;
+    double dOffset;
+    double dLFOHertz;         // Built-in vibrato of osc()
+    double dLFOAmplitude;
+    sEnvelopeADSR envelope;
+    int nInputs[nMaxGraphInputs];            // Node read by each input, -1 if none
+    double dInputGains[nMaxGraphInputs];     // Used by mixers
+
+    sGraphNode(int nNodeType = NODE_MIXER)
+    {
+        nType = nNodeType;
+        nWaveform = 0;
+        dRatio = 0.0;
+        dHertz = 0.0;
+        dGain = 1.0;
+        dOffset = 0.0;
+        dLFOHertz = 0.0;
+        dLFOAmplitude = 0.0;
+        for (int i = 0; i < nMaxGraphInputs; i++)
+        {
+            nInputs[i] = -1;
+            dInputGains[i] = 1.0;
+        }
+    }
+};
+
+// One node of the schedule: what it does, which buffers it reads and which
+// it writes, and whatever it remembers between blocks
+struct sGraphStep
+{
+    int nNode;                           // Index in the sPatchGraph it came from
+    sGraphNode node;
+    int nOut;                            // Buffer written
+    int nIn[nMaxGraphInputs];            // Buffers read, -1 if unconnected
+    float fState;                        // Filter memory
+};
+
+// Note played through the graph, kept by the engine so it outlives graph swaps
+struct sGraphNote
+{
+    double dHertz;
+    double dTriggerOnTime;
+    double dTriggerOffTime;
+    bool bNoteOn;
+};
+
+class sCompiledGraph
+{
+public:
+    sArenaVector<sGraphStep> vSteps; // In the order they run
+    int nOutputBuffer;
+    double dSampleRate;
+
+    size_t Buffers() const
+    {
+        return m_nBuffers;
+    }
+
+    size_t MaxBlockFrames() const
+    {
+        return m_nMaxBlockFrames;
+    }
+
+    // Runs the schedule for nFrames samples (at most MaxBlockFrames()), the
+    // first at dStartTime, and returns the output buffer
+    const float* Run(const sGraphNote& note, size_t nFrames, double dStartTime)
+    {
+        const double dTimeStep = 1.0 / dSampleRate;
+
+        for (sGraphStep& step : vSteps)
+        {
+            const sGraphNode& node = step.node;
+            float* pOut = Buffer(step.nOut);
+            const float* pIn0 = step.nIn[0] >= 0 ? Buffer(step.nIn[0]) : nullptr;
+            const float* pIn1 = step.nIn[1] >= 0 ? Buffer(step.nIn[1]) : nullptr;
+
+            switch (node.nType)
+            {
+            case NODE_OSCILLATOR:
+            {
+                double dHertz = node.dRatio * note.dHertz + node.dHertz;
+                for (size_t n = 0; n < nFrames; n++)
+                    pOut[n] = (float)(node.dGain * osc(dHertz, dStartTime + n * dTimeStep, node.nWaveform, node.dLFOHertz, node.dLFOAmplitude));
+                if (pIn0 != nullptr)
+                    for (size_t n = 0; n < nFrames; n++)
+                        pOut[n] *= pIn0[n];
+                break;
+            }
+
+            case NODE_LFO:
+                for (size_t n = 0; n < nFrames; n++)
+                    pOut[n] = (float)(node.dOffset + node.dGain * osc(node.dHertz, dStartTime + n * dTimeStep, node.nWaveform));
+                break;
+
+            case NODE_ENVELOPE:
+            {
+                sEnvelopeADSR env = node.envelope;
+                env.dTriggerOnTime = note.dTriggerOnTime;
+                env.dTriggerOffTime = note.dTriggerOffTime;
+                env.bNoteOn = note.bNoteOn;
+                for (size_t n = 0; n < nFrames; n++)
+                    pOut[n] = (float)(node.dGain * env.GetAmplitude(dStartTime + n * dTimeStep));
+                if (pIn0 != nullptr)
+                    for (size_t n = 0; n < nFrames; n++)
+                        pOut[n] *= pIn0[n];
+                break;
+            }
+
+            case NODE_MIXER:
+                for (size_t n = 0; n < nFrames; n++)
+                    pOut[n] = 0.0f;
+                for (int i = 0; i < nMaxGraphInputs; i++)
+                {
+                    if (step.nIn[i] < 0)
+                        continue;
+                    const float* pIn = Buffer(step.nIn[i]);
+                    float fGain = (float)node.dInputGains[i];
+                    for (size_t n = 0; n < nFrames; n++)
+                        pOut[n] += fGain * pIn[n];
+                }
+                break;
+
+            case NODE_MULTIPLY:
+                for (size_t n = 0; n < nFrames; n++)
+                    pOut[n] = (float)node.dGain * (pIn0 != nullptr ? pIn0[n] : 0.0f) * (pIn1 != nullptr ? pIn1[n] : 1.0f);
+                break;
+
+            case NODE_FILTER:
+                RunFilter(step, pOut, pIn0, pIn1, nFrames);
+                break;
+            }
+        }
+
+        return Buffer(nOutputBuffer);
+    }
+
+private:
+    friend class sPatchGraph;
+
+    sArenaVector<float> m_vArena;
+    size_t m_nBuffers = 0;
+    size_t m_nMaxBlockFrames = 0;
+
+    float* Buffer(int nBuffer)
+    {
+        return &m_vArena[(size_t)nBuffer * m_nMaxBlockFrames];
+    }
+
+    // Share of the gap to the input a one-pole filter closes each sample
+    float FilterCoefficient(double dCutoff) const
+    {
+        dCutoff = min(max(dCutoff, 0.0), 0.5 * dSampleRate);
+        return (float)(1.0 - exp(-2.0 * PI * dCutoff / dSampleRate));
+    }
+
+    void RunFilter(sGraphStep& step, float* pOut, const float* pIn, const float* pCutoff, size_t nFrames)
+    {
+        bool bHighPass = step.node.nWaveform == FILTER_HIGHPASS;
+        float fLow = step.fState;
+        float a = FilterCoefficient(step.node.dHertz);
+
+        for (size_t n = 0; n < nFrames; n++)
+        {
+            float x = pIn != nullptr ? pIn[n] : 0.0f;
+            if (pCutoff != nullptr)
+                a = FilterCoefficient(step.node.dHertz * (1.0 + pCutoff[n]));
+            fLow += a * (x - fLow);
+            pOut[n] = bHighPass ? x - fLow : fLow;
+        }
+        step.fState = fLow;
+    }
+};
+
+class sPatchGraph
+{
+public:
+    vector<sGraphNode> vNodes;
+    int nOutput = -1;
+
+    // Each Add...() returns the new node's index. Nodes are never removed,
+    // so indices stay valid; disconnect a node to drop it from the patch.
+    int AddOscillator(int nWaveform, double dRatio, double dGain = 1.0, double dLFOHertz = 0.0, double dLFOAmplitude = 0.0)
+    {
+        sGraphNode node(NODE_OSCILLATOR);
+        node.nWaveform = nWaveform;
+        node.dRatio = dRatio;
+        node.dGain = dGain;
+        node.dLFOHertz = dLFOHertz;
+        node.dLFOAmplitude = dLFOAmplitude;
+        return Add(node);
+    }
+
+    int AddLFO(int nWaveform, double dHertz, double dGain, double dOffset = 0.0)
+    {
+        sGraphNode node(NODE_LFO);
+        node.nWaveform = nWaveform;
+        node.dHertz = dHertz;
+        node.dGain = dGain;
+        node.dOffset = dOffset;
+        return Add(node);
+    }
+
+    int AddEnvelope(const sEnvelopeADSR& envelope, int nInput = -1)
+    {
+        sGraphNode node(NODE_ENVELOPE);
+        node.envelope = envelope;
+        node.nInputs[0] = nInput;
+        return Add(node);
+    }
+
+    int AddMixer()
+    {
+        return Add(sGraphNode(NODE_MIXER));
+    }
+
+    int AddMultiply(int nInput0, int nInput1, double dGain = 1.0)
+    {
+        sGraphNode node(NODE_MULTIPLY);
+        node.nInputs[0] = nInput0;
+        node.nInputs[1] = nInput1;
+        node.dGain = dGain;
+        return Add(node);
+    }
+
+    int AddFilter(int nMode, double dCutoff, int nInput = -1)
+    {
+        sGraphNode node(NODE_FILTER);
+        node.nWaveform = nMode;
+        node.dHertz = dCutoff;
+        node.nInputs[0] = nInput;
+        return Add(node);
+    }
+
+    // Feeds node nFrom into input nInput of node nTo; nFrom = -1 disconnects
+    bool Connect(int nFrom, int nTo, int nInput = 0, double dGain = 1.0)
+    {
+        if (!Valid(nTo) || (nFrom != -1 && !Valid(nFrom)) || nInput < 0 || nInput >= nMaxGraphInputs)
+            return false;
+        vNodes[nTo].nInputs[nInput] = nFrom;
+        vNodes[nTo].dInputGains[nInput] = dGain;
+        return true;
+    }
+
+    void SetOutput(int nNode)
+    {
+        nOutput = nNode;
+    }
+
+    // Schedules the graph for blocks of up to nMaxBlockFrames. Returns
+    // nullptr if the output is not set, an input names a missing node, or the
+    // graph has a cycle. Allocates, so call it off the audio thread.
+    unique_ptr<sCompiledGraph> Compile(double dSampleRate, size_t nMaxBlockFrames = 512) const
+    {
+        if (!Valid(nOutput))
+            return nullptr;
+
+        // Depth-first from the output: a node is placed once all its inputs
+        // are, so the order is topological. Meeting a node that is still
+        // being visited means a cycle.
+        const int nUnvisited = 0, nVisiting = 1, nDone = 2;
+        vector<int> vMark(vNodes.size(), nUnvisited);
+        vector<int> vOrder;
+        vector<pair<int, int>> vStack;     // Node, next input to look at
+        vStack.push_back(make_pair(nOutput, 0));
+        vMark[nOutput] = nVisiting;
+
+        while (!vStack.empty())
+        {
+            int nNode = vStack.back().first;
+            int& nNext = vStack.back().second;
+
+            if (nNext == nMaxGraphInputs)
+            {
+                vMark[nNode] = nDone;
+                vOrder.push_back(nNode);
+                vStack.pop_back();
+                continue;
+            }
+
+            int nInput = vNodes[nNode].nInputs[nNext++];
+            if (nInput == -1)
+                continue;
+            if (!Valid(nInput) || vMark[nInput] == nVisiting)
+                return nullptr;
+            if (vMark[nInput] == nUnvisited)
+            {
+                vMark[nInput] = nVisiting;
+                vStack.push_back(make_pair(nInput, 0));
+            }
+        }
+
+        // Step that reads each node's output last. The output node is read
+        // after the schedule, so it is never freed.
+        vector<int> vStepOf(vNodes.size(), -1);
+        for (size_t s = 0; s < vOrder.size(); s++)
+            vStepOf[vOrder[s]] = (int)s;
+
+        vector<int> vLastUse(vNodes.size(), -1);
+        for (size_t s = 0; s < vOrder.size(); s++)
+            for (int i = 0; i < nMaxGraphInputs; i++)
+            {
+                int nInput = vNodes[vOrder[s]].nInputs[i];
+                if (nInput != -1)
+                    vLastUse[nInput] = max(vLastUse[nInput], (int)s);
+            }
+        vLastUse[nOutput] = (int)vOrder.size();
+
+        // Buffers: the output is taken before the inputs are released, so a
+        // node never writes a buffer it is still reading
+        unique_ptr<sCompiledGraph> pGraph(new sCompiledGraph());
+        vector<int> vBufferOf(vNodes.size(), -1);
+        vector<int> vFree;
+        int nBuffers = 0;
+
+        for (size_t s = 0; s < vOrder.size(); s++)
+        {
+            int nNode = vOrder[s];
+            sGraphStep step;
+            step.nNode = nNode;
+            step.node = vNodes[nNode];
+            step.fState = 0.0f;
+
+            if (vFree.empty())
+                step.nOut = nBuffers++;
+            else
+            {
+                step.nOut = vFree.back();
+                vFree.pop_back();
+            }
+            vBufferOf[nNode] = step.nOut;
+
+            for (int i = 0; i < nMaxGraphInputs; i++)
+            {
+                int nInput = step.node.nInputs[i];
+                step.nIn[i] = nInput != -1 ? vBufferOf[nInput] : -1;
+            }
+
+            // Inputs read for the last time here can be reused from the next step
+            for (int i = 0; i < nMaxGraphInputs; i++)
+            {
+                int nInput = step.node.nInputs[i];
+                if (nInput != -1 && vLastUse[nInput] == (int)s && vBufferOf[nInput] != -1)
+                {
+                    vFree.push_back(vBufferOf[nInput]);
+                    vBufferOf[nInput] = -1;
+                }
+            }
+
+            pGraph->vSteps.push_back(step);
+        }
+
+        pGraph->nOutputBuffer = pGraph->vSteps[vStepOf[nOutput]].nOut;
+        pGraph->dSampleRate = dSampleRate;
+        pGraph->m_nBuffers = (size_t)nBuffers;
+        pGraph->m_nMaxBlockFrames = max<size_t>(nMaxBlockFrames, 1);
+        pGraph->m_vArena.assign(pGraph->m_nBuffers * pGraph->m_nMaxBlockFrames, 0.0f);
+        return pGraph;
+    }
+
+private:
+    int Add(const sGraphNode& node)
+    {
+        vNodes.push_back(node);
+        return (int)vNodes.size() - 1;
+    }
+
+    bool Valid(int nNode) const
+    {
+        return nNode >= 0 && nNode < (int)vNodes.size();
+    }
+};
+
+class sGraphEngine
+{
+public:
+    sGraphEngine()
+    {
+        m_note.dHertz = 0.0;
+        m_note.dTriggerOnTime = 0.0;
+        m_note.dTriggerOffTime = 0.0;
+        m_note.bNoteOn = false;
+    }
+
+    ~sGraphEngine()
+    {
+        delete m_pPending.exchange(nullptr);
+        delete m_pRetired.exchange(nullptr);
+        delete m_pCurrent;
+    }
+
+    // Any one thread: queues a graph to be swapped in at the next block,
+    // replacing one queued earlier that has not been picked up yet. Frees
+    // the graph the audio thread last swapped out.
+    void Load(unique_ptr<sCompiledGraph> pGraph)
+    {
+        Collect();
+        delete m_pPending.exchange(pGraph.release());
+    }
+
+    // Same thread as Load(): frees the graph the audio thread swapped out
+    void Collect()
+    {
+        delete m_pRetired.exchange(nullptr);
+    }
+
+    // Audio thread
+    void NoteOn(double dHertz, double dTime)
+    {
+        m_note.dHertz = dHertz;
+        m_note.dTriggerOnTime = dTime;
+        m_note.bNoteOn = true;
+    }
+
+    void NoteOff(double dTime)
+    {
+        m_note.dTriggerOffTime = dTime;
+        m_note.bNoteOn = false;
+    }
+
+    // Audio thread: adds the graph's output to nFrames samples of pOut, the
+    // first of which is at dStartTime
+    void Render(float* pOut, size_t nFrames, double dStartTime)
+    {
+        Swap();
+        if (m_pCurrent == nullptr)
+            return;
+
+        size_t nMaxFrames = m_pCurrent->MaxBlockFrames();
+        for (size_t nOffset = 0; nOffset < nFrames; nOffset += nMaxFrames)
+        {
+            size_t nChunk = min(nMaxFrames, nFrames - nOffset);
+            const float* pGraphOut = m_pCurrent->Run(m_note, nChunk, dStartTime + (double)nOffset / m_pCurrent->dSampleRate);
+            for (size_t n = 0; n < nChunk; n++)
+                pOut[nOffset + n] += pGraphOut[n];
+        }
+    }
+
+private:
+    sGraphNote m_note;
+    sCompiledGraph* m_pCurrent = nullptr;          // Audio thread only
+    atomic<sCompiledGraph*> m_pPending{nullptr};   // Loaded, not yet swapped in
+    atomic<sCompiledGraph*> m_pRetired{nullptr};   // Swapped out, waiting to be freed
+
+    // Takes the pending graph if there is one and the retired slot is free
+    // to receive the old graph. Otherwise keeps playing the current one for
+    // another block.
+    void Swap()
+    {
+        if (m_pPending.load(memory_order_relaxed) == nullptr || m_pRetired.load(memory_order_acquire) != nullptr)
+            return;
+
+        sCompiledGraph* pNew = m_pPending.exchange(nullptr, memory_order_acq_rel);
+        if (pNew == nullptr)
+            return;
+
+        // Filters carry on where the same node left off
+        if (m_pCurrent != nullptr)
+            for (sGraphStep& step : pNew->vSteps)
+                for (const sGraphStep& old : m_pCurrent->vSteps)
+                    if (old.nNode == step.nNode && old.node.nType == step.node.nType)
+                        step.fState = old.fState;
+
+        m_pRetired.store(m_pCurrent, memory_order_release);
+        m_pCurrent = pNew;
+    }
+};
@@ -0,0 +1,632 @@
+/*
+    Input sources: where notes come from.
+
+    An sInputSource hands out events one at a time from Next(), which blocks
+    until there is one, so a thread reading input sleeps in the kernel until
+    a key is pressed or the next note of a score is due and uses no CPU in
+    between. PumpInput() reads a source on the calling thread and pushes its
+    events onto the engine's queue.
+
+      sConsoleKeyboard    Windows console key presses (ReadConsoleInput)
+      sTerminalKeyboard   POSIX terminal in raw mode
+      sEvdevKeyboard      Linux evdev device, e.g. /dev/input/event3
+      sScriptSource       text score read line by line, from stdin or a file
+      sEventListSource    a list of timed events, such as a loaded MIDI file
+
+    The keyboards play the layout "AZSXDCFVGBHNJMK,L.QWERTYUIO" from A2 up
+    in semitones, and stop on Esc. A terminal only reports key presses, so
+    sTerminalKeyboard holds a note while its key keeps repeating and
+    releases it a moment after the repeats stop.
+
+    A text score has one event per line, an optional time in seconds and a
+    command; a line without a time plays as soon as it is read:
+
+        # comment
+        0.0   on A2          note on, by name (C4 is middle C) or MIDI number
+        0.5   off A2
+        0.5   set pan -0.5   preset, volume, steal, attack, decay, sustain,
+                             release, pan or reverb
+        2.0   alloff
+              on 60
+*/
+
+#pragma once
+
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <fcntl.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/input.h>
+#endif
+
+#include "synth.h"
+#include "synthEvents.h"
+
+// Event from an input source. dTime is in seconds from the start of the
+// source, or negative for as soon as possible; event.nFrame is filled in by
+// PumpInput(). Note ons carry their frequency in event.dValue.
+struct sTimedEvent
+{
+    double dTime;
+    sEvent event;
+};
+
+class sInputSource
+{
+public:
+    virtual ~sInputSource() {}
+
+    // Waits for the next event and returns true, or returns false once the
+    // input has ended
+    virtual bool Next(sTimedEvent& e) = 0;
+};
+
+// Keyboard layout, in semitones from nKeyboardBaseNote
+const int nKeyboardKeys = 27;
+const int nKeyboardBaseNote = 45;   // A2, 110 Hz
+const char* const sKeyboardLayout = "azsxdcfvgbhnjmk,l.qwertyuio";
+
+// Key of the layout typed as c, or -1
+inline int KeyboardKey(char c)
+{
+    const char* p = strchr(sKeyboardLayout, tolower((unsigned char)c));
+    return c != 0 && p != nullptr ? (int)(p - sKeyboardLayout) : -1;
+}
+
+// MIDI note of a name such as "A2", "C#4" or "Bb-1", or of a plain number.
+// Returns false if sName is neither.
+inline bool NoteNumber(const string& sName, int& nNote)
+{
+    if (sName.empty())
+        return false;
+
+    char* pEnd = nullptr;
+    long nNumber = strtol(sName.c_str(), &pEnd, 10);
+    if (*pEnd == '\0')
+    {
+        nNote = (int)nNumber;
+        return true;
+    }
+
+    const int nSemitones[7] = { 9, 11, 0, 2, 4, 5, 7 };   // A to G from C
+    char cLetter = (char)toupper((unsigned char)sName[0]);
+    if (cLetter < 'A' || cLetter > 'G')
+        return false;
+
+    int n = nSemitones[cLetter - 'A'];
+    size_t i = 1;
+    while (i < sName.size() && (sName[i] == '#' || sName[i] == 'b'))
+        n += sName[i++] == '#' ? 1 : -1;
+
+    long nOctave = strtol(sName.c_str() + i, &pEnd, 10);
+    if (i == sName.size() || *pEnd != '\0')
+        return false;
+
+    nNote = n + 12 * ((int)nOctave + 1);
+    return true;
+}
+
+// PARAM_* named in a score, or -1
+inline int ParamNumber(const string& sName)
+{
+    const char* sNames[] = { "preset", "volume", "steal", "attack", "decay", "sustain", "release", "pan", "reverb" };
+    for (int i = 0; i < (int)(sizeof(sNames) / sizeof(sNames[0])); i++)
+        if (sName == sNames[i])
+            return i;
+    return -1;
+}
+
+// Reads one line of a text score. Returns 1 and fills e for an event, 0 for
+// a blank line or comment, or -1 with a message in sError.
+inline int ParseScoreLine(const string& sLine, sTimedEvent& e, string& sError)
+{
+    istringstream in(sLine.substr(0, sLine.find('#')));
+    string sWord;
+    if (!(in >> sWord))
+        return 0;
+
+    e.dTime = -1.0;
+    char* pEnd = nullptr;
+    double dTime = strtod(sWord.c_str(), &pEnd);
+    if (*pEnd == '\0')
+    {
+        if (dTime < 0.0)
+        {
+            sError = "negative time";
+            return -1;
+        }
+        e.dTime = dTime;
+        if (!(in >> sWord))
+        {
+            sError = "time with no command";
+            return -1;
+        }
+    }
+
+    string sArg;
+    int nNote = 0;
+    if (sWord == "on" || sWord == "off")
+    {
+        if (!(in >> sArg) || !NoteNumber(sArg, nNote))
+        {
+            sError = "expected a note after '" + sWord + "'";
+            return -1;
+        }
+        e.event = sWord == "on" ? sEvent::NoteOn(nNote, NoteHertz(nNote), 0) : sEvent::NoteOff(nNote, 0);
+    }
+    else if (sWord == "alloff")
+        e.event = sEvent::AllNotesOff(0);
+    else if (sWord == "set")
+    {
+        double dValue = 0.0;
+        int nParam = -1;
+        if (in >> sArg)
+            nParam = ParamNumber(sArg);
+        if (nParam < 0 || !(in >> dValue))
+        {
+            sError = "expected a parameter name and value after 'set'";
+            return -1;
+        }
+        e.event = sEvent::Parameter(nParam, dValue, 0);
+    }
+    else
+    {
+        sError = "unknown command '" + sWord + "'";
+        return -1;
+    }
+
+    if (in >> sArg)
+    {
+        sError = "unexpected '" + sArg + "'";
+        return -1;
+    }
+    return 1;
+}
+
+// Reads a whole text score. Returns false with the line number in sError at
+// the first bad line.
+inline bool ReadScore(istream& in, vector<sTimedEvent>& vEvents, string& sError)
+{
+    string sLine;
+    for (int nLine = 1; getline(in, sLine); nLine++)
+    {
+        sTimedEvent e;
+        int nResult = ParseScoreLine(sLine, e, sError);
+        if (nResult < 0)
+        {
+            sError = "line " + to_string(nLine) + ": " + sError;
+            return false;
+        }
+        if (nResult > 0)
+            vEvents.push_back(e);
+    }
+    return true;
+}
+
+// Text score read a line at a time, so it can be typed or piped in live.
+// Bad lines are reported on cerr and skipped.
+class sScriptSource : public sInputSource
+{
+public:
+    sScriptSource(istream& in) : m_in(in) {}
+
+    bool Next(sTimedEvent& e) override
+    {
+        string sLine, sError;
+        while (getline(m_in, sLine))
+        {
+            m_nLine++;
+            int nResult = ParseScoreLine(sLine, e, sError);
+            if (nResult > 0)
+                return true;
+            if (nResult < 0)
+                cerr << "Score line " << m_nLine << ": " << sError << endl;
+        }
+        return false;
+    }
+
+private:
+    istream& m_in;
+    int m_nLine = 0;
+};
+
+// Plays back a list of events, in the order given
+class sEventListSource : public sInputSource
+{
+public:
+    sEventListSource(vector<sTimedEvent> vEvents) : m_vEvents(move(vEvents)) {}
+
+    bool Next(sTimedEvent& e) override
+    {
+        if (m_nNext == m_vEvents.size())
+            return false;
+        e = m_vEvents[m_nNext++];
+        return true;
+    }
+
+private:
+    vector<sTimedEvent> m_vEvents;
+    size_t m_nNext = 0;
+};
+
+// What the keyboards share: turning key presses and releases into note
+// events, ignoring auto-repeat, and releasing everything at the end
+class sKeyboardSource : public sInputSource
+{
+public:
+    bool bPanKeys = false;   // Spread the keys across the stereo field, low keys left
+
+protected:
+    bool m_bKeyDown[nKeyboardKeys] = {};
+    bool m_bEnded = false;
+
+    // Key k of the layout went down or up. Returns false if that changes
+    // nothing, such as a repeat of a key already down.
+    bool Key(int k, bool bDown)
+    {
+        if (k < 0 || k >= nKeyboardKeys || m_bKeyDown[k] == bDown)
+            return false;
+
+        m_bKeyDown[k] = bDown;
+        int nNote = nKeyboardBaseNote + k;
+        if (bDown)
+        {
+            if (bPanKeys)
+                Queue(sEvent::Parameter(PARAM_PAN, 2.0 * k / (nKeyboardKeys - 1) - 1.0, 0));
+            Queue(sEvent::NoteOn(nNote, NoteHertz(nNote), 0));
+        }
+        else
+            Queue(sEvent::NoteOff(nNote, 0));
+        return true;
+    }
+
+    // Ends the input, releasing any keys still down
+    void End()
+    {
+        if (!m_bEnded)
+            Queue(sEvent::AllNotesOff(0));
+        m_bEnded = true;
+    }
+
+    // Takes the next queued event, if there is one
+    bool Pending(sTimedEvent& e)
+    {
+        if (m_nPending == 0)
+            return false;
+        e.dTime = -1.0;
+        e.event = m_pending[0];
+        m_nPending--;
+        for (int i = 0; i < m_nPending; i++)
+            m_pending[i] = m_pending[i + 1];
+        return true;
+    }
+
+private:
+    sEvent m_pending[4];
+    int m_nPending = 0;
+
+    void Queue(const sEvent& e)
+    {
+        if (m_nPending < 4)
+            m_pending[m_nPending++] = e;
+    }
+};
+
+#if defined(_WIN32)
+
+// Keys pressed while the console window has focus
+class sConsoleKeyboard : public sKeyboardSource
+{
+public:
+    sConsoleKeyboard()
+    {
+        m_hInput = GetStdHandle(STD_INPUT_HANDLE);
+        GetConsoleMode(m_hInput, &m_dwOldMode);
+        SetConsoleMode(m_hInput, ENABLE_WINDOW_INPUT);
+    }
+
+    ~sConsoleKeyboard()
+    {
+        SetConsoleMode(m_hInput, m_dwOldMode);
+    }
+
+    bool Next(sTimedEvent& e) override
+    {
+        while (!Pending(e))
+        {
+            if (m_bEnded)
+                return false;
+
+            // Blocks until the console has input
+            if (m_nNext == m_nRecords)
+            {
+                m_nNext = 0;
+                if (!ReadConsoleInputA(m_hInput, m_records, 32, &m_nRecords) || m_nRecords == 0)
+                {
+                    End();
+                    continue;
+                }
+            }
+
+            const INPUT_RECORD& record = m_records[m_nNext++];
+            if (record.EventType != KEY_EVENT)
+                continue;
+
+            WORD nKey = record.Event.KeyEvent.wVirtualKeyCode;
+            if (nKey == VK_ESCAPE)
+                End();
+            else
+            {
+                const char* p = strchr("AZSXDCFVGBHNJMK\xbcL\xbeQWERTYUIO", (char)nKey);
+                if (nKey != 0 && p != nullptr)
+                    Key((int)(p - "AZSXDCFVGBHNJMK\xbcL\xbeQWERTYUIO"), record.Event.KeyEvent.bKeyDown != FALSE);
+            }
+        }
+        return true;
+    }
+
+private:
+    HANDLE m_hInput;
+    DWORD m_dwOldMode = 0;
+    INPUT_RECORD m_records[32];
+    DWORD m_nRecords = 0;
+    DWORD m_nNext = 0;
+};
+
+#else
+
+// Keys typed into the terminal. The terminal is put in raw mode while this
+// exists. Esc, Ctrl-C or Ctrl-D ends the input.
+class sTerminalKeyboard : public sKeyboardSource
+{
+public:
+    double dFirstHold = 0.7;    // Seconds a note lasts after its key is pressed, if it does not repeat
+    double dRepeatHold = 0.15;  // Seconds a note lasts after each repeat
+
+    sTerminalKeyboard(int nFd = STDIN_FILENO)
+    {
+        m_nFd = nFd;
+        m_bRaw = isatty(m_nFd) && tcgetattr(m_nFd, &m_oldMode) == 0;
+        if (m_bRaw)
+        {
+            termios mode = m_oldMode;
+            mode.c_lflag &= ~(ICANON | ECHO | ISIG);
+            mode.c_cc[VMIN] = 1;
+            mode.c_cc[VTIME] = 0;
+            tcsetattr(m_nFd, TCSANOW, &mode);
+        }
+    }
+
+    ~sTerminalKeyboard()
+    {
+        if (m_bRaw)
+            tcsetattr(m_nFd, TCSANOW, &m_oldMode);
+    }
+
+    bool Next(sTimedEvent& e) override
+    {
+        while (!Pending(e))
+        {
+            if (m_bEnded)
+                return false;
+
+            // Sleep until a key comes in or the next held note is due to be
+            // released; with nothing held, until a key comes in
+            auto tNow = chrono::steady_clock::now();
+            int nTimeout = -1;
+            for (int k = 0; k < nKeyboardKeys; k++)
+                if (m_bKeyDown[k])
+                {
+                    auto nMs = chrono::duration_cast<chrono::milliseconds>(m_tRelease[k] - tNow).count() + 1;
+                    nTimeout = nTimeout < 0 ? (int)max<long long>(nMs, 0) : min(nTimeout, (int)max<long long>(nMs, 0));
+                }
+
+            pollfd fd = { m_nFd, POLLIN, 0 };
+            int nReady = poll(&fd, 1, nTimeout);
+            if (nReady < 0)
+            {
+                if (errno != EINTR)
+                    End();
+                continue;
+            }
+
+            tNow = chrono::steady_clock::now();
+            if (nReady == 0)
+            {
+                for (int k = 0; k < nKeyboardKeys; k++)
+                    if (m_bKeyDown[k] && m_tRelease[k] <= tNow)
+                        Key(k, false);
+                continue;
+            }
+
+            char c;
+            if (read(m_nFd, &c, 1) != 1 || c == 3 || c == 4)
+            {
+                End();
+                continue;
+            }
+
+            // Esc on its own ends; Esc starting a sequence (arrow keys and
+            // the like) is skipped
+            if (c == 27)
+            {
+                pollfd more = { m_nFd, POLLIN, 0 };
+                if (poll(&more, 1, 0) <= 0)
+                    End();
+                else
+                {
+                    char sSequence[8];
+                    ssize_t nRead = read(m_nFd, sSequence, sizeof(sSequence));
+                    (void)nRead;
+                }
+                continue;
+            }
+
+            int k = KeyboardKey(c);
+            if (k < 0)
+                continue;
+            bool bRepeat = m_bKeyDown[k];
+            m_tRelease[k] = tNow + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(bRepeat ? dRepeatHold : dFirstHold));
+            Key(k, true);
+        }
+        return true;
+    }
+
+private:
+    int m_nFd;
+    bool m_bRaw;
+    termios m_oldMode;
+    chrono::steady_clock::time_point m_tRelease[nKeyboardKeys];
+};
+
+#endif
+
+#if defined(__linux__)
+
+// Keys of a Linux input device, read straight from the kernel, so presses
+// and releases are exact and no terminal is needed. Reading
+// /dev/input/event* usually needs the input group. Esc ends the input.
+class sEvdevKeyboard : public sKeyboardSource
+{
+public:
+    sEvdevKeyboard(const string& sDevice)
+    {
+        m_nFd = open(sDevice.c_str(), O_RDONLY);
+    }
+
+    ~sEvdevKeyboard()
+    {
+        if (m_nFd >= 0)
+            close(m_nFd);
+    }
+
+    bool IsOpen() const
+    {
+        return m_nFd >= 0;
+    }
+
+    bool Next(sTimedEvent& e) override
+    {
+        const int nCodes[nKeyboardKeys] = {
+            KEY_A, KEY_Z, KEY_S, KEY_X, KEY_D, KEY_C, KEY_F, KEY_V, KEY_G, KEY_B, KEY_H, KEY_N, KEY_J, KEY_M,
+            KEY_K, KEY_COMMA, KEY_L, KEY_DOT, KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O };
+
+        while (!Pending(e))
+        {
+            if (m_bEnded || m_nFd < 0)
+                return false;
+
+            // Blocks until the device has an event
+            input_event ev;
+            ssize_t nRead = read(m_nFd, &ev, sizeof(ev));
+            if (nRead != (ssize_t)sizeof(ev))
+            {
+                if (nRead < 0 && errno == EINTR)
+                    continue;
+                End();
+                continue;
+            }
+
+            // Value 1 is a press, 0 a release and 2 an auto-repeat
+            if (ev.type != EV_KEY || ev.value == 2)
+                continue;
+            if (ev.code == KEY_ESC)
+            {
+                End();
+                continue;
+            }
+            for (int k = 0; k < nKeyboardKeys; k++)
+                if (nCodes[k] == ev.code)
+                    Key(k, ev.value == 1);
+        }
+        return true;
+    }
+
+private:
+    int m_nFd;
+};
+
+#endif
+
+// Sleeps until the engine reaches nFrame, or returns early if the engine is
+// not running. Each sleep is how long the engine should take to get there,
+// at most 5 ms, so a backend running faster than realtime is not overshot
+// by much.
+template<class SOUND>
+void WaitForFrame(SOUND& sound, uint64_t nFrame, double dSampleRate)
+{
+    for (uint64_t nNow = sound.GetFrame(); nNow < nFrame && sound.IsRunning(); nNow = sound.GetFrame())
+        this_thread::sleep_for(chrono::duration<double>(min((double)(nFrame - nNow) / dSampleRate, 0.005)));
+}
+
+// Reads source on the calling thread and pushes its events onto queue until
+// the source ends, or the engine stops. Returns the frame of the last event.
+//
+// Events with no time are stamped with the frame a live key press would
+// get. Timed events are placed dTime seconds after the first of them was
+// read, plus dLookahead so the first is not late, and are pushed as far
+// ahead as the queue has room for: when it is full, this thread sleeps
+// until the audio thread has taken the oldest event. Timing is exact
+// however fast the backend runs. Frames never go backwards.
+// onEvent(const sEvent&) is called with every event pushed.
+template<class SOUND, class FUNC>
+uint64_t PumpInput(sInputSource& source, sEventQueue& queue, SOUND& sound, double dSampleRate, FUNC onEvent, double dLookahead = 0.1)
+{
+    bool bStarted = false;
+    uint64_t nStartFrame = 0;
+    uint64_t nLastFrame = 0;
+
+    // Frames of the events in the queue, oldest at nPushed % size
+    vector<uint64_t> vPushed(queue.Capacity(), 0);
+    size_t nPushed = 0;
+
+    sTimedEvent e;
+    while (source.Next(e))
+    {
+        uint64_t nFrame;
+        if (e.dTime < 0.0)
+            nFrame = sound.GetEventFrame();
+        else
+        {
+            if (!bStarted)
+            {
+                nStartFrame = sound.GetFrame() + (uint64_t)(dLookahead * dSampleRate);
+                bStarted = true;
+            }
+            nFrame = nStartFrame + (uint64_t)llround(e.dTime * dSampleRate);
+        }
+
+        e.event.nFrame = max(nFrame, nLastFrame);
+        nLastFrame = e.event.nFrame;
+
+        while (!queue.Push(e.event))
+        {
+            if (!sound.IsRunning())
+                return nLastFrame;
+            uint64_t nOldest = vPushed[nPushed % vPushed.size()];
+            if (sound.GetFrame() > nOldest)
+                this_thread::sleep_for(chrono::milliseconds(1));   // Audio thread stalled
+            else
+                WaitForFrame(sound, nOldest + 1, dSampleRate);
+        }
+        vPushed[nPushed++ % vPushed.size()] = e.event.nFrame;
+        onEvent(e.event);
+    }
+    return nLastFrame;
+}
@@ -0,0 +1,277 @@
+/*
+    Standard MIDI file reader.
+
+    LoadMidiFile() turns a format 0 or 1 .mid file into timed events for
+    sEventListSource or an offline render. The tracks are merged, and ticks
+    are turned into seconds through the tempo map (or the SMPTE rate, for
+    files that use one). What the engine can play is kept:
+
+      note on / note off    EVENT_NOTE_ON / EVENT_NOTE_OFF; a note on with
+                            velocity 0 is a note off
+      controller 10         PARAM_PAN
+      controller 120, 123   EVENT_ALL_NOTES_OFF
+
+    Notes are numbered 128 * channel + key, so the same key on two channels
+    is two notes; the pitch comes from the key alone. Everything else
+    (velocity, pitch bend, sysex, other meta events) is skipped, program
+    changes too: they are General MIDI instrument numbers, not indexes into
+    this synth's presets, so the preset stays the one the player picked.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "synth.h"
+#include "synthEvents.h"
+#include "synthInput.h"
+
+// A file's bytes, read with bounds checks; reading past the end sets bFailed
+// and gives zeros
+struct sMidiReader
+{
+    const vector<uint8_t>& vData;
+    size_t nPos;
+    size_t nEnd;
+    bool bFailed;
+
+    sMidiReader(const vector<uint8_t>& vBytes, size_t nStart, size_t nStop) : vData(vBytes), nPos(nStart), nEnd(nStop), bFailed(false) {}
+
+    bool AtEnd() const
+    {
+        return nPos >= nEnd;
+    }
+
+    uint32_t Byte()
+    {
+        if (nPos >= nEnd)
+        {
+            bFailed = true;
+            return 0;
+        }
+        return vData[nPos++];
+    }
+
+    uint32_t BigEndian(int nBytes)
+    {
+        uint32_t n = 0;
+        for (int i = 0; i < nBytes; i++)
+            n = (n << 8) | Byte();
+        return n;
+    }
+
+    // Variable-length quantity: 7 bits per byte, high bit set on all but the last
+    uint32_t Variable()
+    {
+        uint32_t n = 0;
+        for (int i = 0; i < 4; i++)
+        {
+            uint32_t b = Byte();
+            n = (n << 7) | (b & 0x7F);
+            if ((b & 0x80) == 0)
+                return n;
+        }
+        bFailed = true;
+        return n;
+    }
+
+    void Skip(size_t nBytes)
+    {
+        if (nBytes > nEnd - min(nPos, nEnd))
+        {
+            bFailed = true;
+            nPos = nEnd;
+        }
+        else
+            nPos += nBytes;
+    }
+};
+
+// Event read from a track, in ticks, before the tracks are merged
+struct sMidiTrackEvent
+{
+    uint64_t nTick;
+    uint32_t nTempo;      // Microseconds per quarter note if this is a tempo change, otherwise 0
+    bool bTempo;
+    sEvent event;
+};
+
+// Reads sFile into vEvents, in time order. Returns false with a message in
+// sError if the file cannot be read or is not a MIDI file.
+inline bool LoadMidiFile(const string& sFile, vector<sTimedEvent>& vEvents, string& sError)
+{
+    ifstream file(sFile, ios::binary);
+    if (!file)
+    {
+        sError = "cannot open " + sFile;
+        return false;
+    }
+    vector<uint8_t> vData((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+
+    sMidiReader header(vData, 0, vData.size());
+    uint32_t nMagic = header.BigEndian(4);
+    uint32_t nHeaderLength = header.BigEndian(4);
+    if (nMagic != 0x4D546864 || nHeaderLength < 6)   // "MThd"
+    {
+        sError = sFile + " is not a MIDI file";
+        return false;
+    }
+    uint32_t nFormat = header.BigEndian(2);
+    uint32_t nTracks = header.BigEndian(2);
+    uint32_t nDivision = header.BigEndian(2);
+    if (header.bFailed || nFormat > 1 || (nDivision & 0x7FFF) == 0 || ((nDivision & 0x8000) && (nDivision & 0xFF) == 0))
+    {
+        sError = sFile + ": only format 0 and 1 MIDI files are supported";
+        return false;
+    }
+
+    // Tracks start after the header, which may be longer than 6 bytes
+    sMidiReader reader(vData, 8, vData.size());
+    reader.Skip(nHeaderLength);
+
+    vector<sMidiTrackEvent> vTrackEvents;
+    for (uint32_t t = 0; t < nTracks && !reader.AtEnd(); t++)
+    {
+        uint32_t nId = reader.BigEndian(4);
+        size_t nLength = reader.BigEndian(4);
+        if (reader.bFailed || nLength > vData.size() - reader.nPos)
+        {
+            sError = sFile + ": track " + to_string(t) + " is cut short";
+            return false;
+        }
+        if (nId != 0x4D54726B)   // "MTrk"; anything else is skipped
+        {
+            reader.Skip(nLength);
+            continue;
+        }
+
+        sMidiReader track(vData, reader.nPos, reader.nPos + nLength);
+        reader.Skip(nLength);
+
+        uint64_t nTick = 0;
+        uint32_t nStatus = 0;
+        while (!track.AtEnd() && !track.bFailed)
+        {
+            nTick += track.Variable();
+
+            // Running status: a data byte here reuses the last status
+            uint32_t b = track.Byte();
+            if (b & 0x80)
+                nStatus = b;
+            else
+                track.nPos--;
+
+            sMidiTrackEvent e = { nTick, 0, false, sEvent::AllNotesOff(0) };
+            uint32_t nChannel = nStatus & 0x0F;
+
+            if (nStatus == 0xFF)
+            {
+                uint32_t nType = track.Byte();
+                uint32_t nSize = track.Variable();
+                if (nType == 0x2F)
+                    break;
+                if (nType == 0x51 && nSize == 3)
+                {
+                    e.nTempo = track.BigEndian(3);
+                    e.bTempo = e.nTempo > 0;
+                    if (e.bTempo)
+                        vTrackEvents.push_back(e);
+                }
+                else
+                    track.Skip(nSize);
+                nStatus = 0;
+                continue;
+            }
+
+            if (nStatus == 0xF0 || nStatus == 0xF7)
+            {
+                track.Skip(track.Variable());
+                nStatus = 0;
+                continue;
+            }
+
+            switch (nStatus & 0xF0)
+            {
+            case 0x80:
+            case 0x90:
+            {
+                uint32_t nKey = track.Byte() & 0x7F;
+                uint32_t nVelocity = track.Byte();
+                int nNote = (int)(128 * nChannel + nKey);
+                if ((nStatus & 0xF0) == 0x90 && nVelocity > 0)
+                    e.event = sEvent::NoteOn(nNote, NoteHertz((int)nKey), 0);
+                else
+                    e.event = sEvent::NoteOff(nNote, 0);
+                vTrackEvents.push_back(e);
+                break;
+            }
+
+            case 0xB0:
+            {
+                uint32_t nController = track.Byte();
+                uint32_t nValue = track.Byte();
+                if (nController == 10)
+                {
+                    e.event = sEvent::Parameter(PARAM_PAN, max(-1.0, ((double)nValue - 64.0) / 63.0), 0);
+                    vTrackEvents.push_back(e);
+                }
+                else if (nController == 120 || nController == 123)
+                    vTrackEvents.push_back(e);
+                break;
+            }
+
+            case 0xC0:
+            case 0xD0:
+                track.Byte();
+                break;
+
+            case 0xA0:
+            case 0xE0:
+                track.Skip(2);
+                break;
+
+            default:
+                sError = sFile + ": bad event in track " + to_string(t);
+                return false;
+            }
+        }
+
+        if (track.bFailed)
+        {
+            sError = sFile + ": track " + to_string(t) + " is cut short";
+            return false;
+        }
+    }
+
+    // Merge the tracks; events on the same tick keep track order
+    stable_sort(vTrackEvents.begin(), vTrackEvents.end(), [](const sMidiTrackEvent& a, const sMidiTrackEvent& b) { return a.nTick < b.nTick; });
+
+    // Ticks to seconds. SMPTE division is frames per second (negated in the
+    // high byte) times ticks per frame, with no tempo.
+    bool bSmpte = (nDivision & 0x8000) != 0;
+    double dSecondsPerTick = bSmpte ? 1.0 / ((double)(256 - (nDivision >> 8)) * (double)(nDivision & 0xFF)) : 0.5 / (double)nDivision;
+    double dSeconds = 0.0;
+    uint64_t nLastTick = 0;
+
+    for (const sMidiTrackEvent& e : vTrackEvents)
+    {
+        dSeconds += (double)(e.nTick - nLastTick) * dSecondsPerTick;
+        nLastTick = e.nTick;
+
+        if (e.bTempo)
+        {
+            if (!bSmpte)
+                dSecondsPerTick = (double)e.nTempo * 1e-6 / (double)nDivision;
+            continue;
+        }
+
+        sTimedEvent timed = { dSeconds, e.event };
+        vEvents.push_back(timed);
+    }
+    return true;
+}
@@ -0,0 +1,168 @@
+/*
+    Noise generators.
+
+    sRandom is a small xorshift64* generator. It has no hidden global state,
+    so every voice can own one, and it is seeded explicitly, so the same
+    seed always gives the same noise. That keeps offline renders identical
+    from run to run whatever thread a voice is rendered on.
+
+    sNoise turns its output into three colours of noise:
+      NOISE_WHITE  equal energy per hertz
+      NOISE_PINK   equal energy per octave (-3 dB/octave), Voss-McCartney
+      NOISE_BROWN  -6 dB/octave, white noise through a leaky integrator
+    Each colour is scaled to about the same loudness as white noise.
+*/
+
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Noise colours
+#define NOISE_WHITE 0
+#define NOISE_PINK 1
+#define NOISE_BROWN 2
+
+struct sRandom
+{
+    uint64_t nState;
+
+    sRandom(uint64_t nSeed = 1)
+    {
+        Seed(nSeed);
+    }
+
+    // Any seed is fine, including 0; it is spread over the state with
+    // splitmix64 so nearby seeds give unrelated sequences
+    void Seed(uint64_t nSeed)
+    {
+        uint64_t z = nSeed + 0x9E3779B97F4A7C15ull;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        nState = z ^ (z >> 31);
+        if (nState == 0)
+            nState = 0x9E3779B97F4A7C15ull;
+    }
+
+    uint32_t Next()
+    {
+        nState ^= nState >> 12;
+        nState ^= nState << 25;
+        nState ^= nState >> 27;
+        return (uint32_t)((nState * 0x2545F4914F6CDD1Dull) >> 32);
+    }
+
+    // Uniform between -1.0 and 1.0. The top 23 bits become the mantissa of a
+    // float between 2.0 and 4.0, so there is no int to float conversion.
+    float Bipolar()
+    {
+        uint32_t nBits = (Next() >> 9) | 0x40000000u;
+        float f;
+        memcpy(&f, &nBits, sizeof(f));
+        return f - 3.0f;
+    }
+};
+
+// Mixes values into a 64-bit seed, for deriving one seed per voice
+inline uint64_t HashSeed(uint64_t nSeed, uint64_t nValue)
+{
+    uint64_t z = nSeed ^ (nValue + 0x9E3779B97F4A7C15ull + (nSeed << 6) + (nSeed >> 2));
+    z = (z ^ (z >> 33)) * 0xFF51AFD7ED558CCDull;
+    z = (z ^ (z >> 33)) * 0xC4CEB9FE1A85EC53ull;
+    return z ^ (z >> 33);
+}
+
+const int nPinkRows = 16;
+
+struct sNoise
+{
+    sRandom random;
+    uint32_t nPinkCounter;
+    float fPinkRows[nPinkRows];
+    float fPinkSum;
+    float fBrown;
+
+    sNoise(uint64_t nSeed = 1)
+    {
+        Seed(nSeed);
+    }
+
+    // Restarts the sequence and clears the filters
+    void Seed(uint64_t nSeed)
+    {
+        random.Seed(nSeed);
+        nPinkCounter = 0;
+        for (int r = 0; r < nPinkRows; r++)
+            fPinkRows[r] = 0.0f;
+        fPinkSum = 0.0f;
+        fBrown = 0.0f;
+    }
+
+    float Sample(int nColor)
+    {
+        switch (nColor)
+        {
+        case NOISE_PINK:  return Pink();
+        case NOISE_BROWN: return Brown();
+        default:          return random.Bipolar();
+        }
+    }
+
+    // Adds fAmplitude * noise to nFrames samples of pOut. The colour is
+    // resolved once for the whole block.
+    void Render(int nColor, float* pOut, size_t nFrames, float fAmplitude)
+    {
+        switch (nColor)
+        {
+        case NOISE_PINK:
+            for (size_t n = 0; n < nFrames; n++)
+                pOut[n] += fAmplitude * Pink();
+            break;
+        case NOISE_BROWN:
+            for (size_t n = 0; n < nFrames; n++)
+                pOut[n] += fAmplitude * Brown();
+            break;
+        default:
+            for (size_t n = 0; n < nFrames; n++)
+                pOut[n] += fAmplitude * random.Bipolar();
+            break;
+        }
+    }
+
+private:
+    // Voss-McCartney: row r is redrawn every 2^(r+1) samples, picked by the
+    // trailing zeros of a counter, so each sample redraws one row on average.
+    // The sum of the rows plus a fresh white sample falls at about 3 dB per
+    // octave over the 16 octaves the rows cover.
+    float Pink()
+    {
+        nPinkCounter++;
+        uint32_t n = nPinkCounter;
+        int r = 0;
+        while ((n & 1) == 0 && r < nPinkRows)
+        {
+            n >>= 1;
+            r++;
+        }
+
+        if (r < nPinkRows)
+        {
+            float fNew = random.Bipolar();
+            fPinkSum += fNew - fPinkRows[r];
+            fPinkRows[r] = fNew;
+        }
+
+        // 1 / sqrt(rows + 1) matches the loudness of white noise
+        return (fPinkSum + random.Bipolar()) * 0.2425f;
+    }
+
+    // Leaky integrator, corner around 14 Hz at 44.1 kHz, so the level cannot
+    // wander off the way a pure random walk would
+    float Brown()
+    {
+        fBrown = fBrown * 0.998f + random.Bipolar() * 0.0632f;
+        return fBrown;
+    }
+};
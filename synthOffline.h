@@ -0,0 +1,281 @@
+/*
+    Offline rendering, as fast as the CPU allows.
+
+    OfflineRender() takes a list of events (the same sEvent the realtime
+    engine uses) and renders them into one buffer. The work is split into
+    independent items that run on a pool of threads:
+
+    1. Every note becomes its own work item. Its voice is rendered on its own
+       from note on to the end of its release into a private buffer, so it
+       does not matter which thread runs it or when.
+    2. The output is cut into fixed chunks. Each chunk sums the notes that
+       overlap it, always in note order.
+
+    Neither step depends on how work is shared between threads, so the output
+    is bit-identical for any thread count. Noise is seeded per note from
+    sOfflineSettings::nSeed, so it is reproducible too. Offline there is no
+    voice limit: every note gets a voice and nothing is stolen.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "olcNoiseMaker.h"
+#include "synth.h"
+#include "synthVoices.h"
+#include "synthEvents.h"
+
+struct sOfflineSettings
+{
+    double dSampleRate;
+    unsigned int nThreads;         // 0 uses every hardware thread
+    const sPreset* pPresets;       // Presets PARAM_PRESET indexes into
+    int nPresetCount;
+    int nPreset;                   // Preset in use before any PARAM_PRESET
+    sEnvelopeADSR envelope;        // Envelope in use before any PARAM_* change
+    double dMasterVolume;
+    uint64_t nLengthFrames;        // 0 renders until the last note has finished
+    uint64_t nSeed;                // Noise seed; the same seed gives the same render
+
+    sOfflineSettings()
+    {
+        dSampleRate = 44100.0;
+        nThreads = 0;
+        pPresets = nullptr;
+        nPresetCount = 0;
+        nPreset = 0;
+        dMasterVolume = 0.4;
+        nLengthFrames = 0;
+        nSeed = 1;
+    }
+};
+
+struct sOfflineStats
+{
+    uint64_t nFrames;
+    size_t nNotes;
+    unsigned int nThreads;
+    double dRenderSeconds;     // Wall-clock time taken
+    double dRealtimeFactor;    // Seconds of audio rendered per second of wall-clock time
+};
+
+// One note worked out from the event list, with the settings it plays with
+struct sOfflineNote
+{
+    int nNote;
+    double dHertz;
+    uint64_t nOnFrame;
+    uint64_t nOffFrame;
+    uint64_t nEndFrame;        // Release finished
+    const sPreset* pPreset;
+    sEnvelopeADSR envelope;
+    double dGain;
+    uint64_t nSeed;
+};
+
+// Runs func(i) for every i below nItems on nThreads threads. Items are handed
+// out in order from a shared counter.
+template<class FUNC>
+void ParallelFor(size_t nItems, unsigned int nThreads, FUNC func)
+{
+    atomic<size_t> nNext(0);
+    auto worker = [&]()
+    {
+        for (size_t i = nNext++; i < nItems; i = nNext++)
+            func(i);
+    };
+
+    vector<thread> vThreads;
+    for (unsigned int t = 1; t < nThreads; t++)
+        vThreads.push_back(thread(worker));
+    worker();
+    for (auto& th : vThreads)
+        th.join();
+}
+
+// Turns an event list, in frame order, into notes
+inline vector<sOfflineNote> OfflineNotes(const vector<sEvent>& vEvents, const sOfflineSettings& settings)
+{
+    vector<sOfflineNote> vNotes;
+    vector<size_t> vHeld;
+
+    const sPreset* pPreset = settings.nPreset >= 0 && settings.nPreset < settings.nPresetCount ? &settings.pPresets[settings.nPreset] : nullptr;
+    sEnvelopeADSR envelope = settings.envelope;
+    double dGain = settings.dMasterVolume;
+    uint64_t nLastFrame = 0;
+
+    auto release = [&](size_t i, uint64_t nFrame)
+    {
+        sOfflineNote& note = vNotes[i];
+        note.nOffFrame = max(nFrame, note.nOnFrame);
+        note.nEndFrame = note.nOffFrame + (uint64_t)ceil(note.envelope.dReleaseTime * settings.dSampleRate);
+    };
+
+    for (const sEvent& e : vEvents)
+    {
+        nLastFrame = max(nLastFrame, e.nFrame);
+
+        switch (e.nType)
+        {
+        case EVENT_NOTE_ON:
+        {
+            sOfflineNote note = { e.nNote, e.dValue, e.nFrame, e.nFrame, e.nFrame, pPreset, envelope, dGain, settings.nSeed };
+            vHeld.push_back(vNotes.size());
+            vNotes.push_back(note);
+            break;
+        }
+
+        case EVENT_NOTE_OFF:
+        case EVENT_ALL_NOTES_OFF:
+            for (size_t h = 0; h < vHeld.size();)
+            {
+                if (e.nType == EVENT_ALL_NOTES_OFF || vNotes[vHeld[h]].nNote == e.nNote)
+                {
+                    release(vHeld[h], e.nFrame);
+                    vHeld.erase(vHeld.begin() + h);
+                }
+                else
+                    h++;
+            }
+            break;
+
+        case EVENT_PARAMETER:
+            switch (e.nParam)
+            {
+            case PARAM_PRESET:
+                if ((int)e.dValue >= 0 && (int)e.dValue < settings.nPresetCount)
+                    pPreset = &settings.pPresets[(int)e.dValue];
+                break;
+            case PARAM_MASTER_VOLUME:     dGain = e.dValue; break;
+            case PARAM_ATTACK_TIME:       envelope.dAttackTime = e.dValue; break;
+            case PARAM_DECAY_TIME:        envelope.dDecayTime = e.dValue; break;
+            case PARAM_SUSTAIN_AMPLITUDE: envelope.dSustainAmplitude = e.dValue; break;
+            case PARAM_RELEASE_TIME:      envelope.dReleaseTime = e.dValue; break;
+            }
+            break;
+        }
+    }
+
+    // Notes still held are released at the end
+    uint64_t nEnd = settings.nLengthFrames > 0 ? settings.nLengthFrames : nLastFrame;
+    for (size_t h : vHeld)
+        release(h, nEnd);
+
+    return vNotes;
+}
+
+// Renders one note from its note on to the end of its release
+inline void RenderOfflineNote(const sOfflineNote& note, double dSampleRate, vector<float>& vOut)
+{
+    const size_t nBlock = 512;
+    vOut.assign((size_t)(note.nEndFrame - note.nOnFrame), 0.0f);
+    if (note.pPreset == nullptr || vOut.empty())
+        return;
+
+    sVoiceManager voice(1, nBlock);
+    voice.pPreset = note.pPreset;
+    voice.envelope = note.envelope;
+    voice.dSampleRate = dSampleRate;
+    voice.nSeed = note.nSeed;
+    voice.NoteOn(note.nNote, note.dHertz, (double)note.nOnFrame / dSampleRate);
+
+    size_t nOff = (size_t)(note.nOffFrame - note.nOnFrame);
+    size_t n = 0;
+    while (n < vOut.size())
+    {
+        if (n == nOff)
+            voice.NoteOff(note.nNote, (double)note.nOffFrame / dSampleRate);
+
+        size_t nSpan = min(nBlock, vOut.size() - n);
+        if (n < nOff)
+            nSpan = min(nSpan, nOff - n);
+
+        voice.Render(&vOut[n], nSpan);
+        n += nSpan;
+    }
+
+    for (float& f : vOut)
+        f *= (float)note.dGain;
+}
+
+// Renders vEvents into vOut, replacing its contents
+inline sOfflineStats OfflineRender(const vector<sEvent>& vEvents, const sOfflineSettings& settings, vector<float>& vOut)
+{
+    auto tStart = chrono::steady_clock::now();
+
+    unsigned int nThreads = settings.nThreads > 0 ? settings.nThreads : max(1u, thread::hardware_concurrency());
+    vector<sOfflineNote> vNotes = OfflineNotes(vEvents, settings);
+
+    uint64_t nFrames = settings.nLengthFrames;
+    if (nFrames == 0)
+        for (const sOfflineNote& note : vNotes)
+            nFrames = max(nFrames, note.nEndFrame);
+
+    // Every note on its own
+    vector<vector<float>> vNoteBuffers(vNotes.size());
+    ParallelFor(vNotes.size(), nThreads, [&](size_t i)
+    {
+        RenderOfflineNote(vNotes[i], settings.dSampleRate, vNoteBuffers[i]);
+    });
+
+    // Mix in fixed-size chunks, each summing its notes in note order
+    const uint64_t nChunk = 65536;
+    vOut.assign((size_t)nFrames, 0.0f);
+    ParallelFor((size_t)((nFrames + nChunk - 1) / nChunk), nThreads, [&](size_t c)
+    {
+        uint64_t nChunkStart = c * nChunk;
+        uint64_t nChunkEnd = min(nFrames, nChunkStart + nChunk);
+
+        for (size_t i = 0; i < vNotes.size(); i++)
+        {
+            uint64_t nFrom = max(nChunkStart, vNotes[i].nOnFrame);
+            uint64_t nTo = min(nChunkEnd, vNotes[i].nEndFrame);
+            const vector<float>& vNote = vNoteBuffers[i];
+            for (uint64_t n = nFrom; n < nTo; n++)
+                vOut[(size_t)n] += vNote[(size_t)(n - vNotes[i].nOnFrame)];
+        }
+    });
+
+    sOfflineStats stats;
+    stats.nFrames = nFrames;
+    stats.nNotes = vNotes.size();
+    stats.nThreads = nThreads;
+    stats.dRenderSeconds = chrono::duration<double>(chrono::steady_clock::now() - tStart).count();
+    stats.dRealtimeFactor = stats.dRenderSeconds > 0.0 ? ((double)nFrames / settings.dSampleRate) / stats.dRenderSeconds : 0.0;
+    return stats;
+}
+
+// Writes mono float samples to a WAV file through the WAV backend, as T:
+// short, olcInt24, int32_t or float
+template<class T = short>
+bool WriteWav(const string& sFile, const vector<float>& vSamples, unsigned int nSampleRate, bool bDither = false)
+{
+    const size_t nBlock = 4096;
+    vector<T> vBlock(nBlock);
+    olcSampleConverter converter(bDither);
+
+    olcNoiseBackendWav wav(sFile);
+    olcNoiseFormat format = { nSampleRate, 1, olcSampleType<T>::nBits, olcSampleType<T>::bFloat };
+    if (!wav.Open(format, (char*)vBlock.data(), 1, (unsigned int)(nBlock * sizeof(T))))
+        return false;
+
+    for (size_t n = 0; n < vSamples.size(); n += nBlock)
+    {
+        size_t nCount = min(nBlock, vSamples.size() - n);
+        converter.Convert(&vSamples[n], vBlock.data(), nCount);
+        if (!wav.Write((const char*)vBlock.data(), nCount * sizeof(T)))
+        {
+            wav.Close();
+            return false;
+        }
+    }
+
+    return wav.Close();
+}
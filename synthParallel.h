@@ -0,0 +1,434 @@
+/*
+    Parallel voice rendering for the realtime audio thread.
+
+    sVoiceRenderPool spreads the playing voices of an sVoiceManager over a
+    few worker threads, each pinned to its own core. The audio thread takes
+    part as well, so it is never just waiting.
+
+    Each block the active voices are dealt out into one queue per thread.
+    A thread works through its own queue and then steals from the others.
+    A queue is a single atomic word holding the block number, the next item
+    and the end, so claiming an item is one compare-and-swap. A worker that
+    wakes up late still holds an old block number and can never claim
+    anything from a newer block.
+
+    Every voice is rendered into its own buffer. Once all voices are done
+    (per-voice flags the audio thread spins on, no locks) the buffers are
+    summed in voice order, exactly as sVoiceManager::Render() does. The
+    output is the same whatever the number of threads or whoever rendered
+    what.
+
+    The audio thread steals all work nobody has started, so a worker that
+    is asleep or descheduled costs nothing. The audio thread never waits
+    past the deadline either. Each voice has a state word holding the block
+    number, which moves from queued to rendering to done by compare-and-
+    swap. At the deadline, a voice still queued is taken over and rendered
+    by the audio thread. A voice still rendering is left out of this block.
+    It is held in the voice manager, which stops touching it until the late
+    worker marks it done. The pool then renders single-threaded for the next
+    few blocks.
+
+    What a voice is rendered with (preset, envelope settings, frame count)
+    is copied into a job of its own when it is queued, so a late worker
+    never reads settings the audio thread is changing for the next block.
+
+    The deadline belongs to the device block, not to each Render() call.
+    BeginBlock() starts it, and every span the block is split into at event
+    times shares it. A span that starts after the deadline has passed is
+    rendered single-threaded, so no voice is dropped from it.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "olcNoiseMaker.h"
+#include "synthSimd.h"
+#include "synthVoices.h"
+#include "synthRealtime.h"
+
+class sVoiceRenderPool
+{
+public:
+    double dDeadline;             // Share of a block's duration the render may take before falling back
+    size_t nMinParallelVoices;    // Fewer playing voices than this are rendered on the audio thread alone
+    size_t nFallbackBlocks;       // Blocks rendered single-threaded after a missed deadline
+
+    // nCapacity and nMaxBlockFrames must be at least those of the voice
+    // manager it renders
+    sVoiceRenderPool(unsigned int nWorkers, size_t nCapacity = 128, size_t nMaxBlockFrames = 512)
+    {
+        dDeadline = 0.5;
+        nMinParallelVoices = 4;
+        nFallbackBlocks = 64;
+
+        m_nMaxBlockFrames = nMaxBlockFrames > 0 ? nMaxBlockFrames : 1;
+        m_vBuffers.assign(nCapacity * m_nMaxBlockFrames, 0.0f);
+        m_vActive = sArenaVector<sSlot>(nCapacity);
+        m_vVoiceStates = sArenaVector<sSlot>(nCapacity);
+        m_vJobs = sArenaVector<sVoiceJob>(nCapacity);
+        m_vQueues = sArenaVector<sQueue>(nWorkers + 1);
+
+        m_nGeneration = 0;
+        m_nSleeping = 0;
+        m_bQuit = false;
+        m_nFallbackLeft = 0;
+        m_bFallback = false;
+        m_nBlockFramesLeft = 0;
+        m_nMissedDeadlines = 0;
+
+        m_pVoices = nullptr;
+
+        for (unsigned int w = 0; w < nWorkers; w++)
+            m_vThreads.push_back(thread(&sVoiceRenderPool::WorkerThread, this, w + 1));
+    }
+
+    ~sVoiceRenderPool()
+    {
+        m_bQuit = true;
+        m_nGeneration++;
+        {
+            unique_lock<mutex> lm(m_muxWake);
+            m_cvWake.notify_all();
+        }
+        for (auto& th : m_vThreads)
+            th.join();
+    }
+
+    // Worker count that leaves a core for the audio thread and one for
+    // everything else
+    static unsigned int DefaultWorkers()
+    {
+        unsigned int nCores = thread::hardware_concurrency();
+        return nCores > 2 ? min(nCores - 2, 15u) : 0;
+    }
+
+    unsigned int Workers() const
+    {
+        return (unsigned int)m_vThreads.size();
+    }
+
+    // Blocks that overran dDeadline since the pool was made
+    uint64_t MissedDeadlines() const
+    {
+        return m_nMissedDeadlines.load(memory_order_relaxed);
+    }
+
+    // Starts a device block of nFrames, to be rendered by one or more
+    // Render() calls. They share one deadline, dDeadline of the block's
+    // duration from now. Render() starts a block of its own if none is
+    // open or it runs past the end of this one.
+    void BeginBlock(size_t nFrames, double dSampleRate)
+    {
+        m_tDeadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(dDeadline * (double)nFrames / dSampleRate));
+        m_nBlockFramesLeft = nFrames;
+
+        m_bFallback = m_nFallbackLeft > 0;
+        if (m_bFallback)
+            m_nFallbackLeft--;
+    }
+
+    // Same as voices.Render(), on every thread in the pool
+    void Render(sVoiceManager& voices, float* pOut, size_t nFrames, const sSimdKernels& kernels = SimdKernels())
+    {
+        Render(voices, &pOut, 1, nFrames, kernels);
+    }
+
+    // Planar version for up to nMaxChannels channels, each voice panned
+    void Render(sVoiceManager& voices, float* const* ppOut, unsigned int nChannels, size_t nFrames, const sSimdKernels& kernels = SimdKernels())
+    {
+        if (voices.pPreset == nullptr)
+            return;
+
+        if (nChannels > nMaxChannels)
+            nChannels = nMaxChannels;
+
+        if (nFrames > m_nBlockFramesLeft)
+            BeginBlock(nFrames, voices.dSampleRate);
+        m_nBlockFramesLeft -= nFrames;
+
+        for (size_t nOffset = 0; nOffset < nFrames; nOffset += m_nMaxBlockFrames)
+        {
+            size_t nChunk = min(m_nMaxBlockFrames, nFrames - nOffset);
+            RenderChunk(voices, ppOut, nChannels, nOffset, nChunk, kernels);
+        }
+    }
+
+    static const unsigned int nMaxChannels = 8;
+
+private:
+    // Queue word: block number in the top 32 bits, next item in the middle
+    // 16 and end in the low 16. Padded out to a cache line each.
+    struct sQueue
+    {
+        atomic<uint64_t> nWord;
+        char pad[64 - sizeof(atomic<uint64_t>)];
+
+        sQueue() : nWord(0) {}
+        sQueue(const sQueue&) : nWord(0) {}
+    };
+
+    static uint64_t QueueWord(uint32_t nGeneration, uint32_t nNext, uint32_t nEnd)
+    {
+        return ((uint64_t)nGeneration << 32) | ((uint64_t)nNext << 16) | nEnd;
+    }
+
+    // An atomic word that can be kept in a vector
+    struct sSlot
+    {
+        atomic<uint64_t> nWord;
+
+        sSlot() : nWord(0) {}
+        sSlot(const sSlot&) : nWord(0) {}
+    };
+
+    // Voice state word: block number above the VOICE_* state in the low 2 bits
+    enum { VOICE_QUEUED = 0, VOICE_RENDERING = 1, VOICE_DONE = 2 };
+
+    static uint64_t VoiceWord(uint32_t nGeneration, uint32_t nState)
+    {
+        return ((uint64_t)nGeneration << 2) | nState;
+    }
+
+    // What a queued voice is rendered with, copied by the audio thread before
+    // the block is published. Only rewritten once no thread renders the voice.
+    struct sVoiceJob
+    {
+        const sPreset* pPreset = nullptr;
+        sEnvelopeADSR envelope;
+        size_t nFrames = 0;
+        const sSimdKernels* pKernels = nullptr;
+    };
+
+    size_t m_nMaxBlockFrames;
+    sArenaVector<float> m_vBuffers;      // One block per voice
+    sArenaVector<sSlot> m_vActive;       // Voices playing this block
+    sArenaVector<sSlot> m_vVoiceStates;  // VoiceWord() of each voice
+    sArenaVector<sVoiceJob> m_vJobs;     // One per voice
+    sArenaVector<sQueue> m_vQueues;      // Queue 0 is the audio thread's
+    vector<thread> m_vThreads;
+
+    // Voice manager of the current block, written by the audio thread before
+    // m_nGeneration moves on. Atomic because a late worker may still read
+    // it during the next.
+    atomic<sVoiceManager*> m_pVoices;
+
+    atomic<uint32_t> m_nGeneration;
+    atomic<int> m_nSleeping;         // Workers waiting on m_cvWake
+    atomic<bool> m_bQuit;
+
+    // Current device block, see BeginBlock()
+    chrono::steady_clock::time_point m_tDeadline;
+    size_t m_nBlockFramesLeft;
+    size_t m_nFallbackLeft;          // Blocks still to render single-threaded
+    bool m_bFallback;                // This block is rendered single-threaded
+    atomic<uint64_t> m_nMissedDeadlines;
+
+    mutex m_muxWake;
+    condition_variable m_cvWake;
+
+    void RenderChunk(sVoiceManager& voices, float* const* ppOut, unsigned int nChannels, size_t nOffset, size_t nFrames, const sSimdKernels& kernels)
+    {
+        // Voices a late worker has finished with are handed back first
+        size_t nActive = 0;
+        if (voices.Capacity() <= m_vActive.size())
+            for (size_t v = 0; v < voices.Capacity(); v++)
+            {
+                if (voices.vHeld[v] != HOLD_NONE && (m_vVoiceStates[v].nWord.load(memory_order_acquire) & 3) == VOICE_DONE)
+                    voices.Unhold(v);
+                if (voices.vHeld[v] == HOLD_NONE && voices.vStage[v] != ENV_IDLE)
+                    m_vActive[nActive++].nWord.store(v, memory_order_relaxed);
+            }
+
+        bool bSerial = m_vThreads.empty() || nActive < nMinParallelVoices || voices.Capacity() > m_vActive.size() || m_bFallback;
+        if (!bSerial && chrono::steady_clock::now() > m_tDeadline)
+            bSerial = true;
+
+        if (bSerial)
+        {
+            float* ppChunk[nMaxChannels];
+            for (unsigned int c = 0; c < nChannels; c++)
+                ppChunk[c] = ppOut[c] + nOffset;
+            voices.Render(ppChunk, nChannels, nFrames, kernels);
+            return;
+        }
+
+        m_pVoices.store(&voices, memory_order_relaxed);
+
+        // Deal the voices out in contiguous runs, one per thread
+        uint32_t nGeneration = m_nGeneration.load(memory_order_relaxed) + 1;
+        for (size_t i = 0; i < nActive; i++)
+        {
+            uint32_t v = ActiveVoice(i);
+            sVoiceJob& job = m_vJobs[v];
+            job.pPreset = voices.pPreset;
+            job.envelope = voices.envelope;
+            job.nFrames = nFrames;
+            job.pKernels = &kernels;
+            m_vVoiceStates[v].nWord.store(VoiceWord(nGeneration, VOICE_QUEUED), memory_order_relaxed);
+        }
+        size_t nQueues = m_vQueues.size();
+        for (size_t q = 0; q < nQueues; q++)
+        {
+            uint32_t nBegin = (uint32_t)(nActive * q / nQueues);
+            uint32_t nEnd = (uint32_t)(nActive * (q + 1) / nQueues);
+            m_vQueues[q].nWord.store(QueueWord(nGeneration, nBegin, nEnd), memory_order_release);
+        }
+        m_nGeneration.store(nGeneration, memory_order_release);
+
+        // Sleeping workers need a kick. The audio thread never takes the
+        // mutex; a missed wake-up only costs that worker's help this block.
+        if (m_nSleeping.load(memory_order_acquire) > 0)
+            m_cvWake.notify_all();
+
+        Work(0, nGeneration);
+
+        // Join: everything is claimed by now, wait for the voices still in
+        // flight on other threads, but not past the block's deadline
+        size_t nJoined = 0;
+        while (nJoined < nActive)
+        {
+            if (m_vVoiceStates[ActiveVoice(nJoined)].nWord.load(memory_order_acquire) == VoiceWord(nGeneration, VOICE_DONE))
+                nJoined++;
+            else if (chrono::steady_clock::now() > m_tDeadline)
+                break;
+        }
+
+        // Missed: voices claimed but not started are rendered here, and
+        // voices a worker is still on are held and left out of this block
+        if (nJoined < nActive)
+        {
+            m_nMissedDeadlines.fetch_add(1, memory_order_relaxed);
+            m_nFallbackLeft = nFallbackBlocks;
+            m_bFallback = true;
+            for (size_t i = nJoined; i < nActive; i++)
+            {
+                uint32_t v = ActiveVoice(i);
+                RenderQueuedVoice(v, nGeneration);
+                if (m_vVoiceStates[v].nWord.load(memory_order_acquire) != VoiceWord(nGeneration, VOICE_DONE))
+                    voices.vHeld[v] = HOLD_RENDERING;
+            }
+        }
+
+        // Mix in voice order
+        for (size_t i = 0; i < nActive; i++)
+        {
+            uint32_t v = ActiveVoice(i);
+            if (voices.vHeld[v] != HOLD_NONE)
+                continue;
+            MixVoice(&m_vBuffers[v * m_nMaxBlockFrames], voices.vPan[v], ppOut, nChannels, nOffset, nFrames, kernels);
+        }
+    }
+
+    // Claims the next item of queue q if it still belongs to block nGeneration
+    bool Claim(size_t q, uint32_t nGeneration, uint32_t& nItem)
+    {
+        uint64_t nWord = m_vQueues[q].nWord.load(memory_order_acquire);
+        while ((uint32_t)(nWord >> 32) == nGeneration)
+        {
+            uint32_t nNext = (uint32_t)(nWord >> 16) & 0xFFFF;
+            uint32_t nEnd = (uint32_t)nWord & 0xFFFF;
+            if (nNext >= nEnd)
+                return false;
+
+            if (m_vQueues[q].nWord.compare_exchange_weak(nWord, QueueWord(nGeneration, nNext + 1, nEnd), memory_order_acq_rel))
+            {
+                nItem = nNext;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Renders items from queue q until it is empty, then steals from the rest
+    void Work(size_t q, uint32_t nGeneration)
+    {
+        size_t nQueues = m_vQueues.size();
+        for (size_t k = 0; k < nQueues; k++)
+        {
+            size_t nVictim = (q + k) % nQueues;
+            uint32_t nItem;
+            while (Claim(nVictim, nGeneration, nItem))
+                RenderQueuedVoice(ActiveVoice(nItem), nGeneration);
+        }
+    }
+
+    uint32_t ActiveVoice(size_t nItem) const
+    {
+        return (uint32_t)m_vActive[nItem].nWord.load(memory_order_relaxed);
+    }
+
+    // Renders voice v for block nGeneration, unless another thread already
+    // has it. A worker that claimed an item long ago may read a voice from a
+    // newer block here; its state word no longer matches, so it is skipped.
+    void RenderQueuedVoice(uint32_t v, uint32_t nGeneration)
+    {
+        uint64_t nQueued = VoiceWord(nGeneration, VOICE_QUEUED);
+        if (v >= m_vVoiceStates.size() || !m_vVoiceStates[v].nWord.compare_exchange_strong(nQueued, VoiceWord(nGeneration, VOICE_RENDERING), memory_order_acq_rel))
+            return;
+
+        const sVoiceJob& job = m_vJobs[v];
+        m_pVoices.load(memory_order_relaxed)->RenderVoice(v, &m_vBuffers[v * m_nMaxBlockFrames], job.nFrames, *job.pPreset, job.envelope, *job.pKernels);
+        m_vVoiceStates[v].nWord.store(VoiceWord(nGeneration, VOICE_DONE), memory_order_release);
+    }
+
+    // Pins the calling thread to one core, leaving core 0 to the audio thread
+    static void PinToCore(unsigned int nCore)
+    {
+        unsigned int nCores = max(1u, thread::hardware_concurrency());
+        nCore %= nCores;
+#if defined(_WIN32)
+        SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << nCore);
+#elif defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(nCore, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+    }
+
+    void WorkerThread(size_t q)
+    {
+        PinToCore((unsigned int)q);
+
+        uint32_t nSeen = m_nGeneration.load(memory_order_acquire);
+        while (!m_bQuit)
+        {
+            // Spin briefly, then yield, then sleep until the next block
+            uint32_t nGeneration = nSeen;
+            auto tSpinEnd = chrono::steady_clock::now() + chrono::microseconds(200);
+            for (int i = 0; (nGeneration = m_nGeneration.load(memory_order_acquire)) == nSeen; i++)
+            {
+                if (m_bQuit)
+                    return;
+                if (i > 1000)
+                {
+                    if (chrono::steady_clock::now() < tSpinEnd)
+                        this_thread::yield();
+                    else
+                    {
+                        unique_lock<mutex> lm(m_muxWake);
+                        m_nSleeping++;
+                        m_cvWake.wait_for(lm, chrono::milliseconds(2), [&]() { return m_bQuit || m_nGeneration.load(memory_order_acquire) != nSeen; });
+                        m_nSleeping--;
+                    }
+                }
+            }
+
+            nSeen = nGeneration;
+            sRealtimeScope realtime;
+            Work(q, nGeneration);
+        }
+    }
+};
@@ -0,0 +1,103 @@
+/*
+    Presets declared as types, so each one compiles into its own render loop.
+
+    A patch lists its partials as template arguments, in the same order as
+    the fields of sPartial: waveform, amplitude, frequency ratio and LFO.
+
+        typedef sPatch<
+            sPatchPartial<OSC_TRIANGLE, sRatio<1>,    sRatio<1>>,      // Triangle at 1.0x
+            sPatchPartial<OSC_TRIANGLE, sRatio<1, 2>, sRatio<3, 2>>    // Triangle at 1.5x, half as loud
+        > sMyPatch;
+
+    The waveform, amplitude and LFO of every partial are then constants.
+    RenderPatch() in synthSimdKernels.inl reads all the partials, sums them
+    and applies the envelope in one loop, with no switch on the waveform, no
+    call per partial and no separate envelope pass.
+
+    sPatch::Preset() gives the sPreset that describes the same sound, with
+    RenderPatch pointing at that loop, so sVoiceManager plays it like any
+    other preset. The generic path remains for presets built at runtime.
+
+    C++14 takes no double template arguments, so amplitudes, ratios and LFO
+    settings are written as fractions. Patches play the wavetable shapes;
+    noise has no table and stays on the generic path.
+*/
+
+#pragma once
+
+#include <cstddef>
+#include <tuple>
+#include <utility>
+
+#include "synth.h"
+#include "synthWavetable.h"
+#include "synthSimd.h"
+
+// N / D as a compile-time constant
+template<long N, long D = 1>
+struct sRatio
+{
+    static constexpr double Value() { return (double)N / (double)D; }
+};
+
+template<int TYPE, class AMPLITUDE, class RATIO, class LFO_HERTZ = sRatio<0>, class LFO_AMPLITUDE = sRatio<0>>
+struct sPatchPartial
+{
+    static_assert(TYPE >= OSC_SINE && TYPE < OSC_NOISE, "patches play the wavetable shapes only");
+
+    // Same test RenderWavetable() makes on dLFODepth
+    static constexpr bool bModulated = LFO_AMPLITUDE::Value() != 0.0;
+
+    static constexpr float Amplitude() { return (float)AMPLITUDE::Value(); }
+
+    static constexpr sPartial Partial()
+    {
+        return { AMPLITUDE::Value(), RATIO::Value(), TYPE, LFO_HERTZ::Value(), LFO_AMPLITUDE::Value() };
+    }
+};
+
+template<bool... B>
+struct sAny;
+
+template<>
+struct sAny<>
+{
+    static constexpr bool value = false;
+};
+
+template<bool FIRST, bool... REST>
+struct sAny<FIRST, REST...>
+{
+    static constexpr bool value = FIRST || sAny<REST...>::value;
+};
+
+template<class... PARTIALS>
+struct sPatch
+{
+    static const int nPartials = (int)sizeof...(PARTIALS);
+    static_assert(nPartials >= 1 && nPartials <= nMaxPartials, "a patch has 1 to nMaxPartials partials");
+
+    // Whether any partial has an LFO
+    static constexpr bool bModulated = sAny<PARTIALS::bModulated...>::value;
+
+    template<size_t I>
+    using Partial = typename tuple_element<I, tuple<PARTIALS...>>::type;
+
+    static constexpr sPreset Preset(const char* sName)
+    {
+        return { sName, nPartials, { PARTIALS::Partial()... }, Render };
+    }
+
+    // The loop for the kernel set in use. The lane count tells the sets apart.
+    static void Render(sWavetableOscillator* pOsc, float* pOut, size_t nFrames, float fStart, float fStep, const sSimdKernels& kernels)
+    {
+        typedef make_index_sequence<sizeof...(PARTIALS)> tIndices;
+#if SYNTH_SIMD_X86
+        if (kernels.nLanes == 8)
+            return simd_avx2::RenderPatch<sPatch>(pOsc, pOut, nFrames, fStart, fStep, tIndices());
+        if (kernels.nLanes == 4)
+            return simd_sse2::RenderPatch<sPatch>(pOsc, pOut, nFrames, fStart, fStep, tIndices());
+#endif
+        simd_scalar::RenderPatch<sPatch>(pOsc, pOut, nFrames, fStart, fStep, tIndices());
+    }
+};
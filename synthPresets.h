@@ -0,0 +1,68 @@
+/*
+    The built-in sounds, shared by the synthesizer and the benchmarks.
+
+    Each sound is a patch type (see synthPatch.h), so it plays through its
+    own compiled render loop. presets[] holds the matching descriptions.
+*/
+
+#pragma once
+
+#include "synth.h"
+#include "synthPatch.h"
+
+static const char* const sOscNames[] = { "Sine", "Square", "Sawtooth", "Triangle", "Ramp", "Pulse", "Noise", "Pink Noise", "Brown Noise", "Sample" };
+
+// Partials are: waveform, amplitude, frequency ratio, LFO hertz, LFO amplitude
+
+// 1. Rich pad sound with multiple oscillators
+typedef sPatch<
+    sPatchPartial<OSC_SINE,     sRatio<1>,    sRatio<1>,    sRatio<2>,    sRatio<1, 100>>,    // Main tone
+    sPatchPartial<OSC_TRIANGLE, sRatio<1, 2>, sRatio<1, 2>, sRatio<3, 2>, sRatio<1, 50>>,     // Sub oscillator
+    sPatchPartial<OSC_SAWTOOTH, sRatio<1, 4>, sRatio<2>,    sRatio<3>,    sRatio<1, 200>>     // High harmonics
+> sRichPadPatch;
+
+// 2. Retro game sound
+typedef sPatch<
+    sPatchPartial<OSC_SQUARE, sRatio<1>,    sRatio<1>>,       // Main tone
+    sPatchPartial<OSC_PULSE,  sRatio<1, 2>, sRatio<3, 2>>     // High harmony
+> sRetroGamePatch;
+
+// 3. Bass sound
+typedef sPatch<
+    sPatchPartial<OSC_TRIANGLE, sRatio<1>,    sRatio<1>>,     // Main tone
+    sPatchPartial<OSC_TRIANGLE, sRatio<1>,    sRatio<3, 2>>,
+    sPatchPartial<OSC_SINE,     sRatio<1, 2>, sRatio<1, 2>>   // Sub bass
+> sBassPatch;
+
+// 4. Lead sound with vibrato
+typedef sPatch<
+    sPatchPartial<OSC_SAWTOOTH, sRatio<1>,    sRatio<1>, sRatio<5>, sRatio<1, 50>>,   // Main tone with vibrato
+    sPatchPartial<OSC_SINE,     sRatio<1, 4>, sRatio<2>, sRatio<5>, sRatio<1, 50>>    // High harmony
+> sLeadPatch;
+
+// 5. Ambient pad
+typedef sPatch<
+    sPatchPartial<OSC_SINE, sRatio<1>,    sRatio<1>,    sRatio<1, 2>,  sRatio<1, 100>>,   // Main tone
+    sPatchPartial<OSC_SINE, sRatio<1, 2>, sRatio<3, 2>, sRatio<7, 10>, sRatio<1, 100>>,   // Harmony
+    sPatchPartial<OSC_SINE, sRatio<1, 4>, sRatio<2>,    sRatio<3, 10>, sRatio<1, 100>>    // High harmony
+> sAmbientPadPatch;
+
+// 6. Hip Hop Bell
+typedef sPatch<
+    sPatchPartial<OSC_TRIANGLE, sRatio<1>,    sRatio<1>>,     // Main tone
+    sPatchPartial<OSC_TRIANGLE, sRatio<1, 2>, sRatio<3, 2>>,  // Perfect fifth
+    sPatchPartial<OSC_TRIANGLE, sRatio<1, 4>, sRatio<2>>,     // Octave up
+    sPatchPartial<OSC_TRIANGLE, sRatio<1, 8>, sRatio<3>>      // Octave + fifth
+> sHipHopBellPatch;
+
+static const sPreset presets[] =
+{
+    sRichPadPatch::Preset("Rich Pad"),
+    sRetroGamePatch::Preset("Retro Game"),
+    sBassPatch::Preset("Bass"),
+    sLeadPatch::Preset("Lead"),
+    sAmbientPadPatch::Preset("Ambient Pad"),
+    sHipHopBellPatch::Preset("Hip Hop Bell"),
+};
+
+static const int nPresetCount = sizeof(presets) / sizeof(presets[0]);
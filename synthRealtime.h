@@ -0,0 +1,535 @@
+/*
+    Realtime safety: an engine arena, and a checker for the render threads.
+
+    sEngineArena hands out memory for an engine's buffers from a few large
+    chunks. Containers of type sArenaVector made while an sArenaScope is
+    open on the thread take their memory from that arena; made anywhere
+    else they use the heap as a plain vector would. The voices, the render
+    pool, the effect buffers, compiled patch graphs and the sampler's rings
+    are all sArenaVectors, so an engine set up inside one scope is laid out
+    in one place before playback starts. Freeze() marks the start of
+    playback: the arena still works afterwards, from the heap, but counts
+    every late allocation.
+
+    Building with -DSYNTH_RT_GUARD turns on the checker. Code that renders
+    audio runs inside an sRealtimeScope (the sound machine's block loop and
+    the render pool's workers open one), and while one is open these are
+    counted, with the call stack they came from:
+
+      RT_ALLOC      operator new and new[]
+      RT_FREE       operator delete and delete[]
+      RT_LOCK       pthread_mutex_lock, pthread_cond_wait and timedwait      (glibc)
+      RT_SYSCALL    read, write, open, poll, select, nanosleep, usleep, fsync (glibc)
+
+    Nothing is allocated or printed on the render thread: the counters are
+    atomics and the first nMaxRealtimeTraces different stacks go into a
+    fixed table. PrintRealtimeReport() prints them from an ordinary thread.
+    Link with -rdynamic to see function names in the stacks. On Windows only
+    new and delete are checked.
+
+    The checker replaces the global operator new and interposes the C
+    library functions above, so with SYNTH_RT_GUARD defined this header
+    belongs to one translation unit per program, as main1.cpp and bench.cpp
+    each are. Without it sRealtimeScope is empty and nothing is replaced.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <vector>
+
+using namespace std;
+
+// Memory for one engine, handed out from large chunks and given back all
+// at once when the arena goes. Allocating is not thread-safe: set the
+// engine up on one thread.
+class sEngineArena
+{
+public:
+    sEngineArena(size_t nChunkBytes = (size_t)1 << 20) : m_nChunkBytes(nChunkBytes) {}
+    sEngineArena(const sEngineArena&) = delete;
+    sEngineArena& operator=(const sEngineArena&) = delete;
+
+    void* Allocate(size_t nBytes, size_t nAlign)
+    {
+        nAlign = max(nAlign, (size_t)64);   // Every buffer on its own cache lines
+        if (m_bFrozen.load(memory_order_relaxed))
+        {
+            m_nLateAllocations.fetch_add(1, memory_order_relaxed);
+            return ::operator new(nBytes);
+        }
+
+        size_t nOffset = m_vChunks.empty() ? 0 : AlignedOffset(m_vChunks.back(), m_nUsed, nAlign);
+        if (m_vChunks.empty() || nOffset + nBytes > m_vChunks.back().nBytes)
+        {
+            // A new chunk, with room for this allocation however large
+            sChunk chunk;
+            chunk.nBytes = max(m_nChunkBytes, nBytes + nAlign);
+            chunk.pMemory.reset(new char[chunk.nBytes]);
+            m_nReserved += chunk.nBytes;
+            m_vChunks.push_back(move(chunk));
+            nOffset = AlignedOffset(m_vChunks.back(), 0, nAlign);
+        }
+
+        m_nUsed = nOffset + nBytes;
+        m_nAllocated += nBytes;
+        return m_vChunks.back().pMemory.get() + nOffset;
+    }
+
+    // Memory from the arena stays until the arena goes; only late
+    // allocations from the heap are freed
+    void Free(void* p)
+    {
+        for (const sChunk& chunk : m_vChunks)
+            if ((char*)p >= chunk.pMemory.get() && (char*)p < chunk.pMemory.get() + chunk.nBytes)
+                return;
+        ::operator delete(p);
+    }
+
+    // Playback has started: allocations from now on come from the heap and
+    // are counted in LateAllocations()
+    void Freeze()
+    {
+        m_bFrozen.store(true, memory_order_relaxed);
+    }
+
+    size_t Allocated() const { return m_nAllocated; }     // Bytes handed out before Freeze()
+    size_t Reserved() const { return m_nReserved; }       // Bytes in chunks
+    uint64_t LateAllocations() const { return m_nLateAllocations.load(memory_order_relaxed); }
+
+private:
+    struct sChunk
+    {
+        unique_ptr<char[]> pMemory;
+        size_t nBytes;
+    };
+
+    // First offset from nFrom on in chunk whose address is a multiple of nAlign
+    static size_t AlignedOffset(const sChunk& chunk, size_t nFrom, size_t nAlign)
+    {
+        uintptr_t nBase = (uintptr_t)chunk.pMemory.get();
+        return (size_t)(((nBase + nFrom + nAlign - 1) & ~(uintptr_t)(nAlign - 1)) - nBase);
+    }
+
+    size_t m_nChunkBytes;
+    vector<sChunk> m_vChunks;
+    size_t m_nUsed = 0;          // In the last chunk
+    size_t m_nAllocated = 0;
+    size_t m_nReserved = 0;
+    atomic<bool> m_bFrozen { false };
+    atomic<uint64_t> m_nLateAllocations { 0 };
+};
+
+// While one of these is open, sArenaVectors made on this thread take their
+// memory from arena. Scopes nest.
+class sArenaScope
+{
+public:
+    sArenaScope(sEngineArena& arena) : m_pPrevious(Slot())
+    {
+        Slot() = &arena;
+    }
+
+    ~sArenaScope()
+    {
+        Slot() = m_pPrevious;
+    }
+
+    // The arena of the innermost open scope on this thread, or nullptr
+    static sEngineArena* Current()
+    {
+        return Slot();
+    }
+
+private:
+    sEngineArena* m_pPrevious;
+
+    static sEngineArena*& Slot()
+    {
+        static thread_local sEngineArena* pArena = nullptr;
+        return pArena;
+    }
+};
+
+// Allocator for the arena current when the container was made, or the heap
+template<class T>
+class sArenaAllocator
+{
+public:
+    typedef T value_type;
+    typedef true_type propagate_on_container_move_assignment;
+    typedef true_type propagate_on_container_swap;
+
+    sArenaAllocator() : pArena(sArenaScope::Current()) {}
+
+    template<class U>
+    sArenaAllocator(const sArenaAllocator<U>& other) : pArena(other.pArena) {}
+
+    T* allocate(size_t n)
+    {
+        if (pArena != nullptr)
+            return (T*)pArena->Allocate(n * sizeof(T), alignof(T));
+        return (T*)::operator new(n * sizeof(T));
+    }
+
+    void deallocate(T* p, size_t)
+    {
+        if (pArena != nullptr)
+            pArena->Free(p);
+        else
+            ::operator delete(p);
+    }
+
+    // Copies take their memory from wherever the copy is made
+    sArenaAllocator select_on_container_copy_construction() const
+    {
+        return sArenaAllocator();
+    }
+
+    sEngineArena* pArena;
+};
+
+template<class T, class U>
+bool operator==(const sArenaAllocator<T>& a, const sArenaAllocator<U>& b)
+{
+    return a.pArena == b.pArena;
+}
+
+template<class T, class U>
+bool operator!=(const sArenaAllocator<T>& a, const sArenaAllocator<U>& b)
+{
+    return a.pArena != b.pArena;
+}
+
+template<class T>
+using sArenaVector = vector<T, sArenaAllocator<T>>;
+
+// What the checker counts
+#define RT_ALLOC 0
+#define RT_FREE 1
+#define RT_LOCK 2
+#define RT_SYSCALL 3
+
+static const char* const sRealtimeViolationNames[] = { "allocation", "free", "lock", "blocking call" };
+
+struct sRealtimeReport
+{
+    uint64_t nViolations[4];    // Indexed by RT_*
+    bool bEnabled;              // Built with SYNTH_RT_GUARD
+
+    uint64_t Total() const
+    {
+        return nViolations[RT_ALLOC] + nViolations[RT_FREE] + nViolations[RT_LOCK] + nViolations[RT_SYSCALL];
+    }
+};
+
+#if defined(SYNTH_RT_GUARD)
+
+#if defined(_WIN32)
+#include <cstdio>
+#else
+#include <cstdarg>
+#include <cxxabi.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <string>
+#endif
+
+#if defined(__GLIBC__)
+#include <dlfcn.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/select.h>
+#include <time.h>
+#include <unistd.h>
+#define SYNTH_RT_GUARD_LIBC 1
+#endif
+
+const int nMaxRealtimeTraces = 32;
+const int nRealtimeTraceDepth = 24;
+
+// One call stack that broke the rules, and how often it did
+struct sRealtimeTrace
+{
+    atomic<uint64_t> nHash;     // 0 while the slot is free
+    atomic<bool> bReady;        // Frames written
+    atomic<uint64_t> nCount;
+    int nKind;
+    int nFrames;
+    void* pFrames[nRealtimeTraceDepth];
+};
+
+// Zero-initialised before anything runs, so safe to use from the earliest
+// operator new
+sRealtimeTrace g_realtimeTraces[nMaxRealtimeTraces];
+atomic<uint64_t> g_nRealtimeViolations[4];
+atomic<uint64_t> g_nRealtimeTracesLost;
+thread_local int t_nRealtimeDepth;      // Open sRealtimeScopes on this thread
+thread_local bool t_bInRealtimeGuard;   // Recording a violation, so ignore what that does
+
+// Records a violation of kind nKind if this thread is rendering
+inline void RealtimeViolation(int nKind)
+{
+    if (t_nRealtimeDepth == 0 || t_bInRealtimeGuard)
+        return;
+    t_bInRealtimeGuard = true;
+
+    g_nRealtimeViolations[nKind].fetch_add(1, memory_order_relaxed);
+
+    void* pFrames[nRealtimeTraceDepth + 2];
+#if defined(_WIN32)
+    int nFrames = (int)CaptureStackBackTrace(0, nRealtimeTraceDepth + 2, pFrames, nullptr);
+#else
+    int nFrames = backtrace(pFrames, nRealtimeTraceDepth + 2);
+#endif
+
+    // Leave out this function and the hook that called it
+    int nSkip = min(nFrames, 2);
+    uint64_t nHash = 14695981039346656037ull ^ (uint64_t)nKind;
+    for (int i = nSkip; i < nFrames; i++)
+        nHash = (nHash ^ (uint64_t)(uintptr_t)pFrames[i]) * 1099511628211ull;
+    nHash |= 1;
+
+    bool bStored = false;
+    for (int t = 0; t < nMaxRealtimeTraces && !bStored; t++)
+    {
+        sRealtimeTrace& trace = g_realtimeTraces[t];
+        uint64_t nExpected = 0;
+        if (trace.nHash.compare_exchange_strong(nExpected, nHash, memory_order_acq_rel))
+        {
+            trace.nKind = nKind;
+            trace.nFrames = nFrames - nSkip;
+            for (int i = nSkip; i < nFrames; i++)
+                trace.pFrames[i - nSkip] = pFrames[i];
+            trace.nCount.fetch_add(1, memory_order_relaxed);
+            trace.bReady.store(true, memory_order_release);
+            bStored = true;
+        }
+        else if (nExpected == nHash)
+        {
+            trace.nCount.fetch_add(1, memory_order_relaxed);
+            bStored = true;
+        }
+    }
+    if (!bStored)
+        g_nRealtimeTracesLost.fetch_add(1, memory_order_relaxed);
+
+    t_bInRealtimeGuard = false;
+}
+
+// Marks the calling thread as rendering audio until it goes out of scope
+class sRealtimeScope
+{
+public:
+    sRealtimeScope() { t_nRealtimeDepth++; }
+    ~sRealtimeScope() { t_nRealtimeDepth--; }
+};
+
+inline sRealtimeReport RealtimeReport()
+{
+    sRealtimeReport report;
+    for (int k = 0; k < 4; k++)
+        report.nViolations[k] = g_nRealtimeViolations[k].load(memory_order_relaxed);
+    report.bEnabled = true;
+    return report;
+}
+
+// Prints the counts and every stack recorded
+inline void PrintRealtimeReport(ostream& out = cout)
+{
+    sRealtimeReport report = RealtimeReport();
+    out << "Realtime violations: " << report.nViolations[RT_ALLOC] << " allocations, " << report.nViolations[RT_FREE] << " frees, "
+        << report.nViolations[RT_LOCK] << " locks, " << report.nViolations[RT_SYSCALL] << " blocking calls" << endl;
+
+    for (int t = 0; t < nMaxRealtimeTraces; t++)
+    {
+        const sRealtimeTrace& trace = g_realtimeTraces[t];
+        if (!trace.bReady.load(memory_order_acquire))
+            continue;
+
+        out << "  " << sRealtimeViolationNames[trace.nKind] << ", " << trace.nCount.load(memory_order_relaxed) << " times, at:" << endl;
+#if defined(_WIN32)
+        for (int i = 0; i < trace.nFrames; i++)
+        {
+            char sAddress[32];
+            snprintf(sAddress, sizeof(sAddress), "%p", trace.pFrames[i]);
+            out << "    " << sAddress << endl;
+        }
+#else
+        char** ppSymbols = backtrace_symbols(trace.pFrames, trace.nFrames);
+        for (int i = 0; i < trace.nFrames && ppSymbols != nullptr; i++)
+        {
+            // "binary(mangled+offset) [address]", with the name demangled
+            string sLine = ppSymbols[i];
+            size_t nOpen = sLine.find('('), nPlus = sLine.find('+', nOpen);
+            if (nOpen != string::npos && nPlus != string::npos && nPlus > nOpen + 1)
+            {
+                int nStatus = 0;
+                char* sName = abi::__cxa_demangle(sLine.substr(nOpen + 1, nPlus - nOpen - 1).c_str(), nullptr, nullptr, &nStatus);
+                if (nStatus == 0 && sName != nullptr)
+                    sLine = sLine.substr(0, nOpen + 1) + sName + sLine.substr(nPlus);
+                free(sName);
+            }
+            out << "    " << sLine << endl;
+        }
+        free(ppSymbols);
+#endif
+    }
+
+    uint64_t nLost = g_nRealtimeTracesLost.load(memory_order_relaxed);
+    if (nLost > 0)
+        out << "  " << nLost << " more from stacks not recorded" << endl;
+}
+
+// backtrace() loads its unwinder the first time it is called, which
+// allocates and locks, so that is done once before any audio runs
+struct sRealtimeGuardInit
+{
+    sRealtimeGuardInit()
+    {
+#if !defined(_WIN32)
+        void* pFrame;
+        backtrace(&pFrame, 1);
+#endif
+    }
+} g_realtimeGuardInit;
+
+// The global operator new and delete, counted on rendering threads
+
+void* operator new(size_t nBytes)
+{
+    RealtimeViolation(RT_ALLOC);
+    if (void* p = malloc(nBytes > 0 ? nBytes : 1))
+        return p;
+    throw bad_alloc();
+}
+
+void* operator new[](size_t nBytes)
+{
+    return operator new(nBytes);
+}
+
+void* operator new(size_t nBytes, const nothrow_t&) noexcept
+{
+    RealtimeViolation(RT_ALLOC);
+    return malloc(nBytes > 0 ? nBytes : 1);
+}
+
+void* operator new[](size_t nBytes, const nothrow_t& tag) noexcept
+{
+    return operator new(nBytes, tag);
+}
+
+void operator delete(void* p) noexcept
+{
+    if (p != nullptr)
+        RealtimeViolation(RT_FREE);
+    free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    operator delete(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+void operator delete(void* p, const nothrow_t&) noexcept
+{
+    operator delete(p);
+}
+
+void operator delete[](void* p, const nothrow_t&) noexcept
+{
+    operator delete(p);
+}
+
+#if defined(SYNTH_RT_GUARD_LIBC)
+
+// The C library's own version of a function interposed below. glibc calls
+// its internal versions directly, so dlsym() never comes back in here.
+template<class FUNC>
+FUNC RealtimeNextFunction(FUNC& pNext, const char* sName)
+{
+    if (pNext == nullptr)
+        pNext = (FUNC)dlsym(RTLD_NEXT, sName);
+    return pNext;
+}
+
+#define SYNTH_RT_INTERPOSE(KIND, RESULT, NAME, PARAMS, ARGS) \
+    static RESULT(*g_pNext_##NAME) PARAMS = nullptr; \
+    extern "C" RESULT NAME PARAMS \
+    { \
+        RealtimeViolation(KIND); \
+        return RealtimeNextFunction(g_pNext_##NAME, #NAME) ARGS; \
+    }
+
+SYNTH_RT_INTERPOSE(RT_LOCK, int, pthread_mutex_lock, (pthread_mutex_t* pMutex), (pMutex))
+SYNTH_RT_INTERPOSE(RT_LOCK, int, pthread_cond_wait, (pthread_cond_t* pCond, pthread_mutex_t* pMutex), (pCond, pMutex))
+SYNTH_RT_INTERPOSE(RT_LOCK, int, pthread_cond_timedwait, (pthread_cond_t* pCond, pthread_mutex_t* pMutex, const struct timespec* pTime), (pCond, pMutex, pTime))
+SYNTH_RT_INTERPOSE(RT_LOCK, int, pthread_cond_clockwait, (pthread_cond_t* pCond, pthread_mutex_t* pMutex, clockid_t nClock, const struct timespec* pTime), (pCond, pMutex, nClock, pTime))
+SYNTH_RT_INTERPOSE(RT_SYSCALL, ssize_t, read, (int nFd, void* pBuffer, size_t nBytes), (nFd, pBuffer, nBytes))
+SYNTH_RT_INTERPOSE(RT_SYSCALL, ssize_t, write, (int nFd, const void* pBuffer, size_t nBytes), (nFd, pBuffer, nBytes))
+SYNTH_RT_INTERPOSE(RT_SYSCALL, int, poll, (struct pollfd* pFds, nfds_t nCount, int nTimeout), (pFds, nCount, nTimeout))
+SYNTH_RT_INTERPOSE(RT_SYSCALL, int, select, (int nFds, fd_set* pRead, fd_set* pWrite, fd_set* pError, struct timeval* pTimeout), (nFds, pRead, pWrite, pError, pTimeout))
+SYNTH_RT_INTERPOSE(RT_SYSCALL, int, nanosleep, (const struct timespec* pTime, struct timespec* pLeft), (pTime, pLeft))
+SYNTH_RT_INTERPOSE(RT_SYSCALL, int, clock_nanosleep, (clockid_t nClock, int nFlags, const struct timespec* pTime, struct timespec* pLeft), (nClock, nFlags, pTime, pLeft))
+SYNTH_RT_INTERPOSE(RT_SYSCALL, int, usleep, (useconds_t nMicroseconds), (nMicroseconds))
+SYNTH_RT_INTERPOSE(RT_SYSCALL, int, fsync, (int nFd), (nFd))
+
+// open() takes a mode only when creating
+static int(*g_pNext_open)(const char*, int, ...) = nullptr;
+extern "C" int open(const char* sPath, int nFlags, ...)
+{
+    RealtimeViolation(RT_SYSCALL);
+    mode_t nMode = 0;
+    if (nFlags & (O_CREAT | O_TMPFILE))
+    {
+        va_list args;
+        va_start(args, nFlags);
+        nMode = (mode_t)va_arg(args, int);
+        va_end(args);
+    }
+    return RealtimeNextFunction(g_pNext_open, "open")(sPath, nFlags, nMode);
+}
+
+#undef SYNTH_RT_INTERPOSE
+
+#endif
+
+#else
+
+// Without SYNTH_RT_GUARD nothing is checked
+class sRealtimeScope
+{
+public:
+    sRealtimeScope() {}
+};
+
+inline sRealtimeReport RealtimeReport()
+{
+    sRealtimeReport report = { { 0, 0, 0, 0 }, false };
+    return report;
+}
+
+inline void PrintRealtimeReport(ostream& out = cout)
+{
+    out << "Realtime checks are off, build with -DSYNTH_RT_GUARD" << endl;
+}
+
+#endif
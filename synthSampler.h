@@ -0,0 +1,546 @@
+/*
+    Sample playback: recorded notes streamed from disk.
+
+    A partial of type OSC_SAMPLE plays a recording instead of a waveform.
+    sSampler holds the recordings of one instrument (each a WAV file with
+    the note it was recorded at) and streams them to the voices of an
+    sVoiceManager whose pSampler points at it. The voice's envelope, level
+    and pan apply to a sample exactly as they do to an oscillator.
+
+    Sample sets can be far larger than RAM, so nothing is read up front
+    except the start of each sample:
+
+    1. Every file is memory-mapped. Its first nPreloadFrames frames are
+       converted to float and kept in RAM, so a note sounds at once.
+    2. Each voice has a lock-free ring. A prefetch thread started with
+       Start() fills it from the mapped file, following on from the
+       preloaded frames. Page faults, and so the disk reads, happen on that
+       thread only.
+    3. The audio thread plays the preloaded frames, then the ring. It never
+       waits: a ring that has not been filled in time plays silence for the
+       missing frames, and is counted in Underruns().
+
+    A note plays the sample recorded nearest to it, resampled by linear
+    interpolation, once through. A preset plays one sample partial per
+    voice; any after the first are silent.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "synth.h"
+#include "synthRealtime.h"
+
+// A file mapped read-only into memory. Pages are read from disk the first
+// time they are touched.
+class sMappedFile
+{
+public:
+    sMappedFile() {}
+    sMappedFile(const sMappedFile&) = delete;
+    sMappedFile& operator=(const sMappedFile&) = delete;
+
+    ~sMappedFile()
+    {
+        Close();
+    }
+
+    bool Open(const string& sFile)
+    {
+        Close();
+#if defined(_WIN32)
+        m_hFile = CreateFileA(sFile.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (m_hFile == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER nSize;
+        if (!GetFileSizeEx(m_hFile, &nSize) || nSize.QuadPart == 0)
+        {
+            Close();
+            return false;
+        }
+        m_nSize = (size_t)nSize.QuadPart;
+
+        m_hMapping = CreateFileMappingA(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_hMapping != nullptr)
+            m_pData = (const uint8_t*)MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+#else
+        int nFd = open(sFile.c_str(), O_RDONLY);
+        if (nFd < 0)
+            return false;
+
+        struct stat info;
+        if (fstat(nFd, &info) == 0 && info.st_size > 0)
+        {
+            m_nSize = (size_t)info.st_size;
+            void* p = mmap(nullptr, m_nSize, PROT_READ, MAP_PRIVATE, nFd, 0);
+            if (p != MAP_FAILED)
+            {
+                m_pData = (const uint8_t*)p;
+                madvise(p, m_nSize, MADV_SEQUENTIAL);
+            }
+        }
+        close(nFd);
+#endif
+        if (m_pData == nullptr)
+        {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close()
+    {
+#if defined(_WIN32)
+        if (m_pData != nullptr)
+            UnmapViewOfFile(m_pData);
+        if (m_hMapping != nullptr)
+            CloseHandle(m_hMapping);
+        if (m_hFile != INVALID_HANDLE_VALUE)
+            CloseHandle(m_hFile);
+        m_hMapping = nullptr;
+        m_hFile = INVALID_HANDLE_VALUE;
+#else
+        if (m_pData != nullptr)
+            munmap((void*)m_pData, m_nSize);
+#endif
+        m_pData = nullptr;
+        m_nSize = 0;
+    }
+
+    const uint8_t* Data() const { return m_pData; }
+    size_t Size() const { return m_nSize; }
+
+private:
+    const uint8_t* m_pData = nullptr;
+    size_t m_nSize = 0;
+#if defined(_WIN32)
+    HANDLE m_hFile = INVALID_HANDLE_VALUE;
+    HANDLE m_hMapping = nullptr;
+#endif
+};
+
+// One recorded note: a mapped WAV file and its first frames in RAM
+struct sSample
+{
+    sMappedFile file;
+    const uint8_t* pFrames = nullptr;  // Sample data within the mapping
+    uint64_t nFrames = 0;
+    unsigned int nChannels = 0;
+    unsigned int nBytes = 0;           // Per channel sample
+    bool bFloat = false;
+    double dSampleRate = 0.0;
+    int nRootNote = 60;                // MIDI note it was recorded at
+    vector<float> vHead;               // The first frames, in mono
+
+    // Opens a PCM (8, 16, 24 or 32-bit) or float WAV file. The root note
+    // comes from a 'smpl' chunk if there is one, otherwise nDefaultRoot.
+    bool Open(const string& sFile, int nDefaultRoot, size_t nPreloadFrames, string& sError)
+    {
+        if (!file.Open(sFile))
+        {
+            sError = "cannot open " + sFile;
+            return false;
+        }
+
+        const uint8_t* p = file.Data();
+        size_t nSize = file.Size();
+        if (nSize < 12 || memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "WAVE", 4) != 0)
+        {
+            sError = sFile + " is not a WAV file";
+            return false;
+        }
+
+        nRootNote = nDefaultRoot;
+        unsigned int nFormat = 0;
+        size_t nDataBytes = 0;
+        for (size_t nPos = 12; nPos + 8 <= nSize;)
+        {
+            size_t nChunk = U32(p + nPos + 4);
+            const uint8_t* pChunk = p + nPos + 8;
+            nChunk = min(nChunk, nSize - nPos - 8);
+
+            if (memcmp(p + nPos, "fmt ", 4) == 0 && nChunk >= 16)
+            {
+                nFormat = U16(pChunk);
+                nChannels = U16(pChunk + 2);
+                dSampleRate = (double)U32(pChunk + 4);
+                nBytes = U16(pChunk + 14) / 8;
+                if (nFormat == 0xFFFE && nChunk >= 26)   // WAVE_FORMAT_EXTENSIBLE, the real format opens the GUID
+                    nFormat = U16(pChunk + 24);
+            }
+            else if (memcmp(p + nPos, "smpl", 4) == 0 && nChunk >= 16)
+                nRootNote = (int)U32(pChunk + 12);
+            else if (memcmp(p + nPos, "data", 4) == 0)
+            {
+                pFrames = pChunk;
+                nDataBytes = nChunk;
+            }
+            nPos += 8 + nChunk + (nChunk & 1);
+        }
+
+        bFloat = nFormat == 3;
+        bool bPcm = nFormat == 1 && nBytes >= 1 && nBytes <= 4;
+        if (pFrames == nullptr || nChannels == 0 || dSampleRate <= 0.0 || !(bPcm || (bFloat && nBytes == 4)))
+        {
+            sError = sFile + ": only PCM and 32-bit float WAV files are supported";
+            return false;
+        }
+        nFrames = nDataBytes / (nChannels * nBytes);
+
+        vHead.resize((size_t)min<uint64_t>(nPreloadFrames, nFrames));
+        Read(0, vHead.size(), vHead.data());
+        return true;
+    }
+
+    // Converts nCount frames from nStart on to mono float. Touches the
+    // mapping, so may wait on the disk.
+    void Read(uint64_t nStart, size_t nCount, float* pOut) const
+    {
+        const float fScale = 1.0f / (float)nChannels;
+        const uint8_t* p = pFrames + nStart * nChannels * nBytes;
+        for (size_t n = 0; n < nCount; n++)
+        {
+            float fSum = 0.0f;
+            for (unsigned int c = 0; c < nChannels; c++, p += nBytes)
+                fSum += Value(p);
+            pOut[n] = fSum * fScale;
+        }
+    }
+
+private:
+    static uint32_t U16(const uint8_t* p) { return (uint32_t)p[0] | ((uint32_t)p[1] << 8); }
+    static uint32_t U32(const uint8_t* p) { return U16(p) | (U16(p + 2) << 16); }
+
+    float Value(const uint8_t* p) const
+    {
+        switch (nBytes)
+        {
+        case 1: return ((float)p[0] - 128.0f) * (1.0f / 128.0f);
+        case 2: return (float)(int16_t)U16(p) * (1.0f / 32768.0f);
+        case 3: return (float)((int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 24)) >> 8) * (1.0f / 8388608.0f);
+        default:
+            if (bFloat)
+            {
+                float f;
+                memcpy(&f, p, sizeof(f));
+                return f;
+            }
+            return (float)(int32_t)U32(p) * (1.0f / 2147483648.0f);
+        }
+    }
+};
+
+// Single-producer/single-consumer ring of samples, written and read in runs.
+// Like sSpscQueue, neither side blocks or allocates.
+class sSampleRing
+{
+public:
+    // nCapacity is rounded up to a power of 2
+    void Allocate(size_t nCapacity)
+    {
+        size_t nSize = 2;
+        while (nSize < nCapacity)
+            nSize <<= 1;
+        m_vSamples.assign(nSize, 0.0f);
+        m_nMask = nSize - 1;
+        m_nHead = 0;
+        m_nTail = 0;
+    }
+
+    // Producer only
+    size_t Space() const
+    {
+        return m_vSamples.size() - (m_nTail.load(memory_order_relaxed) - m_nHead.load(memory_order_acquire));
+    }
+
+    // Producer only. pIn must fit in Space().
+    void Write(const float* pIn, size_t nCount)
+    {
+        size_t nTail = m_nTail.load(memory_order_relaxed);
+        for (size_t n = 0; n < nCount; n++)
+            m_vSamples[(nTail + n) & m_nMask] = pIn[n];
+        m_nTail.store(nTail + nCount, memory_order_release);
+    }
+
+    // Consumer only. Takes up to nCount samples and returns how many it took.
+    size_t Read(float* pOut, size_t nCount)
+    {
+        size_t nHead = m_nHead.load(memory_order_relaxed);
+        size_t nReady = m_nTail.load(memory_order_acquire) - nHead;
+        nCount = min(nCount, nReady);
+        for (size_t n = 0; n < nCount; n++)
+            pOut[n] = m_vSamples[(nHead + n) & m_nMask];
+        m_nHead.store(nHead + nCount, memory_order_release);
+        return nCount;
+    }
+
+    // Empties the ring. Only while the consumer is known not to be reading.
+    void Reset()
+    {
+        m_nHead.store(0, memory_order_relaxed);
+        m_nTail.store(0, memory_order_relaxed);
+    }
+
+private:
+    sArenaVector<float> m_vSamples;
+    size_t m_nMask = 0;
+    alignas(64) atomic<size_t> m_nHead;
+    alignas(64) atomic<size_t> m_nTail;
+};
+
+class sSampler
+{
+public:
+    size_t nPreloadFrames;    // Frames of each sample kept in RAM; set before AddSample()
+
+    // One stream per voice of the sVoiceManager this plays for
+    sSampler(size_t nVoices = 128, size_t nRingFrames = 32768) : m_vStreams(nVoices)
+    {
+        nPreloadFrames = 4096;
+        for (sStream& stream : m_vStreams)
+            stream.ring.Allocate(nRingFrames);
+        m_vChunk.assign(nChunkFrames, 0.0f);
+    }
+
+    ~sSampler()
+    {
+        Stop();
+    }
+
+    // Adds a sample, recorded at nRootNote or, if that is negative, at the
+    // note in the file's 'smpl' chunk (C4 without one). Not while running.
+    bool AddSample(const string& sFile, int nRootNote, string& sError)
+    {
+        m_vSamples.emplace_back(new sSample());
+        if (!m_vSamples.back()->Open(sFile, nRootNote >= 0 ? nRootNote : 60, nPreloadFrames, sError))
+        {
+            m_vSamples.pop_back();
+            return false;
+        }
+        if (nRootNote >= 0)
+            m_vSamples.back()->nRootNote = nRootNote;
+        return true;
+    }
+
+    size_t SampleCount() const
+    {
+        return m_vSamples.size();
+    }
+
+    // Starts the prefetch thread
+    void Start()
+    {
+        if (m_bRunning.exchange(true))
+            return;
+        m_thread = thread(&sSampler::PrefetchThread, this);
+    }
+
+    void Stop()
+    {
+        if (!m_bRunning.exchange(false))
+            return;
+        m_thread.join();
+    }
+
+    // Frames the audio thread had to play as silence because their ring was
+    // not filled in time
+    uint64_t Underruns() const
+    {
+        return m_nUnderruns.load(memory_order_relaxed);
+    }
+
+    // Audio thread: voice v starts a note at dHertz. Picks the sample and
+    // asks the prefetch thread for the rest of it.
+    void NoteOn(size_t v, double dHertz)
+    {
+        if (v >= m_vStreams.size() || m_vSamples.empty())
+            return;
+
+        sStream& stream = m_vStreams[v];
+        stream.nSample = NearestSample(dHertz);
+        stream.nGeneration++;
+        stream.dPosition = 0.0;
+        stream.nNextFrame = 0;
+        stream.fFrom = 0.0f;
+        stream.fTo = 0.0f;
+        stream.nSkip = 0;
+        stream.nFetched = 0;       // Frames left from the last note must not play
+        stream.nFetchPos = 0;
+        stream.nRequest.store(((uint64_t)stream.nGeneration << 32) | (uint64_t)(stream.nSample + 1), memory_order_release);
+    }
+
+    // Audio thread: adds fAmplitude times voice v's sample, playing at
+    // dHertz, to nFrames samples of pOut
+    void Render(size_t v, float* pOut, size_t nFrames, double dHertz, double dSampleRate, float fAmplitude)
+    {
+        if (v >= m_vStreams.size())
+            return;
+        sStream& stream = m_vStreams[v];
+        if (stream.nSample < 0)
+            return;
+
+        const sSample& sample = *m_vSamples[(size_t)stream.nSample];
+        double dStep = dHertz / NoteHertz(sample.nRootNote) * sample.dSampleRate / dSampleRate;
+        uint64_t nStarved = 0;
+
+        for (size_t n = 0; n < nFrames; n++)
+        {
+            uint64_t nFrame = (uint64_t)stream.dPosition;
+            if (nFrame >= sample.nFrames)
+                break;
+
+            // fFrom and fTo are frames nFrame and nFrame + 1
+            while (stream.nNextFrame <= nFrame + 1)
+            {
+                stream.fFrom = stream.fTo;
+                stream.fTo = Fetch(stream, sample, nStarved);
+                stream.nNextFrame++;
+            }
+
+            float fFraction = (float)(stream.dPosition - (double)nFrame);
+            pOut[n] += fAmplitude * (stream.fFrom + (stream.fTo - stream.fFrom) * fFraction);
+            stream.dPosition += dStep;
+        }
+
+        if (nStarved > 0)
+            m_nUnderruns.fetch_add(nStarved, memory_order_relaxed);
+    }
+
+private:
+    static const size_t nChunkFrames = 4096;    // Most the prefetch thread reads into a ring at once
+    static const size_t nFetchFrames = 64;      // Read from the ring at a time by the audio thread
+
+    struct sStream
+    {
+        sSampleRing ring;
+
+        // Audio thread
+        int nSample = -1;
+        uint32_t nGeneration = 0;          // Counts notes, so the prefetch thread can tell them apart
+        double dPosition = 0.0;            // In frames of the sample
+        uint64_t nNextFrame = 0;           // Next frame Fetch() will give
+        float fFrom = 0.0f, fTo = 0.0f;
+        uint64_t nSkip = 0;                // Frames played as silence, still to be dropped from the ring
+        float fFetched[nFetchFrames];
+        size_t nFetched = 0, nFetchPos = 0;
+
+        // Written by the audio thread: generation << 32 | sample + 1
+        atomic<uint64_t> nRequest;
+        // Written by the prefetch thread once the ring holds this generation's frames
+        atomic<uint32_t> nReady;
+
+        // Prefetch thread
+        uint64_t nPrefetchRequest = 0;
+        uint64_t nPrefetchFrame = 0;       // Next frame to put in the ring
+
+        sStream() : nRequest(0), nReady(0) {}
+    };
+
+    vector<unique_ptr<sSample>> m_vSamples;
+    sArenaVector<sStream> m_vStreams;
+    sArenaVector<float> m_vChunk;          // Prefetch thread's read buffer
+    atomic<bool> m_bRunning { false };
+    atomic<uint64_t> m_nUnderruns { 0 };
+    thread m_thread;
+
+    // The sample recorded closest to dHertz
+    int NearestSample(double dHertz) const
+    {
+        double dNote = 69.0 + 12.0 * log2(max(dHertz, 1e-3) / 440.0);
+        int nBest = 0;
+        for (size_t s = 1; s < m_vSamples.size(); s++)
+            if (fabs(m_vSamples[s]->nRootNote - dNote) < fabs(m_vSamples[nBest]->nRootNote - dNote))
+                nBest = (int)s;
+        return nBest;
+    }
+
+    // Frame stream.nNextFrame of the sample: preloaded, or from the ring
+    float Fetch(sStream& stream, const sSample& sample, uint64_t& nStarved)
+    {
+        if (stream.nNextFrame >= sample.nFrames)
+            return 0.0f;
+        if (stream.nNextFrame < sample.vHead.size())
+            return sample.vHead[(size_t)stream.nNextFrame];
+
+        // Frames that were played as silence are dropped as they arrive
+        if (stream.nReady.load(memory_order_acquire) == stream.nGeneration)
+        {
+            while (stream.nFetchPos == stream.nFetched)
+            {
+                stream.nFetchPos = 0;
+                stream.nFetched = stream.ring.Read(stream.fFetched, nFetchFrames);
+                if (stream.nFetched == 0)
+                    break;
+
+                size_t nDrop = (size_t)min<uint64_t>(stream.nSkip, stream.nFetched);
+                stream.nSkip -= nDrop;
+                stream.nFetchPos = nDrop;
+            }
+        }
+
+        if (stream.nFetchPos < stream.nFetched)
+            return stream.fFetched[stream.nFetchPos++];
+
+        nStarved++;
+        stream.nSkip++;
+        return 0.0f;
+    }
+
+    void PrefetchThread()
+    {
+        while (m_bRunning.load(memory_order_relaxed))
+        {
+            bool bBusy = false;
+            for (sStream& stream : m_vStreams)
+            {
+                // A new note: the audio thread has stopped reading the ring,
+                // so it can be emptied and refilled from after the preload
+                uint64_t nRequest = stream.nRequest.load(memory_order_acquire);
+                if (nRequest != stream.nPrefetchRequest)
+                {
+                    stream.nPrefetchRequest = nRequest;
+                    stream.ring.Reset();
+                    int nSample = (int)(nRequest & 0xFFFFFFFFu) - 1;
+                    stream.nPrefetchFrame = nSample >= 0 ? m_vSamples[(size_t)nSample]->vHead.size() : 0;
+                    stream.nReady.store((uint32_t)(nRequest >> 32), memory_order_release);
+                }
+
+                int nSample = (int)(stream.nPrefetchRequest & 0xFFFFFFFFu) - 1;
+                if (nSample < 0)
+                    continue;
+                const sSample& sample = *m_vSamples[(size_t)nSample];
+                size_t nCount = (size_t)min<uint64_t>(min(stream.ring.Space(), nChunkFrames), sample.nFrames - min(stream.nPrefetchFrame, sample.nFrames));
+                if (nCount == 0)
+                    continue;
+
+                sample.Read(stream.nPrefetchFrame, nCount, m_vChunk.data());
+                stream.ring.Write(m_vChunk.data(), nCount);
+                stream.nPrefetchFrame += nCount;
+                bBusy = true;
+            }
+
+            // Nothing to read: the rings are full or every sample is in.
+            // A new note plays from its preload for far longer than this.
+            if (!bBusy)
+                this_thread::sleep_for(chrono::milliseconds(2));
+        }
+    }
+};
@@ -0,0 +1,283 @@
+/*
+    SIMD oscillator, envelope and mixing kernels with run-time dispatch.
+
+    The kernels in synthSimdKernels.inl are compiled three times: plain scalar
+    (one lane, the reference), SSE2 (4 lanes) and AVX2 (8 lanes). SimdKernels()
+    checks the CPU once and hands back the widest set it supports. Each kernel
+    works across the samples of one oscillator, keeping the phase of every lane
+    in float for the length of one block.
+
+    The scalar set is the reference the vector sets must agree with. Within a
+    block they differ only by float rounding, apart from the odd sample sitting
+    right on a square or pulse edge.
+*/
+
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#include "synth.h"
+#include "synthWavetable.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SYNTH_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#else
+#define SYNTH_SIMD_X86 0
+#endif
+
+#define SIMD_SCALAR 0
+#define SIMD_SSE2 1
+#define SIMD_AVX2 2
+
+struct sSimdKernels
+{
+    const char* sName;
+    int nLanes;
+
+    // Adds fAmplitude * waveform to nFrames samples of pOut and advances the oscillator
+    void(*RenderOscillator)(sOscillator& osc, float* pOut, size_t nFrames, float fAmplitude);
+    void(*RenderWavetable)(sWavetableOscillator& osc, float* pOut, size_t nFrames, float fAmplitude);
+
+    // Multiplies nFrames samples of pOut by the gain ramp fStart + n * fStep
+    void(*MulRamp)(float* pOut, size_t nFrames, float fStart, float fStep);
+
+    // Adds fGain * pIn to nFrames samples of pOut
+    void(*MulAdd)(const float* pIn, float* pOut, size_t nFrames, float fGain);
+
+    // Adds the product of two complex spectra, as split real and imaginary
+    // arrays, to pOut
+    void(*MulAddSpectrum)(const float* pARe, const float* pAIm, const float* pBRe, const float* pBIm, float* pOutRe, float* pOutIm, size_t nBins);
+};
+
+namespace simd_scalar
+{
+    struct V
+    {
+        typedef float type;
+        typedef int itype;
+        static const int W = 1;
+
+        static type set1(float f) { return f; }
+        static type load(const float* p) { return *p; }
+        static void store(float* p, type a) { *p = a; }
+        static type add(type a, type b) { return a + b; }
+        static type sub(type a, type b) { return a - b; }
+        static type mul(type a, type b) { return a * b; }
+        static bool lt(type a, type b) { return a < b; }
+        static type select(bool m, type a, type b) { return m ? a : b; }
+        static type floor(type a) { return floorf(a); }
+        static type round(type a) { return nearbyintf(a); }
+        static itype truncate(type a) { return (int)a; }
+        static type tofloat(itype i) { return (float)i; }
+        static itype wrap(itype i, int nMask) { return i & nMask; }
+        static type gather(const float* p, itype i) { return p[i]; }
+    };
+
+    #include "synthSimdKernels.inl"
+}
+
+#if SYNTH_SIMD_X86
+
+namespace simd_sse2
+{
+#if defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+    struct V
+    {
+        typedef __m128 type;
+        typedef __m128i itype;
+        static const int W = 4;
+
+        static type set1(float f) { return _mm_set1_ps(f); }
+        static type load(const float* p) { return _mm_loadu_ps(p); }
+        static void store(float* p, type a) { _mm_storeu_ps(p, a); }
+        static type add(type a, type b) { return _mm_add_ps(a, b); }
+        static type sub(type a, type b) { return _mm_sub_ps(a, b); }
+        static type mul(type a, type b) { return _mm_mul_ps(a, b); }
+        static type lt(type a, type b) { return _mm_cmplt_ps(a, b); }
+        static type select(type m, type a, type b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+        static type round(type a) { return _mm_cvtepi32_ps(_mm_cvtps_epi32(a)); }
+        static type floor(type a)
+        {
+            // Truncate, then step down where truncation went up (negative values)
+            type t = _mm_cvtepi32_ps(_mm_cvttps_epi32(a));
+            return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, a), _mm_set1_ps(1.0f)));
+        }
+        static itype truncate(type a) { return _mm_cvttps_epi32(a); }
+        static type tofloat(itype i) { return _mm_cvtepi32_ps(i); }
+        static itype wrap(itype i, int nMask) { return _mm_and_si128(i, _mm_set1_epi32(nMask)); }
+        static type gather(const float* p, itype i)
+        {
+            alignas(16) int32_t n[4];
+            _mm_store_si128((__m128i*)n, i);
+            return _mm_setr_ps(p[n[0]], p[n[1]], p[n[2]], p[n[3]]);
+        }
+    };
+
+    #include "synthSimdKernels.inl"
+#if defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+}
+
+namespace simd_avx2
+{
+#if defined(__GNUC__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#endif
+    struct V
+    {
+        typedef __m256 type;
+        typedef __m256i itype;
+        static const int W = 8;
+
+        static type set1(float f) { return _mm256_set1_ps(f); }
+        static type load(const float* p) { return _mm256_loadu_ps(p); }
+        static void store(float* p, type a) { _mm256_storeu_ps(p, a); }
+        static type add(type a, type b) { return _mm256_add_ps(a, b); }
+        static type sub(type a, type b) { return _mm256_sub_ps(a, b); }
+        static type mul(type a, type b) { return _mm256_mul_ps(a, b); }
+        static type lt(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+        static type select(type m, type a, type b) { return _mm256_blendv_ps(b, a, m); }
+        static type round(type a) { return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+        static type floor(type a) { return _mm256_floor_ps(a); }
+        static itype truncate(type a) { return _mm256_cvttps_epi32(a); }
+        static type tofloat(itype i) { return _mm256_cvtepi32_ps(i); }
+        static itype wrap(itype i, int nMask) { return _mm256_and_si256(i, _mm256_set1_epi32(nMask)); }
+        static type gather(const float* p, itype i) { return _mm256_i32gather_ps(p, i, 4); }
+    };
+
+    #include "synthSimdKernels.inl"
+#if defined(__GNUC__)
+#pragma GCC pop_options
+#endif
+}
+
+#endif
+
+// Widest instruction set this CPU and OS can run
+inline int DetectSimdLevel()
+{
+#if SYNTH_SIMD_X86
+#if defined(_MSC_VER)
+    int nInfo[4];
+    __cpuid(nInfo, 0);
+    int nMaxLeaf = nInfo[0];
+
+    __cpuid(nInfo, 1);
+    bool bSSE2 = (nInfo[3] & (1 << 26)) != 0;
+    bool bOSXSAVE = (nInfo[2] & (1 << 27)) != 0;
+    bool bAVX = (nInfo[2] & (1 << 28)) != 0;
+
+    bool bAVX2 = false;
+    if (nMaxLeaf >= 7 && bOSXSAVE && bAVX && (_xgetbv(0) & 6) == 6)
+    {
+        __cpuidex(nInfo, 7, 0);
+        bAVX2 = (nInfo[1] & (1 << 5)) != 0;
+    }
+
+    if (bAVX2) return SIMD_AVX2;
+    if (bSSE2) return SIMD_SSE2;
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2")) return SIMD_SSE2;
+#endif
+#endif
+    return SIMD_SCALAR;
+}
+
+// Kernels for one instruction set, lowered to the best the CPU can run
+inline const sSimdKernels& SimdKernelsFor(int nLevel)
+{
+    static const int nDetected = DetectSimdLevel();
+
+    static const sSimdKernels scalar = { "scalar", 1, simd_scalar::RenderOscillator, simd_scalar::RenderWavetable, simd_scalar::MulRamp, simd_scalar::MulAdd, simd_scalar::MulAddSpectrum };
+#if SYNTH_SIMD_X86
+    static const sSimdKernels sse2 = { "sse2", 4, simd_sse2::RenderOscillator, simd_sse2::RenderWavetable, simd_sse2::MulRamp, simd_sse2::MulAdd, simd_sse2::MulAddSpectrum };
+    static const sSimdKernels avx2 = { "avx2", 8, simd_avx2::RenderOscillator, simd_avx2::RenderWavetable, simd_avx2::MulRamp, simd_avx2::MulAdd, simd_avx2::MulAddSpectrum };
+
+    if (nLevel > nDetected) nLevel = nDetected;
+    if (nLevel == SIMD_AVX2) return avx2;
+    if (nLevel == SIMD_SSE2) return sse2;
+#endif
+    return scalar;
+}
+
+// Kernels for this CPU, picked on first use
+inline const sSimdKernels& SimdKernels()
+{
+    static const sSimdKernels& kernels = SimdKernelsFor(SIMD_AVX2);
+    return kernels;
+}
+
+// Applies envelope.GetAmplitude() to a block whose first sample is at
+// dStartTime. The block is split where the envelope changes stage, and each
+// straight piece is applied as one gain ramp.
+inline void ApplyEnvelope(const sEnvelopeADSR& env, float* pOut, size_t nFrames, double dStartTime, double dTimeStep, const sSimdKernels& kernels = SimdKernels())
+{
+    if (!env.bNoteOn)
+    {
+        // Release is one straight line from the sustain level down to zero
+        double dGain = ((dStartTime - env.dTriggerOffTime) / env.dReleaseTime) * (0.0 - env.dSustainAmplitude) + env.dSustainAmplitude;
+        double dStep = (dTimeStep / env.dReleaseTime) * (0.0 - env.dSustainAmplitude);
+        kernels.MulRamp(pOut, nFrames, (float)dGain, (float)dStep);
+        return;
+    }
+
+    // First frame past each stage boundary. The estimate is nudged with the
+    // same arithmetic GetAmplitude() uses so the split lands on the same sample.
+    auto FirstFrameAfter = [&](double dBoundary)
+    {
+        double dEstimate = ceil((dBoundary + env.dTriggerOnTime - dStartTime) / dTimeStep);
+        size_t n = dEstimate <= 0.0 ? 0 : (dEstimate >= (double)nFrames ? nFrames : (size_t)dEstimate);
+        while (n > 0 && (dStartTime + (n - 1) * dTimeStep) - env.dTriggerOnTime > dBoundary)
+            n--;
+        while (n < nFrames && (dStartTime + n * dTimeStep) - env.dTriggerOnTime <= dBoundary)
+            n++;
+        return n;
+    };
+
+    size_t nDecay = FirstFrameAfter(env.dAttackTime);
+    size_t nSustain = max(nDecay, FirstFrameAfter(env.dAttackTime + env.dDecayTime));
+
+    if (nDecay > 0)
+    {
+        double dLifeTime = dStartTime - env.dTriggerOnTime;
+        kernels.MulRamp(pOut, nDecay, (float)(dLifeTime / env.dAttackTime), (float)(dTimeStep / env.dAttackTime));
+    }
+
+    if (nSustain > nDecay)
+    {
+        double dLifeTime = (dStartTime + nDecay * dTimeStep) - env.dTriggerOnTime;
+        double dSlope = (env.dSustainAmplitude - env.dStartAmplitude) / env.dDecayTime;
+        kernels.MulRamp(pOut + nDecay, nSustain - nDecay, (float)((dLifeTime - env.dAttackTime) * dSlope + env.dStartAmplitude), (float)(dTimeStep * dSlope));
+    }
+
+    if (nFrames > nSustain)
+        kernels.MulRamp(pOut + nSustain, nFrames - nSustain, (float)env.dSustainAmplitude, 0.0f);
+}
+
+// Applies the next nFrames samples of a stateful envelope to a block and
+// moves it on. Each straight piece NextSegment() gives is one gain ramp.
+inline void ApplyEnvelope(sEnvelopeGenerator& gen, const sEnvelopeADSR& env, double dSampleRate, float* pOut, size_t nFrames, const sSimdKernels& kernels = SimdKernels())
+{
+    size_t n = 0;
+    while (n < nFrames)
+    {
+        float fStart, fStep;
+        size_t nSegment = gen.NextSegment(env, dSampleRate, nFrames - n, fStart, fStep);
+        kernels.MulRamp(pOut + n, nSegment, fStart, fStep);
+        n += nSegment;
+    }
+}
@@ -0,0 +1,464 @@
+/*
+    Oscillator and envelope kernels written once against a lane type V.
+
+    This file has no include guard on purpose: synthSimd.h includes it once per
+    instruction set, each time inside its own namespace with its own V and
+    compiler target. V provides float lanes (V::type), int lanes (V::itype),
+    W lanes per vector and the handful of operations used below.
+*/
+
+typedef V::type vf;
+typedef V::itype vi;
+
+// Sine of phases given in cycles, same folding as sinTurns() in synth.h
+inline vf SinTurns(vf p)
+{
+    vf x = V::sub(p, V::round(p)); // -0.5 to 0.5
+    vf half = V::set1(0.5f);
+    vf quarter = V::set1(0.25f);
+    x = V::select(V::lt(quarter, x), V::sub(half, x), x);
+    x = V::select(V::lt(x, V::set1(-0.25f)), V::sub(V::set1(-0.5f), x), x);
+
+    vf r = V::mul(x, V::set1((float)(2.0 * PI)));
+    vf r2 = V::mul(r, r);
+    vf s = V::set1(-1.0f / 39916800.0f);
+    s = V::add(V::mul(s, r2), V::set1(1.0f / 362880.0f));
+    s = V::add(V::mul(s, r2), V::set1(-1.0f / 5040.0f));
+    s = V::add(V::mul(s, r2), V::set1(1.0f / 120.0f));
+    s = V::add(V::mul(s, r2), V::set1(-1.0f / 6.0f));
+    s = V::add(V::mul(s, r2), V::set1(1.0f));
+    return V::mul(s, r);
+}
+
+// Phase is between 0.0 and 1.0
+template<int TYPE>
+inline vf Shape(vf p)
+{
+    vf one = V::set1(1.0f);
+    vf two = V::set1(2.0f);
+    vf half = V::set1(0.5f);
+
+    switch (TYPE)
+    {
+    case OSC_SINE:
+        return SinTurns(p);
+    case OSC_SQUARE:
+        return V::select(V::lt(p, half), one, V::set1(-1.0f));
+    case OSC_SAWTOOTH:
+        return V::select(V::lt(p, half), V::mul(two, p), V::sub(V::mul(two, p), two));
+    case OSC_TRIANGLE:
+    {
+        vf p4 = V::mul(V::set1(4.0f), p);
+        vf vFalling = V::select(V::lt(p, V::set1(0.75f)), V::sub(two, p4), V::sub(p4, V::set1(4.0f)));
+        return V::select(V::lt(p, V::set1(0.25f)), p4, vFalling);
+    }
+    case OSC_RAMP:
+        return V::sub(V::mul(two, p), one);
+    default: // OSC_PULSE
+        return V::select(V::lt(p, half), one, V::set1(0.0f));
+    }
+}
+
+// Lanes 0 to W - 1 of a phase accumulator, and the step that moves all of
+// them on by W samples. Worked out in double, then kept in float for at most
+// one block before being worked out again.
+inline void SplitPhase(double dPhase, double dPhaseInc, vf& vPhase, vf& vStep)
+{
+    float fLanes[V::W];
+    for (int k = 0; k < V::W; k++)
+    {
+        double d = dPhase + (double)k * dPhaseInc;
+        fLanes[k] = (float)(d - floor(d));
+    }
+    vPhase = V::load(fLanes);
+
+    double dStep = (double)V::W * dPhaseInc;
+    vStep = V::set1((float)(dStep - floor(dStep)));
+}
+
+inline vf WrapStep(vf p, vf vStep)
+{
+    vf one = V::set1(1.0f);
+    p = V::add(p, vStep);
+    return V::sub(p, V::select(V::lt(p, one), V::set1(0.0f), one));
+}
+
+inline double AdvancePhase(double dPhase, double dPhaseInc, size_t nFrames)
+{
+    double d = dPhase + (double)nFrames * dPhaseInc;
+    return d - floor(d);
+}
+
+// LFO offset (dDepth * sine of the LFO phase) for W lanes at a time. With
+// nPeriod > 1 the sine is only worked out at control rate, every nPeriod
+// samples (rounded up to whole vectors), and interpolated in between:
+// MOD_LINEAR adds a step per vector, MOD_CUBIC follows a Hermite curve whose
+// slope matches the sine at every control point. With nPeriod <= 1 the sine
+// is evaluated on every sample.
+//
+// Kernels call NextPeriod() every PeriodFrames() samples and Next() for every
+// vector in between, so the per-period work stays out of the inner loop.
+struct sModLanes
+{
+    double dDepth, dSlopeScale;
+    double dSin, dCos;         // LFO at the last control point
+    double dRotSin, dRotCos;   // Turn of the LFO over one control period
+    int nVectors;              // Vectors per control period, 0 at audio rate
+    bool bCubic;
+    vf vValue, vStep;          // Audio rate: LFO phase lanes. Linear: offset lanes and their step.
+    vf vT, vTStep, c0, c1, c2, c3;   // Cubic: position in the period and the curve
+
+    void Start(double dLFOPhase, double dLFOPhaseInc, double dLFODepth, int nPeriod, int nInterpolation)
+    {
+        dDepth = dLFODepth;
+        bCubic = nInterpolation == MOD_CUBIC;
+        nVectors = nPeriod > 1 ? (nPeriod + V::W - 1) / V::W : 0;
+
+        if (nVectors == 0)
+        {
+            SplitPhase(dLFOPhase, dLFOPhaseInc, vValue, vStep);
+            return;
+        }
+
+        // The control points are a fixed turn apart, so they are found by
+        // rotating the last one rather than working out a sine each time.
+        // Start() runs once per block, which keeps the rounding from adding up.
+        double dTurn = dLFOPhaseInc * (double)(nVectors * V::W);
+        dSin = sinTurns(dLFOPhase);
+        dCos = sinTurns(dLFOPhase + 0.25);
+        dRotSin = sinTurns(dTurn);
+        dRotCos = sinTurns(dTurn + 0.25);
+        dSlopeScale = 2.0 * PI * dTurn;
+    }
+
+    // Samples between calls to NextPeriod(), nMax at audio rate
+    size_t PeriodFrames(size_t nMax) const
+    {
+        return nVectors > 0 ? (size_t)(nVectors * V::W) : nMax;
+    }
+
+    // Works out the curve to the next control point
+    void NextPeriod()
+    {
+        if (nVectors == 0)
+            return;
+
+        double dNextSin = dSin * dRotCos + dCos * dRotSin;
+        double dNextCos = dCos * dRotCos - dSin * dRotSin;
+        double y0 = dDepth * dSin, y1 = dDepth * dNextSin;
+        float fLanes[V::W];
+
+        if (bCubic)
+        {
+            // Hermite curve with the LFO's own slope at both ends
+            double m0 = dDepth * dSlopeScale * dCos, m1 = dDepth * dSlopeScale * dNextCos;
+            c0 = V::set1((float)y0);
+            c1 = V::set1((float)m0);
+            c2 = V::set1((float)(3.0 * (y1 - y0) - 2.0 * m0 - m1));
+            c3 = V::set1((float)(2.0 * (y0 - y1) + m0 + m1));
+
+            float fInv = 1.0f / (float)(nVectors * V::W);
+            for (int k = 0; k < V::W; k++)
+                fLanes[k] = (float)k * fInv;
+            vT = V::load(fLanes);
+            vTStep = V::set1((float)V::W * fInv);
+        }
+        else
+        {
+            double dStep = (y1 - y0) / (double)(nVectors * V::W);
+            for (int k = 0; k < V::W; k++)
+                fLanes[k] = (float)(y0 + (double)k * dStep);
+            vValue = V::load(fLanes);
+            vStep = V::set1((float)(dStep * V::W));
+        }
+
+        dSin = dNextSin;
+        dCos = dNextCos;
+    }
+
+    vf Next()
+    {
+        if (nVectors == 0)
+        {
+            vf v = V::mul(V::set1((float)dDepth), SinTurns(vValue));
+            vValue = WrapStep(vValue, vStep);
+            return v;
+        }
+
+        if (!bCubic)
+        {
+            vf v = vValue;
+            vValue = V::add(vValue, vStep);
+            return v;
+        }
+
+        vf t = vT;
+        vT = V::add(vT, vTStep);
+        return V::add(V::mul(V::add(V::mul(V::add(V::mul(c3, t), c2), t), c1), t), c0);
+    }
+};
+
+template<int TYPE, bool MODULATED>
+inline void RenderShape(sOscillator& osc, float* pOut, size_t nFrames, float fAmplitude)
+{
+    size_t nVector = nFrames - nFrames % V::W;
+    vf vPhase, vStep;
+    SplitPhase(osc.dPhase, osc.dPhaseInc, vPhase, vStep);
+    sModLanes mod;
+    if (MODULATED)
+        mod.Start(osc.dLFOPhase, osc.dLFOPhaseInc, osc.dLFODepth, osc.nModPeriod, osc.nModInterpolation);
+    vf vAmplitude = V::set1(fAmplitude);
+
+    size_t nPeriod = MODULATED ? mod.PeriodFrames(nVector) : nVector;
+    for (size_t n = 0; n < nVector;)
+    {
+        if (MODULATED)
+            mod.NextPeriod();
+
+        for (size_t nEnd = min(nVector, n + nPeriod); n < nEnd; n += V::W)
+        {
+            vf p = vPhase;
+            if (MODULATED)
+            {
+                p = V::add(p, mod.Next());
+                p = V::sub(p, V::floor(p));
+            }
+
+            V::store(pOut + n, V::add(V::load(pOut + n), V::mul(vAmplitude, Shape<TYPE>(p))));
+            vPhase = WrapStep(vPhase, vStep);
+        }
+    }
+
+    osc.dPhase = AdvancePhase(osc.dPhase, osc.dPhaseInc, nVector);
+    osc.dLFOPhase = AdvancePhase(osc.dLFOPhase, osc.dLFOPhaseInc, nVector);
+
+    for (size_t n = nVector; n < nFrames; n++)
+        pOut[n] += (float)(fAmplitude * osc.Tick<TYPE>());
+}
+
+template<int TYPE>
+inline void RenderShape(sOscillator& osc, float* pOut, size_t nFrames, float fAmplitude)
+{
+    if (osc.dLFODepth != 0.0)
+        RenderShape<TYPE, true>(osc, pOut, nFrames, fAmplitude);
+    else
+        RenderShape<TYPE, false>(osc, pOut, nFrames, fAmplitude);
+}
+
+inline void RenderOscillator(sOscillator& osc, float* pOut, size_t nFrames, float fAmplitude)
+{
+    switch (osc.nType)
+    {
+    case OSC_SINE:     RenderShape<OSC_SINE>(osc, pOut, nFrames, fAmplitude); break;
+    case OSC_SQUARE:   RenderShape<OSC_SQUARE>(osc, pOut, nFrames, fAmplitude); break;
+    case OSC_SAWTOOTH: RenderShape<OSC_SAWTOOTH>(osc, pOut, nFrames, fAmplitude); break;
+    case OSC_TRIANGLE: RenderShape<OSC_TRIANGLE>(osc, pOut, nFrames, fAmplitude); break;
+    case OSC_RAMP:     RenderShape<OSC_RAMP>(osc, pOut, nFrames, fAmplitude); break;
+    case OSC_PULSE:    RenderShape<OSC_PULSE>(osc, pOut, nFrames, fAmplitude); break;
+    default:           osc.Render(pOut, nFrames, fAmplitude); break;
+    }
+}
+
+// W lanes of a wavetable oscillator, set up from osc for one run of samples
+struct sTableLanes
+{
+    vf vPhase, vStep, vAmplitude;
+    sModLanes mod;
+    const float* pLevel;
+
+    // nModPeriod overrides the oscillator's, so lanes rendered together
+    // reach their control points together
+    void Start(const sWavetableOscillator& osc, float fAmplitude, int nModPeriod)
+    {
+        SplitPhase(osc.dPhase, osc.dPhaseInc, vPhase, vStep);
+        mod.Start(osc.dLFOPhase, osc.dLFOPhaseInc, osc.dLFODepth, nModPeriod, osc.nModInterpolation);
+        vAmplitude = V::set1(fAmplitude);
+        pLevel = osc.pLevel;
+    }
+
+    // fAmplitude * the next W samples
+    template<bool MODULATED>
+    vf Next()
+    {
+        vf p = vPhase;
+        if (MODULATED)
+        {
+            p = V::add(p, mod.Next());
+            p = V::sub(p, V::floor(p));
+        }
+
+        vf vPos = V::mul(p, V::set1((float)nWavetableSize));
+        vi i = V::truncate(vPos);
+        vf f = V::sub(vPos, V::tofloat(i));
+        i = V::wrap(i, nWavetableSize - 1);
+        vf a = V::gather(pLevel, i);
+        vf b = V::gather(pLevel + 1, i);
+        vPhase = WrapStep(vPhase, vStep);
+        return V::mul(vAmplitude, V::add(a, V::mul(V::sub(b, a), f)));
+    }
+
+    // Moves osc on by the nFrames samples the lanes have rendered
+    static void Finish(sWavetableOscillator& osc, size_t nFrames)
+    {
+        osc.dPhase = AdvancePhase(osc.dPhase, osc.dPhaseInc, nFrames);
+        osc.dLFOPhase = AdvancePhase(osc.dLFOPhase, osc.dLFOPhaseInc, nFrames);
+    }
+};
+
+template<bool MODULATED>
+inline void RenderTable(sWavetableOscillator& osc, float* pOut, size_t nFrames, float fAmplitude)
+{
+    size_t nVector = nFrames - nFrames % V::W;
+    sTableLanes lanes;
+    lanes.Start(osc, fAmplitude, osc.nModPeriod);
+
+    size_t nPeriod = MODULATED ? lanes.mod.PeriodFrames(nVector) : nVector;
+    for (size_t n = 0; n < nVector;)
+    {
+        if (MODULATED)
+            lanes.mod.NextPeriod();
+
+        for (size_t nEnd = min(nVector, n + nPeriod); n < nEnd; n += V::W)
+            V::store(pOut + n, V::add(V::load(pOut + n), lanes.Next<MODULATED>()));
+    }
+
+    sTableLanes::Finish(osc, nVector);
+
+    if (nVector < nFrames)
+        osc.Render(pOut + nVector, nFrames - nVector, fAmplitude);
+}
+
+inline void RenderWavetable(sWavetableOscillator& osc, float* pOut, size_t nFrames, float fAmplitude)
+{
+    if (osc.pLevel == nullptr)
+        osc.Render(pOut, nFrames, fAmplitude);
+    else if (osc.dLFODepth != 0.0)
+        RenderTable<true>(osc, pOut, nFrames, fAmplitude);
+    else
+        RenderTable<false>(osc, pOut, nFrames, fAmplitude);
+}
+
+// pOut[n] *= fStart + n * fStep, with gains at or below 0.0001 treated as
+// silence the same way sEnvelopeADSR::GetAmplitude() does
+inline void MulRamp(float* pOut, size_t nFrames, float fStart, float fStep)
+{
+    size_t nVector = nFrames - nFrames % V::W;
+    float fLanes[V::W];
+    for (int k = 0; k < V::W; k++)
+        fLanes[k] = (float)k;
+
+    vf vIndex = V::load(fLanes);
+    vf vStart = V::set1(fStart);
+    vf vStep = V::set1(fStep);
+    vf vWidth = V::set1((float)V::W);
+    vf vFloor = V::set1(0.0001f);
+    vf vZero = V::set1(0.0f);
+
+    for (size_t n = 0; n < nVector; n += V::W)
+    {
+        vf g = V::add(vStart, V::mul(vIndex, vStep));
+        g = V::select(V::lt(vFloor, g), g, vZero);
+        V::store(pOut + n, V::mul(V::load(pOut + n), g));
+        vIndex = V::add(vIndex, vWidth);
+    }
+
+    for (size_t n = nVector; n < nFrames; n++)
+    {
+        float g = fStart + (float)n * fStep;
+        pOut[n] *= g > 0.0001f ? g : 0.0f;
+    }
+}
+
+// pOut[n] += fGain * pIn[n]
+inline void MulAdd(const float* pIn, float* pOut, size_t nFrames, float fGain)
+{
+    size_t nVector = nFrames - nFrames % V::W;
+    vf vGain = V::set1(fGain);
+
+    for (size_t n = 0; n < nVector; n += V::W)
+        V::store(pOut + n, V::add(V::load(pOut + n), V::mul(vGain, V::load(pIn + n))));
+
+    for (size_t n = nVector; n < nFrames; n++)
+        pOut[n] += fGain * pIn[n];
+}
+
+// Complex multiply-accumulate over spectra kept as separate real and
+// imaginary arrays: pOut[k] += pA[k] * pB[k]
+inline void MulAddSpectrum(const float* pARe, const float* pAIm, const float* pBRe, const float* pBIm, float* pOutRe, float* pOutIm, size_t nBins)
+{
+    size_t nVector = nBins - nBins % V::W;
+
+    for (size_t k = 0; k < nVector; k += V::W)
+    {
+        vf ar = V::load(pARe + k), ai = V::load(pAIm + k);
+        vf br = V::load(pBRe + k), bi = V::load(pBIm + k);
+        V::store(pOutRe + k, V::add(V::load(pOutRe + k), V::sub(V::mul(ar, br), V::mul(ai, bi))));
+        V::store(pOutIm + k, V::add(V::load(pOutIm + k), V::add(V::mul(ar, bi), V::mul(ai, br))));
+    }
+
+    for (size_t k = nVector; k < nBins; k++)
+    {
+        pOutRe[k] += pARe[k] * pBRe[k] - pAIm[k] * pBIm[k];
+        pOutIm[k] += pARe[k] * pBIm[k] + pAIm[k] * pBRe[k];
+    }
+}
+
+// Renders a patch known at compile time (see synthPatch.h) in one pass: every
+// W samples all partials are read, summed in partial order and multiplied by
+// the gain ramp fStart + n * fStep. pOsc holds one oscillator per partial,
+// already Set() up. Writes pOut rather than adding to it. The sum and gain
+// round exactly like RenderWavetable() followed by MulRamp().
+template<class PATCH, size_t... I>
+inline void RenderPatch(sWavetableOscillator* pOsc, float* pOut, size_t nFrames, float fStart, float fStep, index_sequence<I...>)
+{
+    size_t nVector = nFrames - nFrames % V::W;
+    sTableLanes lanes[sizeof...(I)];
+    int nStart[] = { (lanes[I].Start(pOsc[I], PATCH::template Partial<I>::Amplitude(), pOsc[0].nModPeriod), 0)... };
+    (void)nStart;
+
+    float fLanes[V::W];
+    for (int k = 0; k < V::W; k++)
+        fLanes[k] = (float)k;
+
+    vf vIndex = V::load(fLanes);
+    vf vStart = V::set1(fStart);
+    vf vStep = V::set1(fStep);
+    vf vWidth = V::set1((float)V::W);
+    vf vFloor = V::set1(0.0001f);
+    vf vZero = V::set1(0.0f);
+
+    size_t nPeriod = PATCH::bModulated ? lanes[0].mod.PeriodFrames(nVector) : nVector;
+    for (size_t n = 0; n < nVector;)
+    {
+        if (PATCH::bModulated)
+        {
+            int nPeriods[] = { (PATCH::template Partial<I>::bModulated ? lanes[I].mod.NextPeriod() : (void)0, 0)... };
+            (void)nPeriods;
+        }
+
+        for (size_t nEnd = min(nVector, n + nPeriod); n < nEnd; n += V::W)
+        {
+            vf vSum = vZero;
+            int nSum[] = { (vSum = V::add(vSum, lanes[I].template Next<PATCH::template Partial<I>::bModulated>()), 0)... };
+            (void)nSum;
+
+            vf g = V::add(vStart, V::mul(vIndex, vStep));
+            g = V::select(V::lt(vFloor, g), g, vZero);
+            V::store(pOut + n, V::mul(vSum, g));
+            vIndex = V::add(vIndex, vWidth);
+        }
+    }
+
+    int nFinish[] = { (sTableLanes::Finish(pOsc[I], nVector), 0)... };
+    (void)nFinish;
+
+    for (size_t n = nVector; n < nFrames; n++)
+    {
+        float fSum = 0.0f;
+        int nTail[] = { (pOsc[I].Render(&fSum, 1, PATCH::template Partial<I>::Amplitude()), 0)... };
+        (void)nTail;
+
+        float g = fStart + (float)n * fStep;
+        pOut[n] = fSum * (g > 0.0001f ? g : 0.0f);
+    }
+}
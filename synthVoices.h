@@ -0,0 +1,412 @@
+/*
+    Polyphonic voice allocation.
+
+    sVoiceManager owns a fixed number of voices, stored as structure-of-arrays
+    so the per-block scans (which voices are playing, which one is quietest)
+    walk short contiguous arrays. All memory is allocated in the constructor,
+    from the engine arena if one is being set up (see synthRealtime.h);
+    NoteOn(), NoteOff() and Render() never touch the heap.
+
+    When every voice is busy a new note steals one according to nStealPolicy.
+    Voices whose release has finished are returned to the pool automatically
+    and cost nothing to render.
+
+    Each voice is rendered in mono and mixed into planar output channels
+    with a constant-power pan it takes from dPan when its note starts.
+
+    OSC_SAMPLE partials are played by pSampler (see synthSampler.h), from
+    the voice's own stream, under the same envelope as every other partial.
+
+    A voice can be held by sVoiceRenderPool while a worker that missed the
+    block's deadline is still rendering it. Until the pool hands it back it
+    is left alone: it is not stolen, rendered or read, and a note off for it
+    waits.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "synth.h"
+#include "synthWavetable.h"
+#include "synthSimd.h"
+#include "synthSampler.h"
+#include "synthRealtime.h"
+
+// Voice stealing policies
+#define STEAL_OLDEST 0      // Steal the voice that started longest ago
+#define STEAL_QUIETEST 1    // Steal the voice with the lowest envelope level
+#define STEAL_SAME_NOTE 2   // Reuse a voice already playing this note, else the oldest
+
+// Voice hold states, see sVoiceManager::vHeld
+#define HOLD_NONE 0
+#define HOLD_RENDERING 1    // A late render worker still has the voice
+#define HOLD_RELEASED 2     // Same, and a note off is waiting for it
+
+// Constant-power pan over nChannels speakers in a row, fPan -1.0 at the first
+// and 1.0 at the last. The voice goes to channel nFirst and the one after it
+// with gains cos and sin of the way between them, so it is as loud wherever
+// it sits. Mono has a gain of 1.
+inline void PanGains(float fPan, unsigned int nChannels, unsigned int& nFirst, float& fFirst, float& fSecond)
+{
+    if (nChannels < 2)
+    {
+        nFirst = 0;
+        fFirst = 1.0f;
+        fSecond = 0.0f;
+        return;
+    }
+
+    float fPosition = (min(max(fPan, -1.0f), 1.0f) + 1.0f) * 0.5f * (float)(nChannels - 1);
+    nFirst = min((unsigned int)fPosition, nChannels - 2);
+    double dAngle = (double)(fPosition - (float)nFirst) * PI * 0.5;
+    fFirst = (float)cos(dAngle);
+    fSecond = (float)sin(dAngle);
+}
+
+// Adds a mono voice to nFrames samples of planar channels ppOut, from nOffset on
+inline void MixVoice(const float* pVoice, float fPan, float* const* ppOut, unsigned int nChannels, size_t nOffset, size_t nFrames, const sSimdKernels& kernels)
+{
+    unsigned int nFirst;
+    float fFirst, fSecond;
+    PanGains(fPan, nChannels, nFirst, fFirst, fSecond);
+
+    kernels.MulAdd(pVoice, ppOut[nFirst] + nOffset, nFrames, fFirst);
+    if (nChannels > 1)
+        kernels.MulAdd(pVoice, ppOut[nFirst + 1] + nOffset, nFrames, fSecond);
+}
+
+struct sVoiceManager
+{
+    int nStealPolicy;
+    sEnvelopeADSR envelope;    // Envelope settings shared by every voice
+    const sPreset* pPreset;    // Sound every voice plays
+    double dSampleRate;
+    uint64_t nSeed;            // Noise seed. Each note's noise is derived from it, the note and its start time.
+    int nModPeriod;            // Samples between LFO control points, 1 for audio rate
+    int nModInterpolation;     // MOD_*
+    double dPan;               // Pan of notes started from now on, -1.0 left to 1.0 right
+    sSampler* pSampler;        // Plays OSC_SAMPLE partials, one stream per voice, or nullptr
+
+    // Structure of arrays, one entry per voice
+    sArenaVector<int> vNote;
+    sArenaVector<int> vStage;
+    sArenaVector<float> vLevel;       // Envelope level at the end of the last block
+    sArenaVector<float> vEnvRate;     // Envelope increment or ratio per sample, see sEnvelopeGenerator
+    sArenaVector<uint32_t> vEnvLeft;  // Samples left in the envelope stage
+    sArenaVector<uint64_t> vAge;      // Order in which voices were started
+    sArenaVector<double> vFrequency;
+    sArenaVector<double> vPhase;      // nMaxPartials entries per voice
+    sArenaVector<double> vLFOPhase;   // nMaxPartials entries per voice
+    sArenaVector<float> vCost;        // Seconds the voice took to render last block, 0 once idle
+    sArenaVector<float> vPan;
+    sArenaVector<sNoise> vNoise;      // nMaxPartials entries per voice, used by noise partials
+    sArenaVector<uint8_t> vHeld;      // HOLD_*, set by sVoiceRenderPool on the audio thread
+
+    sVoiceManager(size_t nCapacity = 128, size_t nMaxBlockFrames = 512)
+    {
+        nStealPolicy = STEAL_OLDEST;
+        pPreset = nullptr;
+        dSampleRate = 44100.0;
+        nSeed = 1;
+        nModPeriod = nDefaultModPeriod;
+        nModInterpolation = MOD_LINEAR;
+        dPan = 0.0;
+        pSampler = nullptr;
+        m_nAgeCounter = 0;
+
+        vNote.assign(nCapacity, -1);
+        vStage.assign(nCapacity, ENV_IDLE);
+        vLevel.assign(nCapacity, 0.0f);
+        vEnvRate.assign(nCapacity, 0.0f);
+        vEnvLeft.assign(nCapacity, 0);
+        vAge.assign(nCapacity, 0);
+        vFrequency.assign(nCapacity, 0.0);
+        vPhase.assign(nCapacity * nMaxPartials, 0.0);
+        vLFOPhase.assign(nCapacity * nMaxPartials, 0.0);
+        vCost.assign(nCapacity, 0.0f);
+        vPan.assign(nCapacity, 0.0f);
+        vNoise.assign(nCapacity * nMaxPartials, sNoise());
+        vHeld.assign(nCapacity, HOLD_NONE);
+
+        m_vScratch.assign(nMaxBlockFrames > 0 ? nMaxBlockFrames : 1, 0.0f);
+    }
+
+    size_t Capacity() const
+    {
+        return vStage.size();
+    }
+
+    size_t ActiveVoices() const
+    {
+        size_t nActive = 0;
+        for (size_t v = 0; v < vStage.size(); v++)
+            if (vHeld[v] != HOLD_NONE || vStage[v] != ENV_IDLE)
+                nActive++;
+        return nActive;
+    }
+
+    // Seconds the most expensive voice took to render in the last block
+    double CostliestVoice() const
+    {
+        float fCost = 0.0f;
+        for (size_t v = 0; v < vCost.size(); v++)
+            if (vHeld[v] == HOLD_NONE)
+                fCost = max(fCost, vCost[v]);
+        return fCost;
+    }
+
+    // Starts a note and returns the voice it was given, or -1 if every
+    // voice is held
+    int NoteOn(int nNote, double dHertz, double dTime)
+    {
+        int v = FindVoice(nNote);
+        if (v < 0)
+            return -1;
+
+        // A voice replaying the same note rises from where it is, any other
+        // starts from silence
+        sEnvelopeGenerator env = VoiceEnvelope(v);
+        if (vNote[v] != nNote)
+            env.fLevel = 0.0f;
+        env.NoteOn(envelope, dSampleRate);
+        StoreEnvelope(v, env);
+
+        vNote[v] = nNote;
+        vAge[v] = ++m_nAgeCounter;
+        vFrequency[v] = dHertz;
+        vPan[v] = (float)dPan;
+        uint64_t nTimeBits;
+        memcpy(&nTimeBits, &dTime, sizeof(nTimeBits));
+        uint64_t nNoteSeed = HashSeed(HashSeed(nSeed, (uint64_t)nNote), nTimeBits);
+
+        for (int p = 0; p < nMaxPartials; p++)
+        {
+            vPhase[v * nMaxPartials + p] = 0.0;
+            vLFOPhase[v * nMaxPartials + p] = 0.0;
+            vNoise[v * nMaxPartials + p].Seed(HashSeed(nNoteSeed, (uint64_t)p));
+        }
+
+        if (pSampler != nullptr)
+            pSampler->NoteOn((size_t)v, dHertz);
+        return v;
+    }
+
+    // Releases every held voice playing nNote
+    void NoteOff(int nNote, double dTime)
+    {
+        for (size_t v = 0; v < vStage.size(); v++)
+        {
+            if (vHeld[v] != HOLD_NONE)
+            {
+                if (vNote[v] == nNote)
+                    vHeld[v] = HOLD_RELEASED;
+            }
+            else if (vNote[v] == nNote && vStage[v] != ENV_IDLE && vStage[v] != ENV_RELEASE)
+                Release(v, dTime);
+        }
+    }
+
+    void AllNotesOff(double dTime)
+    {
+        for (size_t v = 0; v < vStage.size(); v++)
+        {
+            if (vHeld[v] != HOLD_NONE)
+                vHeld[v] = HOLD_RELEASED;
+            else if (vStage[v] != ENV_IDLE && vStage[v] != ENV_RELEASE)
+                Release(v, dTime);
+        }
+    }
+
+    // Hands voice v back once the render pool's late worker is done with
+    // it, and plays a note off that came in meanwhile
+    void Unhold(size_t v)
+    {
+        bool bReleased = vHeld[v] == HOLD_RELEASED;
+        vHeld[v] = HOLD_NONE;
+        if (bReleased && vStage[v] != ENV_IDLE && vStage[v] != ENV_RELEASE)
+            Release(v, 0.0);
+    }
+
+    // Adds every playing voice to nFrames samples of pOut. Each voice keeps
+    // its own envelope and phase, so no clock is needed.
+    void Render(float* pOut, size_t nFrames, const sSimdKernels& kernels = SimdKernels())
+    {
+        Render(&pOut, 1, nFrames, kernels);
+    }
+
+    // Same, panning each voice over nChannels planar channels
+    void Render(float* const* ppOut, unsigned int nChannels, size_t nFrames, const sSimdKernels& kernels = SimdKernels())
+    {
+        if (pPreset == nullptr)
+            return;
+
+        const size_t nMaxFrames = m_vScratch.size();
+        float* pVoice = m_vScratch.data();
+
+        // Blocks longer than the scratch buffer are rendered in pieces
+        for (size_t nOffset = 0; nOffset < nFrames; nOffset += nMaxFrames)
+        {
+            size_t nChunk = min(nMaxFrames, nFrames - nOffset);
+
+            for (size_t v = 0; v < vStage.size(); v++)
+            {
+                if (vHeld[v] != HOLD_NONE || vStage[v] == ENV_IDLE)
+                    continue;
+
+                RenderVoice(v, pVoice, nChunk, kernels);
+                MixVoice(pVoice, vPan[v], ppOut, nChannels, nOffset, nChunk, kernels);
+            }
+        }
+    }
+
+    // Renders voice v on its own into pVoice, replacing its contents, and
+    // moves the voice on by nFrames. Only touches voice v's entries, so
+    // different voices may be rendered on different threads at once.
+    void RenderVoice(size_t v, float* pVoice, size_t nFrames, const sSimdKernels& kernels = SimdKernels())
+    {
+        RenderVoice(v, pVoice, nFrames, *pPreset, envelope, kernels);
+    }
+
+    // Same, playing preset under the envelope settings adsr instead of
+    // pPreset and envelope. For a thread rendering while the audio thread
+    // may change those: it passes a copy taken when the voice was handed
+    // over.
+    void RenderVoice(size_t v, float* pVoice, size_t nFrames, const sPreset& preset, const sEnvelopeADSR& adsr, const sSimdKernels& kernels = SimdKernels())
+    {
+        auto tStart = chrono::steady_clock::now();
+
+        sWavetableOscillator osc[nMaxPartials];
+        for (int p = 0; p < preset.nPartials; p++)
+        {
+            const sPartial& partial = preset.partials[p];
+            osc[p].Set(vFrequency[v] * partial.dRatio, dSampleRate, partial.nType, partial.dLFOHertz, partial.dLFOAmplitude);
+            osc[p].dPhase = vPhase[v * nMaxPartials + p];
+            osc[p].dLFOPhase = vLFOPhase[v * nMaxPartials + p];
+            osc[p].nModPeriod = nModPeriod;
+            osc[p].nModInterpolation = nModInterpolation;
+            if (partial.nType >= OSC_NOISE)
+                osc[p].noise = vNoise[v * nMaxPartials + p];
+        }
+
+        sEnvelopeGenerator env = VoiceEnvelope(v);
+        if (preset.RenderPatch != nullptr)
+        {
+            // Compiled preset: partials and envelope in one pass per
+            // straight piece of the envelope
+            size_t n = 0;
+            while (n < nFrames)
+            {
+                float fStart, fStep;
+                size_t nSegment = env.NextSegment(adsr, dSampleRate, nFrames - n, fStart, fStep);
+                preset.RenderPatch(osc, pVoice + n, nSegment, fStart, fStep, kernels);
+                n += nSegment;
+            }
+        }
+        else
+        {
+            for (size_t n = 0; n < nFrames; n++)
+                pVoice[n] = 0.0f;
+
+            bool bSampled = false;
+            for (int p = 0; p < preset.nPartials; p++)
+            {
+                const sPartial& partial = preset.partials[p];
+                if (partial.nType != OSC_SAMPLE)
+                    kernels.RenderWavetable(osc[p], pVoice, nFrames, (float)partial.dAmplitude);
+                else if (pSampler != nullptr && !bSampled)
+                {
+                    pSampler->Render(v, pVoice, nFrames, vFrequency[v] * partial.dRatio, dSampleRate, (float)partial.dAmplitude);
+                    bSampled = true;
+                }
+            }
+
+            ApplyEnvelope(env, adsr, dSampleRate, pVoice, nFrames, kernels);
+        }
+        StoreEnvelope(v, env);
+
+        for (int p = 0; p < preset.nPartials; p++)
+        {
+            vPhase[v * nMaxPartials + p] = osc[p].dPhase;
+            vLFOPhase[v * nMaxPartials + p] = osc[p].dLFOPhase;
+            if (preset.partials[p].nType >= OSC_NOISE)
+                vNoise[v * nMaxPartials + p] = osc[p].noise;
+        }
+
+        vCost[v] = vStage[v] == ENV_IDLE ? 0.0f : chrono::duration<float>(chrono::steady_clock::now() - tStart).count();
+    }
+
+private:
+    uint64_t m_nAgeCounter;
+    sArenaVector<float> m_vScratch;
+
+    // Release starts at the next block rendered, from the level the voice
+    // has reached
+    void Release(size_t v, double)
+    {
+        sEnvelopeGenerator env = VoiceEnvelope(v);
+        env.NoteOff(envelope, dSampleRate);
+        StoreEnvelope(v, env);
+    }
+
+    int FindVoice(int nNote)
+    {
+        if (nStealPolicy == STEAL_SAME_NOTE)
+            for (size_t v = 0; v < vStage.size(); v++)
+                if (vHeld[v] == HOLD_NONE && vStage[v] != ENV_IDLE && vNote[v] == nNote)
+                    return (int)v;
+
+        for (size_t v = 0; v < vStage.size(); v++)
+            if (vHeld[v] == HOLD_NONE && vStage[v] == ENV_IDLE)
+                return (int)v;
+
+        // Every voice is busy, steal one. Voices in their release go first;
+        // voices held by the render pool cannot be taken at all.
+        int nBest = -1;
+        for (size_t v = 0; v < vStage.size(); v++)
+        {
+            if (vHeld[v] != HOLD_NONE)
+                continue;
+            if (nBest < 0)
+            {
+                nBest = (int)v;
+                continue;
+            }
+
+            bool bReleased = vStage[v] == ENV_RELEASE;
+            bool bBestReleased = vStage[nBest] == ENV_RELEASE;
+            if (bReleased != bBestReleased)
+            {
+                if (bReleased) nBest = (int)v;
+                continue;
+            }
+
+            if (nStealPolicy == STEAL_QUIETEST ? vLevel[v] < vLevel[nBest] : vAge[v] < vAge[nBest])
+                nBest = (int)v;
+        }
+        return nBest;
+    }
+
+    // Envelope state of voice v, gathered from the arrays
+    sEnvelopeGenerator VoiceEnvelope(size_t v) const
+    {
+        sEnvelopeGenerator env;
+        env.nStage = vStage[v];
+        env.fLevel = vLevel[v];
+        env.fRate = vEnvRate[v];
+        env.nLeft = vEnvLeft[v];
+        return env;
+    }
+
+    void StoreEnvelope(size_t v, const sEnvelopeGenerator& env)
+    {
+        vStage[v] = env.nStage;
+        vLevel[v] = env.fLevel;
+        vEnvRate[v] = env.fRate;
+        vEnvLeft[v] = env.nLeft;
+    }
+};
@@ -0,0 +1,366 @@
+/*
+    Band-limited wavetable oscillators.
+
+    Every waveform is stored as one cycle of nWavetableSize samples, once per
+    octave (a "mipmap"). Level 0 holds every harmonic that fits in the table,
+    each level above it holds half as many. When a note is played the oscillator
+    picks the level whose highest harmonic still sits below Nyquist, so high
+    notes do not alias, and then reads it with linear interpolation.
+
+    The tables are built once at startup by WavetableBank(); call it from the
+    main thread before the audio starts.
+*/
+
+#pragma once
+
+#include <cmath>
+#include <cstdlib>
+#include <cstddef>
+#include <vector>
+#include <string>
+#include <fstream>
+
+#include "synth.h"
+
+const int nWavetableSize = 2048;     // Samples per cycle, must be a power of 2
+const int nWavetableLevels = 11;     // Level k holds up to (nWavetableSize / 2) >> k harmonics
+
+struct sWavetable
+{
+    // nWavetableLevels tables of nWavetableSize + 1 samples. The extra sample
+    // repeats the first one so interpolation never has to wrap.
+    vector<float> vSamples;
+
+    sWavetable()
+    {
+        vSamples.assign(nWavetableLevels * (nWavetableSize + 1), 0.0f);
+    }
+
+    const float* Level(int nLevel) const
+    {
+        return &vSamples[nLevel * (nWavetableSize + 1)];
+    }
+
+    // Picks the mip level for an oscillator advancing dPhaseInc cycles per
+    // sample: the first level whose top harmonic is at or below Nyquist.
+    static int LevelForIncrement(double dPhaseInc)
+    {
+        double dTopHarmonics = 2.0 * (nWavetableSize / 2) * fabs(dPhaseInc);
+        if (dTopHarmonics <= 1.0)
+            return 0;
+
+        int nLevel = (int)ceil(log2(dTopHarmonics));
+        return nLevel < nWavetableLevels ? nLevel : nWavetableLevels - 1;
+    }
+
+    // Builds every level from Fourier coefficients:
+    // x(p) = dDC + sum over h of vSin[h] * sin(2 PI h p) + vCos[h] * cos(2 PI h p)
+    // Index 0 of vSin and vCos is unused.
+    void BuildFromHarmonics(const vector<double>& vSin, const vector<double>& vCos, double dDC)
+    {
+        const int N = nWavetableSize;
+
+        // Exact sine of every table position, so harmonic h at position n is
+        // vSine[(h * n) % N] and building needs no further sin() calls
+        vector<double> vSine(N);
+        for (int n = 0; n < N; n++)
+            vSine[n] = sin(2.0 * PI * (double)n / (double)N);
+
+        vector<double> vLevel(N);
+        for (int nLevel = 0; nLevel < nWavetableLevels; nLevel++)
+        {
+            int nHarmonics = (N / 2) >> nLevel;
+            fill(vLevel.begin(), vLevel.end(), dDC);
+
+            for (int h = 1; h <= nHarmonics && h < (int)vSin.size(); h++)
+            {
+                double a = vSin[h];
+                double b = h < (int)vCos.size() ? vCos[h] : 0.0;
+                if (a == 0.0 && b == 0.0)
+                    continue;
+
+                for (int n = 0; n < N; n++)
+                {
+                    int i = (h * n) & (N - 1);
+                    vLevel[n] += a * vSine[i] + b * vSine[(i + N / 4) & (N - 1)];
+                }
+            }
+
+            float* pLevel = &vSamples[nLevel * (N + 1)];
+            for (int n = 0; n < N; n++)
+                pLevel[n] = (float)vLevel[n];
+            pLevel[N] = pLevel[0];
+        }
+    }
+
+    // Builds the table from one arbitrary cycle of a waveform. The cycle is
+    // resampled to nWavetableSize points, analysed into harmonics and rebuilt
+    // band-limited at every level.
+    void BuildFromWaveform(const float* pCycle, size_t nCycle)
+    {
+        const int N = nWavetableSize;
+        if (pCycle == nullptr || nCycle == 0)
+            return;
+
+        vector<double> vResampled(N);
+        for (int n = 0; n < N; n++)
+        {
+            double dPos = (double)n * (double)nCycle / (double)N;
+            size_t i = (size_t)dPos;
+            double f = dPos - (double)i;
+            double a = pCycle[i % nCycle];
+            double b = pCycle[(i + 1) % nCycle];
+            vResampled[n] = a + (b - a) * f;
+        }
+
+        vector<double> vSine(N);
+        for (int n = 0; n < N; n++)
+            vSine[n] = sin(2.0 * PI * (double)n / (double)N);
+
+        double dDC = 0.0;
+        for (int n = 0; n < N; n++)
+            dDC += vResampled[n];
+        dDC /= (double)N;
+
+        vector<double> vSin(N / 2 + 1, 0.0), vCos(N / 2 + 1, 0.0);
+        for (int h = 1; h <= N / 2; h++)
+        {
+            double a = 0.0, b = 0.0;
+            for (int n = 0; n < N; n++)
+            {
+                int i = (h * n) & (N - 1);
+                a += vResampled[n] * vSine[i];
+                b += vResampled[n] * vSine[(i + N / 4) & (N - 1)];
+            }
+
+            // The Nyquist bin only has a cosine part and is not doubled
+            double dScale = h == N / 2 ? 1.0 : 2.0;
+            vSin[h] = dScale * a / (double)N;
+            vCos[h] = dScale * b / (double)N;
+        }
+
+        BuildFromHarmonics(vSin, vCos, dDC);
+    }
+
+    // Loads a single-cycle waveform stored as raw 32-bit float samples
+    bool LoadFromFile(const string& sFile)
+    {
+        ifstream file(sFile, ios::binary | ios::ate);
+        if (!file.is_open())
+            return false;
+
+        size_t nBytes = (size_t)file.tellg();
+        vector<float> vCycle(nBytes / sizeof(float));
+        if (vCycle.empty())
+            return false;
+
+        file.seekg(0);
+        file.read((char*)vCycle.data(), vCycle.size() * sizeof(float));
+        if (!file)
+            return false;
+
+        BuildFromWaveform(vCycle.data(), vCycle.size());
+        return true;
+    }
+};
+
+// The band-limited versions of the OSC_* shapes, built once
+struct sWavetableBank
+{
+    sWavetable tables[OSC_NOISE];
+
+    sWavetableBank()
+    {
+        const int nHarmonics = nWavetableSize / 2;
+        vector<double> vSin(nHarmonics + 1), vNone;
+
+        // Sine - the fundamental only
+        fill(vSin.begin(), vSin.end(), 0.0);
+        vSin[1] = 1.0;
+        tables[OSC_SINE].BuildFromHarmonics(vSin, vNone, 0.0);
+
+        // Square - odd harmonics falling at 1/h
+        fill(vSin.begin(), vSin.end(), 0.0);
+        for (int h = 1; h <= nHarmonics; h += 2)
+            vSin[h] = 4.0 / (PI * h);
+        tables[OSC_SQUARE].BuildFromHarmonics(vSin, vNone, 0.0);
+
+        // Pulse - the square moved to between 0.0 and 1.0
+        for (int h = 1; h <= nHarmonics; h++)
+            vSin[h] *= 0.5;
+        tables[OSC_PULSE].BuildFromHarmonics(vSin, vNone, 0.5);
+
+        // Sawtooth - every harmonic at 1/h, alternating sign
+        for (int h = 1; h <= nHarmonics; h++)
+            vSin[h] = (h % 2 ? 2.0 : -2.0) / (PI * h);
+        tables[OSC_SAWTOOTH].BuildFromHarmonics(vSin, vNone, 0.0);
+
+        // Ramp - every harmonic at 1/h, rising from -1.0 to 1.0
+        for (int h = 1; h <= nHarmonics; h++)
+            vSin[h] = -2.0 / (PI * h);
+        tables[OSC_RAMP].BuildFromHarmonics(vSin, vNone, 0.0);
+
+        // Triangle - odd harmonics falling at 1/h^2, alternating sign
+        fill(vSin.begin(), vSin.end(), 0.0);
+        for (int h = 1; h <= nHarmonics; h += 2)
+            vSin[h] = ((h / 2) % 2 ? -8.0 : 8.0) / (PI * PI * h * h);
+        tables[OSC_TRIANGLE].BuildFromHarmonics(vSin, vNone, 0.0);
+    }
+
+    const sWavetable* Get(int nType) const
+    {
+        return nType >= 0 && nType < OSC_NOISE ? &tables[nType] : nullptr;
+    }
+};
+
+inline const sWavetableBank& WavetableBank()
+{
+    static sWavetableBank bank;
+    return bank;
+}
+
+/**
+ * Oscillator that reads a band-limited wavetable. It is a drop in for
+ * sOscillator: same Set()/Sample()/Render() interface, same phase and LFO
+ * behaviour, but every waveform costs one table read instead of evaluating
+ * the shape. Noise has no table and comes from the oscillator's own
+ * generator; Seed() makes it repeatable.
+ *
+ * SetTable() plays any sWavetable, such as one built from a custom cycle.
+ * The block kernels work the LFO out at control rate, as for sOscillator.
+ */
+struct sWavetableOscillator
+{
+    int nType;
+    const sWavetable* pTable;
+    const float* pLevel;  // Mip level chosen for the current frequency
+    double dPhase;        // Position within the current cycle, 0.0 to 1.0
+    double dPhaseInc;     // Cycles advanced per sample
+    double dLFOPhase;
+    double dLFOPhaseInc;
+    double dLFODepth;     // Modulation depth in cycles (or amplitude for noise)
+    int nModPeriod;       // Samples between LFO control points in the block kernels
+    int nModInterpolation;
+    sNoise noise;         // Generator for the noise types
+
+    sWavetableOscillator()
+    {
+        nType = OSC_SINE;
+        pTable = nullptr;
+        pLevel = nullptr;
+        dPhase = 0.0;
+        dPhaseInc = 0.0;
+        dLFOPhase = 0.0;
+        dLFOPhaseInc = 0.0;
+        dLFODepth = 0.0;
+        nModPeriod = nDefaultModPeriod;
+        nModInterpolation = MOD_LINEAR;
+    }
+
+    void Set(double dHertz, double dSampleRate, int nNewType = OSC_SINE, double dLFOHertz = 0.0, double dLFOAmplitude = 0.0)
+    {
+        nType = nNewType;
+        SetTable(WavetableBank().Get(nType), dHertz, dSampleRate, dLFOHertz, dLFOAmplitude);
+    }
+
+    void SetTable(const sWavetable* pNewTable, double dHertz, double dSampleRate, double dLFOHertz = 0.0, double dLFOAmplitude = 0.0)
+    {
+        pTable = pNewTable;
+        dPhaseInc = dHertz / dSampleRate;
+        dLFOPhaseInc = dLFOHertz / dSampleRate;
+
+        if (nType == OSC_SAWTOOTH || nType == OSC_RAMP || pTable == nullptr)
+            dLFODepth = dLFOAmplitude;
+        else
+            dLFODepth = dLFOAmplitude * dHertz / (2.0 * PI);
+
+        pLevel = pTable != nullptr ? pTable->Level(sWavetable::LevelForIncrement(dPhaseInc)) : nullptr;
+    }
+
+    void Reset()
+    {
+        dPhase = 0.0;
+        dLFOPhase = 0.0;
+    }
+
+    void Seed(uint64_t nSeed)
+    {
+        noise.Seed(nSeed);
+    }
+
+    // Returns the next sample and advances the oscillator by one sample
+    double Sample()
+    {
+        double dLFO = dLFODepth != 0.0 ? dLFODepth * sinTurns(dLFOPhase) : 0.0;
+        double dOut;
+
+        if (pLevel != nullptr)
+            dOut = Read(dPhase + dLFO);
+        else
+            dOut = noise.Sample(nType - OSC_NOISE) * (1.0 + dLFO * 0.5);
+
+        Advance();
+        return dOut;
+    }
+
+    // Adds dAmplitude * waveform to nFrames samples of pOut
+    void Render(float* pOut, size_t nFrames, double dAmplitude)
+    {
+        if (pLevel == nullptr && dLFODepth == 0.0)
+        {
+            noise.Render(nType - OSC_NOISE, pOut, nFrames, (float)dAmplitude);
+            Skip(nFrames);
+            return;
+        }
+
+        if (pLevel == nullptr || dLFODepth != 0.0)
+        {
+            for (size_t n = 0; n < nFrames; n++)
+                pOut[n] += (float)(dAmplitude * Sample());
+            return;
+        }
+
+        // Unmodulated table read - the common case. dPhase is already wrapped.
+        for (size_t n = 0; n < nFrames; n++)
+        {
+            pOut[n] += (float)(dAmplitude * ReadWrapped(dPhase));
+            dPhase += dPhaseInc;
+            if (dPhase >= 1.0) dPhase -= 1.0;
+        }
+        dLFOPhase += dLFOPhaseInc * (double)nFrames;
+        dLFOPhase -= floor(dLFOPhase);
+    }
+
+private:
+    double Read(double p) const
+    {
+        return ReadWrapped(p - floor(p));
+    }
+
+    // p must be between 0.0 and 1.0
+    double ReadWrapped(double p) const
+    {
+        double dPos = p * (double)nWavetableSize;
+        int i = (int)dPos;
+        double f = dPos - (double)i;
+        i &= nWavetableSize - 1;
+        return pLevel[i] + (pLevel[i + 1] - pLevel[i]) * f;
+    }
+
+    void Advance()
+    {
+        dPhase += dPhaseInc;
+        if (dPhase >= 1.0) dPhase -= 1.0;
+        dLFOPhase += dLFOPhaseInc;
+        if (dLFOPhase >= 1.0) dLFOPhase -= 1.0;
+    }
+
+    // Advance() nFrames times over
+    void Skip(size_t nFrames)
+    {
+        dPhase += dPhaseInc * (double)nFrames;
+        dPhase -= floor(dPhase);
+        dLFOPhase += dLFOPhaseInc * (double)nFrames;
+        dLFOPhase -= floor(dLFOPhase);
+    }
+};